@@ -0,0 +1,331 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+
+#include "async.hpp"
+#include "fs.hpp"
+#include "metrics.hpp"
+
+// Runs a fixed set of workloads against a fresh image and prints one line
+// per workload: throughput, latency percentiles and block I/O counts, as
+// CSV or as one JSON object per line. Every input comes from a fixed seed,
+// so runs of two builds can be compared line by line.
+
+typedef struct
+{
+    bool json = false;
+    bool memory = false;
+    bool direct = false;
+    uint64_t scale = 1;
+    std::string image = "bench.img";
+} BenchOptions;
+
+static const uint64_t LARGE_FILE_SIZE = 16 << 20;
+static const uint64_t SMALL_FILE_SIZE = 4 << 10;
+static const uint64_t READ_SIZE = 4 << 10;
+static const unsigned ASYNC_IO_THREADS = 4;
+
+class Workload
+{
+    std::string name;
+    FileSystem &fs;
+    LatencyHistogram latency;
+    uint64_t operations = 0;
+    uint64_t bytes = 0;
+    uint64_t block_reads;
+    uint64_t block_writes;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    Workload(const std::string &workload_name, FileSystem &target)
+        : name(workload_name), fs(target),
+          block_reads(target.get_metrics().block_reads),
+          block_writes(target.get_metrics().block_writes),
+          start(std::chrono::steady_clock::now())
+    {
+    }
+
+    // Times one operation moving the given number of bytes.
+    void operation(uint64_t moved, const std::function<void()> &body)
+    {
+        {
+            LatencyHistogram::Timer timed(this->latency);
+            body();
+        }
+        ++this->operations;
+        this->bytes += moved;
+    }
+
+    // Counts an operation the caller timed itself, for operations that
+    // overlap each other.
+    void completed(uint64_t moved, uint64_t nanoseconds)
+    {
+        this->latency.record(nanoseconds);
+        ++this->operations;
+        this->bytes += moved;
+    }
+
+    void report(bool json)
+    {
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - this->start)
+                             .count();
+        const Metrics &metrics = this->fs.get_metrics();
+        uint64_t reads = metrics.block_reads - this->block_reads;
+        uint64_t writes = metrics.block_writes - this->block_writes;
+        double per_second = (seconds > 0) ? (this->operations / seconds) : (0);
+        double mib_per_second =
+            (seconds > 0) ? (this->bytes / seconds / (1 << 20)) : (0);
+        std::vector<std::pair<const char *, double>> percentiles = {
+            {"mean", this->latency.mean() / 1000.0},
+            {"p50", this->latency.percentile(0.5) / 1000.0},
+            {"p90", this->latency.percentile(0.9) / 1000.0},
+            {"p99", this->latency.percentile(0.99) / 1000.0},
+            {"p999", this->latency.percentile(0.999) / 1000.0},
+            {"max", this->latency.max() / 1000.0}};
+        std::cout << std::fixed << std::setprecision(3);
+        if (json)
+        {
+            std::cout << "{\"workload\":\"" << this->name
+                      << "\",\"operations\":" << this->operations
+                      << ",\"seconds\":" << seconds
+                      << ",\"ops_per_second\":" << per_second
+                      << ",\"mib_per_second\":" << mib_per_second;
+            for (auto &[label, value] : percentiles)
+                std::cout << ",\"" << label << "_us\":" << value;
+            std::cout << ",\"block_reads\":" << reads
+                      << ",\"block_writes\":" << writes << "}" << std::endl;
+            return;
+        }
+        std::cout << this->name << "," << this->operations << "," << seconds
+                  << "," << per_second << "," << mib_per_second;
+        for (auto &[label, value] : percentiles)
+            std::cout << "," << value;
+        std::cout << "," << reads << "," << writes << std::endl;
+    }
+};
+
+static void write_local_file(const std::string &path, uint64_t size,
+                             std::mt19937_64 &random)
+{
+    std::vector<uint64_t> data((size + 7) / 8);
+    for (uint64_t &word : data)
+        word = random();
+    std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+    stream.write(reinterpret_cast<char *>(data.data()), size);
+}
+
+static Task<void> timed_read(AsyncFileSystem &async, Workload &workload,
+                             FileHandle handle, uint64_t offset, char *data)
+{
+    auto start = std::chrono::steady_clock::now();
+    co_await async.read(handle, offset, data, READ_SIZE);
+    workload.completed(READ_SIZE,
+                       std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count());
+}
+
+static void run(const BenchOptions &options)
+{
+    std::mt19937_64 random(42);
+    const std::string large_local = options.image + ".large";
+    const std::string small_local = options.image + ".small";
+    const std::string extracted = options.image + ".out";
+    write_local_file(large_local, LARGE_FILE_SIZE, random);
+    write_local_file(small_local, SMALL_FILE_SIZE, random);
+
+    const uint64_t large_count = 8 * options.scale;
+    const uint64_t directory_count = 20;
+    const uint64_t small_per_directory = 50 * options.scale;
+    const uint64_t deep_count = 32 * options.scale;
+    const uint64_t deep_depth = 32;
+    const uint64_t wide_count = 500 * options.scale;
+    const uint64_t ls_count = 50;
+    const uint64_t read_count = 4096 * options.scale;
+
+    FormatOptions format;
+    format.block_size = 4096;
+    format.inode_count = 16384 * options.scale;
+    format.in_memory = options.memory;
+    format.direct_io = options.direct;
+    auto fs_pointer = std::make_unique<FileSystem>(
+        options.image, (large_count * LARGE_FILE_SIZE) * 2 + (256 << 20),
+        format);
+    FileSystem &fs = *fs_pointer;
+
+    if (!options.json)
+        std::cout << "workload,operations,seconds,ops_per_second,"
+                     "mib_per_second,mean_us,p50_us,p90_us,p99_us,p999_us,"
+                     "max_us,block_reads,block_writes"
+                  << std::endl;
+
+    fs.mkdir("/seq");
+    {
+        Workload workload("sequential_upload", fs);
+        for (uint64_t i = 0; i < large_count; ++i)
+            workload.operation(LARGE_FILE_SIZE, [&]()
+                               { fs.cplocal(large_local,
+                                            "/seq/f" + std::to_string(i)); });
+        workload.report(options.json);
+    }
+    {
+        Workload workload("sequential_extract", fs);
+        for (uint64_t i = 0; i < large_count; ++i)
+            workload.operation(LARGE_FILE_SIZE, [&]()
+                               { fs.cpvirtual("/seq/f" + std::to_string(i),
+                                              extracted); });
+        workload.report(options.json);
+    }
+
+    for (uint64_t j = 0; j < directory_count; ++j)
+        fs.mkdir("/small/d" + std::to_string(j));
+    auto small_name = [](uint64_t j, uint64_t i)
+    { return "/small/d" + std::to_string(j) + "/f" + std::to_string(i); };
+    {
+        Workload workload("small_create", fs);
+        for (uint64_t i = 0; i < small_per_directory; ++i)
+            for (uint64_t j = 0; j < directory_count; ++j)
+                workload.operation(SMALL_FILE_SIZE, [&]()
+                                   { fs.cplocal(small_local,
+                                                small_name(j, i)); });
+        workload.report(options.json);
+    }
+    {
+        Workload workload("small_rm", fs);
+        for (uint64_t i = 0; i < small_per_directory; ++i)
+            for (uint64_t j = 0; j < directory_count; ++j)
+                workload.operation(0, [&]() { fs.rm(small_name(j, i)); });
+        workload.report(options.json);
+    }
+
+    {
+        Workload workload("deep_mkdir", fs);
+        for (uint64_t i = 0; i < deep_count; ++i)
+        {
+            std::string path = "/deep/b" + std::to_string(i);
+            for (uint64_t level = 1; level <= deep_depth; ++level)
+                path += "/l" + std::to_string(level);
+            workload.operation(0, [&]() { fs.mkdir(path); });
+        }
+        workload.report(options.json);
+    }
+
+    for (uint64_t i = 0; i < wide_count; ++i)
+        fs.mkdir("/wide/e" + std::to_string(i));
+    {
+        Workload workload("large_ls", fs);
+        for (uint64_t i = 0; i < ls_count; ++i)
+            workload.operation(0, [&]() { fs.ls("/wide"); });
+        workload.report(options.json);
+    }
+
+    {
+        Workload workload("random_read", fs);
+        std::vector<char> buffer(READ_SIZE);
+        std::uniform_int_distribution<uint64_t> file(0, large_count - 1);
+        std::uniform_int_distribution<uint64_t> offset(
+            0, LARGE_FILE_SIZE - READ_SIZE);
+        for (uint64_t i = 0; i < read_count; ++i)
+        {
+            std::string name = "/seq/f" + std::to_string(file(random));
+            uint64_t at = offset(random);
+            workload.operation(READ_SIZE, [&]()
+                               { fs.read(name, at, buffer.data(),
+                                         buffer.size()); });
+        }
+        workload.report(options.json);
+    }
+
+    {
+        // the same kind of reads, all of them in flight at once: one event
+        // loop thread issues and completes them while ASYNC_IO_THREADS do
+        // the block I/O
+        Workload workload("async_read", fs);
+        ThreadPoolExecutor io(ASYNC_IO_THREADS);
+        EventLoopExecutor loop;
+        AsyncFileSystem async(fs, io, loop);
+        std::vector<FileHandle> handles;
+        for (uint64_t i = 0; i < large_count; ++i)
+            handles.push_back(fs.open("/seq/f" + std::to_string(i)));
+        std::vector<char> buffers(read_count * READ_SIZE);
+        std::uniform_int_distribution<uint64_t> file(0, large_count - 1);
+        std::uniform_int_distribution<uint64_t> offset(
+            0, LARGE_FILE_SIZE - READ_SIZE);
+        uint64_t pending = read_count;
+        std::exception_ptr failure;
+        for (uint64_t i = 0; i < read_count; ++i)
+        {
+            FileHandle handle = handles[file(random)];
+            uint64_t at = offset(random);
+            spawn(timed_read(async, workload, handle, at,
+                             buffers.data() + i * READ_SIZE),
+                  [&](std::exception_ptr error)
+                  {
+                      if (error)
+                          failure = error;
+                      --pending;
+                  });
+        }
+        while (pending > 0)
+        {
+            pollfd ready = {loop.descriptor(), POLLIN, 0};
+            ::poll(&ready, 1, -1);
+            loop.run_pending();
+        }
+        if (failure)
+            std::rethrow_exception(failure);
+        workload.report(options.json);
+    }
+
+    std::remove(large_local.c_str());
+    std::remove(small_local.c_str());
+    std::remove(extracted.c_str());
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions options;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string argument = argv[i];
+        if (argument == "--json")
+            options.json = true;
+        else if (argument == "--memory")
+            options.memory = true;
+        else if (argument == "--direct")
+            options.direct = true;
+        else if (argument.starts_with("--scale="))
+            options.scale = std::stoull(argument.substr(argument.find('=') + 1));
+        else if (argument.starts_with("--"))
+        {
+            std::cout << "Usage: ./bench.out [--json] [--memory] [--direct] "
+                         "[--scale=<factor>] [<image>]"
+                      << std::endl;
+            return 1;
+        }
+        else
+            options.image = argument;
+    }
+    try
+    {
+        run(options);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    if (!options.memory)
+        std::remove(options.image.c_str());
+    return 0;
+}
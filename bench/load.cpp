@@ -0,0 +1,263 @@
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "client.hpp"
+#include "exceptions.hpp"
+#include "fs.hpp"
+#include "metrics.hpp"
+#include "server.hpp"
+
+// Drives a server with concurrent clients, each keeping a number of 4 KiB
+// reads and writes of one file in flight, and prints one line: throughput
+// and latency percentiles over all clients, as CSV or as a JSON object.
+// Without --socket it serves a fresh in-memory image itself.
+
+typedef struct
+{
+    bool json = false;
+    unsigned clients = 4;
+    unsigned depth = 1;
+    uint64_t requests = 10000;
+    unsigned write_percent = 0;
+    std::string socket_path;
+    std::string image = "load.img";
+} LoadOptions;
+
+static const uint64_t FILE_SIZE = 16 << 20;
+static const uint64_t REQUEST_SIZE = 4 << 10;
+static const std::string FILE_NAME = "/load";
+
+// Runs the requests of one client, slot i of its shared buffer belongs to
+// the i-th request in flight.
+static void run_client(const LoadOptions &options, const std::string &path,
+                       unsigned index, LatencyHistogram &latency)
+{
+    Client client(path, options.depth * REQUEST_SIZE);
+    FileHandle handle = client.open(FILE_NAME);
+    std::mt19937_64 random(42 + index);
+    std::vector<char> pattern(REQUEST_SIZE, static_cast<char>(index));
+    for (unsigned slot = 0; slot < options.depth; ++slot)
+        std::copy(pattern.begin(), pattern.end(),
+                  client.shared_buffer() + slot * REQUEST_SIZE);
+
+    // the responses come in the order of the requests
+    std::deque<std::pair<unsigned, std::chrono::steady_clock::time_point>>
+        in_flight;
+    std::vector<unsigned> free_slots;
+    for (unsigned slot = options.depth; slot > 0; --slot)
+        free_slots.push_back(slot - 1);
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    while (received < options.requests)
+    {
+        while (sent < options.requests && !free_slots.empty())
+        {
+            unsigned slot = free_slots.back();
+            free_slots.pop_back();
+            Request request;
+            bool write = random() % 100 < options.write_percent;
+            request.operation = (write) ? (PROTOCOL_PWRITE) : (PROTOCOL_PREAD);
+            request.flags = PROTOCOL_SHARED;
+            request.numbers = {handle,
+                               random() % (FILE_SIZE / REQUEST_SIZE) *
+                                   REQUEST_SIZE,
+                               REQUEST_SIZE, slot * REQUEST_SIZE};
+            in_flight.emplace_back(slot, std::chrono::steady_clock::now());
+            client.send(request);
+            ++sent;
+        }
+        Response response = client.receive();
+        auto [slot, start] = in_flight.front();
+        in_flight.pop_front();
+        latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count());
+        if (response.status != PROTOCOL_OK)
+            throw RemoteException(response.data);
+        free_slots.push_back(slot);
+        ++received;
+    }
+}
+
+static void report(const LoadOptions &options, LatencyHistogram &latency,
+                   double seconds)
+{
+    uint64_t operations = latency.count();
+    double per_second = (seconds > 0) ? (operations / seconds) : (0);
+    double mib_per_second =
+        (seconds > 0) ? (operations * REQUEST_SIZE / seconds / (1 << 20))
+                      : (0);
+    std::vector<std::pair<const char *, double>> percentiles = {
+        {"mean", latency.mean() / 1000.0},
+        {"p50", latency.percentile(0.5) / 1000.0},
+        {"p90", latency.percentile(0.9) / 1000.0},
+        {"p99", latency.percentile(0.99) / 1000.0},
+        {"p999", latency.percentile(0.999) / 1000.0},
+        {"max", latency.max() / 1000.0}};
+    std::cout << std::fixed << std::setprecision(3);
+    if (options.json)
+    {
+        std::cout << "{\"clients\":" << options.clients
+                  << ",\"depth\":" << options.depth
+                  << ",\"write_percent\":" << options.write_percent
+                  << ",\"operations\":" << operations
+                  << ",\"seconds\":" << seconds
+                  << ",\"ops_per_second\":" << per_second
+                  << ",\"mib_per_second\":" << mib_per_second;
+        for (auto &[label, value] : percentiles)
+            std::cout << ",\"" << label << "_us\":" << value;
+        std::cout << "}" << std::endl;
+        return;
+    }
+    std::cout << "clients,depth,write_percent,operations,seconds,"
+                 "ops_per_second,mib_per_second,mean_us,p50_us,p90_us,"
+                 "p99_us,p999_us,max_us"
+              << std::endl;
+    std::cout << options.clients << "," << options.depth << ","
+              << options.write_percent << "," << operations << "," << seconds
+              << "," << per_second << "," << mib_per_second;
+    for (auto &[label, value] : percentiles)
+        std::cout << "," << value;
+    std::cout << std::endl;
+}
+
+static void run(const LoadOptions &options)
+{
+    std::unique_ptr<FileSystem> fs;
+    std::unique_ptr<Server> server;
+    std::thread serving;
+    std::string path = options.socket_path;
+    if (path.empty())
+    {
+        FormatOptions format;
+        format.block_size = 4096;
+        format.in_memory = true;
+        fs = std::make_unique<FileSystem>(options.image,
+                                          FILE_SIZE * 2 + (64 << 20), format);
+        path = options.image + ".sock";
+        server = std::make_unique<Server>(
+            *fs, path, std::thread::hardware_concurrency(), ".");
+        serving = std::thread([&server]() { server->run(); });
+    }
+
+    // the server reads the file to upload itself, below the directory it
+    // shares
+    const std::string local = options.image + ".data";
+    {
+        std::mt19937_64 random(42);
+        std::vector<uint64_t> data(FILE_SIZE / 8);
+        for (uint64_t &word : data)
+            word = random();
+        std::ofstream stream(local, std::ios::binary | std::ios::trunc);
+        stream.write(reinterpret_cast<char *>(data.data()), FILE_SIZE);
+    }
+    try
+    {
+        Client setup(path);
+        try
+        {
+            setup.rm(FILE_NAME);
+        }
+        catch (const RemoteException &)
+        {
+        }
+        setup.upload(local, FILE_NAME);
+        std::remove(local.c_str());
+
+        LatencyHistogram latency;
+        std::vector<std::thread> clients;
+        std::vector<std::exception_ptr> errors(options.clients);
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < options.clients; ++i)
+            clients.emplace_back(
+                [&, i]()
+                {
+                    try
+                    {
+                        run_client(options, path, i, latency);
+                    }
+                    catch (...)
+                    {
+                        errors[i] = std::current_exception();
+                    }
+                });
+        for (std::thread &client : clients)
+            client.join();
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        for (std::exception_ptr &error : errors)
+            if (error)
+                std::rethrow_exception(error);
+        report(options, latency, seconds);
+    }
+    catch (...)
+    {
+        std::remove(local.c_str());
+        if (server)
+        {
+            server->stop();
+            serving.join();
+        }
+        throw;
+    }
+    if (server)
+    {
+        server->stop();
+        serving.join();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    LoadOptions options;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string argument = argv[i];
+        std::string value = argument.substr(argument.find('=') + 1);
+        if (argument == "--json")
+            options.json = true;
+        else if (argument.starts_with("--clients="))
+            options.clients = std::stoul(value);
+        else if (argument.starts_with("--depth="))
+            options.depth = std::max(1ul, std::stoul(value));
+        else if (argument.starts_with("--requests="))
+            options.requests = std::stoull(value);
+        else if (argument.starts_with("--write="))
+            options.write_percent = std::stoul(value);
+        else if (argument.starts_with("--socket="))
+            options.socket_path = value;
+        else
+        {
+            std::cout << "Usage: ./load.out [--json] [--clients=<count>] "
+                         "[--depth=<requests>] [--requests=<per_client>] "
+                         "[--write=<percent>] [--socket=<path>]"
+                      << std::endl;
+            std::cout << "Without --socket an in-memory image is served "
+                         "at load.img.sock for the run. A server given with "
+                         "--socket has to share the current directory "
+                         "(--serve-root)."
+                      << std::endl;
+            return 1;
+        }
+    }
+    try
+    {
+        run(options);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,369 @@
+#ifndef __ASYNC_HPP__
+#define __ASYNC_HPP__
+
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "fs.hpp"
+
+// Runs the jobs posted to it, on threads of its own choosing.
+class Executor
+{
+public:
+    virtual ~Executor() = default;
+
+    virtual void post(std::function<void()> job) = 0;
+};
+
+// A fixed number of threads taking the jobs in the order they were
+// posted. The jobs still queued when it is destroyed are run first.
+class ThreadPoolExecutor : public Executor
+{
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> jobs;
+    bool stopping = false;
+    std::vector<std::thread> threads;
+
+public:
+    explicit ThreadPoolExecutor(unsigned thread_count);
+
+    ThreadPoolExecutor(const ThreadPoolExecutor &) = delete;
+
+    ~ThreadPoolExecutor() override;
+
+    void post(std::function<void()> job) override;
+};
+
+// Keeps the jobs posted to it until the thread of an event loop runs them
+// with run_pending. Its descriptor (an eventfd) is readable while jobs
+// wait, so the loop can watch it with poll or epoll among its others.
+class EventLoopExecutor : public Executor
+{
+    int event;
+    std::mutex lock;
+    std::vector<std::function<void()>> jobs;
+
+public:
+    EventLoopExecutor();
+
+    EventLoopExecutor(const EventLoopExecutor &) = delete;
+
+    ~EventLoopExecutor() override;
+
+    int descriptor() const;
+
+    void post(std::function<void()> job) override;
+
+    // Runs the jobs posted so far, returns how many there were.
+    size_t run_pending();
+};
+
+template <typename T>
+class Task;
+
+// The part of the promise of a Task that does not depend on its result.
+// A task starts when it is awaited and resumes its awaiter when it ends.
+class TaskPromiseBase
+{
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            return handle.promise().continuation;
+        }
+
+        void await_resume() noexcept {}
+    };
+
+public:
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+class TaskPromise : public TaskPromiseBase
+{
+    std::optional<T> value;
+
+public:
+    Task<T> get_return_object();
+
+    template <typename U>
+    void return_value(U &&result)
+    {
+        value.emplace(std::forward<U>(result));
+    }
+
+    T result()
+    {
+        if (error)
+            std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template <>
+class TaskPromise<void> : public TaskPromiseBase
+{
+public:
+    Task<void> get_return_object();
+
+    void return_void() {}
+
+    void result()
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+// A coroutine returning T to the coroutine awaiting it. It owns its frame
+// and runs nothing until it is awaited, see spawn and sync_wait for
+// starting one from outside a coroutine.
+template <typename T = void>
+class Task
+{
+public:
+    typedef TaskPromise<T> promise_type;
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+public:
+    explicit Task(std::coroutine_handle<promise_type> coroutine)
+        : handle(coroutine)
+    {
+    }
+
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr))
+    {
+    }
+
+    Task(const Task &) = delete;
+
+    ~Task()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+
+    T await_resume() { return handle.promise().result(); }
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object()
+{
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object()
+{
+    return Task<void>(
+        std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// A coroutine nobody waits for, its frame goes away when it ends.
+struct DetachedTask
+{
+    struct promise_type
+    {
+        DetachedTask get_return_object() { return {}; }
+
+        std::suspend_never initial_suspend() noexcept { return {}; }
+
+        std::suspend_never final_suspend() noexcept { return {}; }
+
+        void return_void() {}
+
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// Starts a task on the calling thread, which it leaves at its first
+// suspension. done is called with the exception the task ended with, if
+// any, on the thread that finished it.
+inline DetachedTask spawn(Task<void> task,
+                          std::function<void(std::exception_ptr)> done)
+{
+    std::exception_ptr error;
+    try
+    {
+        co_await task;
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+    if (done)
+        done(error);
+}
+
+// Runs a task and blocks the calling thread until it ends, for callers
+// that are not coroutines themselves.
+template <typename T>
+T sync_wait(Task<T> task)
+{
+    std::mutex lock;
+    std::condition_variable finished;
+    bool done = false;
+    std::exception_ptr error;
+    std::optional<std::conditional_t<std::is_void_v<T>, bool, T>> result;
+    auto body = [&](Task<T> &awaited) -> Task<void>
+    {
+        if constexpr (std::is_void_v<T>)
+            co_await awaited;
+        else
+            result.emplace(co_await awaited);
+    };
+    spawn(body(task),
+          [&](std::exception_ptr failure)
+          {
+              std::lock_guard<std::mutex> guard(lock);
+              error = failure;
+              done = true;
+              finished.notify_all();
+          });
+    std::unique_lock<std::mutex> guard(lock);
+    finished.wait(guard, [&]() { return done; });
+    if (error)
+        std::rethrow_exception(error);
+    if constexpr (!std::is_void_v<T>)
+        return std::move(*result);
+}
+
+// Suspends the awaiting coroutine while a blocking call runs on the io
+// executor and resumes it with the result on the resume executor.
+template <typename T>
+class Offload
+{
+    Executor &io;
+    Executor &resume;
+    std::function<T()> call;
+    std::optional<std::conditional_t<std::is_void_v<T>, bool, T>> result;
+    std::exception_ptr error;
+
+public:
+    Offload(Executor &io_executor, Executor &resume_executor,
+            std::function<T()> job)
+        : io(io_executor), resume(resume_executor), call(std::move(job))
+    {
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        io.post(
+            [this, handle]()
+            {
+                try
+                {
+                    if constexpr (std::is_void_v<T>)
+                    {
+                        call();
+                        result.emplace(true);
+                    }
+                    else
+                        result.emplace(call());
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
+                resume.post([handle]() { handle.resume(); });
+            });
+    }
+
+    T await_resume()
+    {
+        if (error)
+            std::rethrow_exception(error);
+        if constexpr (!std::is_void_v<T>)
+            return std::move(*result);
+    }
+};
+
+// Awaitable calls of a FileSystem for callers that must not block, an
+// event loop above all. The blocking calls run on the io executor and the
+// coroutines continue on the resume executor; many operations in flight
+// share the threads of both. Reads and writes are split into runs of at
+// most RUN_SIZE bytes with a suspension around each, so the calls of other
+// coroutines get the image in between. Only every run is atomic. Calls
+// that run on the io threads at the same time are kept apart by the image
+// itself, like any other callers (see operation_lock in fs.hpp).
+class AsyncFileSystem
+{
+    static constexpr uint64_t RUN_SIZE = 1 << 20;
+
+    FileSystem &fs;
+    Executor &io;
+    Executor &resume;
+
+public:
+    AsyncFileSystem(FileSystem &file_system, Executor &io_executor,
+                    Executor &resume_executor);
+
+    // Any other call of the file system. g++ 12 copies the captures of a
+    // lambda made within a co_await expression wrongly, so the task is
+    // made first:
+    //     auto listed = async.call<std::string>([&]() { return fs.df(); });
+    //     std::string free = co_await listed;
+    template <typename T>
+    Task<T> call(std::function<T()> job)
+    {
+        Offload<T> offload(this->io, this->resume, std::move(job));
+        if constexpr (std::is_void_v<T>)
+            co_await offload;
+        else
+            co_return co_await offload;
+    }
+
+    Task<FileHandle> open(std::string name);
+
+    // The arguments are copied into the tasks, except for the buffers,
+    // which have to stay valid until the task ends.
+    Task<uint64_t> read(FileHandle handle, uint64_t offset, char *data,
+                        uint64_t size);
+
+    Task<void> write(FileHandle handle, uint64_t offset, char *data,
+                     uint64_t size);
+
+    Task<void> mkdir(std::string name);
+
+    Task<void> rm(std::string name);
+
+    Task<std::string> ls(std::string directory);
+};
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef __BLOCK_HASH_HPP__
+#define __BLOCK_HASH_HPP__
+
+#include <cstddef>
+#include <cstdint>
+
+// 64-bit content hash used to find identical blocks. Eight lanes of
+// multiply-accumulate over 64 byte stripes, run with SSE2 on x86-64; the
+// portable path gives the same values, so images stay readable anywhere.
+uint64_t block_hash(const void *data, size_t size);
+
+// Compares both paths with known values. The hashes are kept on disk, a
+// build that computes others must not use them.
+bool block_hash_self_check();
+
+#endif
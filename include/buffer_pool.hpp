@@ -0,0 +1,119 @@
+#ifndef __BUFFER_POOL_HPP__
+#define __BUFFER_POOL_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Page-aligned buffers for block transfers, kept for reuse once they are
+// given back. Direct I/O needs every buffer it is handed to be aligned,
+// reusing them keeps the memory of the process flat. Each thread keeps a
+// few buffers of its own, the rest are shared up to MAX_POOLED_BYTES,
+// anything beyond is returned to the system.
+class BufferPool
+{
+    static const size_t THREAD_CACHE_SIZE = 8;
+    // larger buffers are rare, they are only kept in the shared pool
+    static const size_t MAX_CACHED_SIZE = 64 << 10;
+    static const size_t MAX_POOLED_BYTES = 64 << 20;
+
+    std::mutex lock;
+    std::unordered_map<size_t, std::vector<char *>> free_buffers;
+    size_t pooled_bytes = 0;
+
+    // the buffers a thread gave back last, with their sizes
+    struct ThreadCache
+    {
+        std::vector<std::pair<size_t, char *>> buffers;
+
+        ~ThreadCache();
+    };
+
+    static ThreadCache &thread_cache();
+
+    static size_t rounded(size_t size);
+
+    // keeps a buffer in the shared pool, or frees it when that is full
+    void share(char *buffer, size_t size);
+
+public:
+    static constexpr size_t ALIGNMENT = 4096;
+
+    ~BufferPool();
+
+    static BufferPool &instance();
+
+    char *acquire(size_t size);
+
+    void release(char *buffer, size_t size);
+};
+
+// A buffer of the pool for the length of a scope, its content undefined.
+class PooledBuffer
+{
+    char *buffer;
+    size_t length;
+
+public:
+    explicit PooledBuffer(size_t size)
+        : buffer(BufferPool::instance().acquire(size)), length(size)
+    {
+    }
+
+    PooledBuffer(const PooledBuffer &) = delete;
+
+    ~PooledBuffer() { BufferPool::instance().release(buffer, length); }
+
+    char *data() { return buffer; }
+};
+
+// A zero-filled buffer of the pool owning its memory like a vector of
+// char, for DataBlock. A vector with an allocator of its own would fill
+// its elements one by one.
+class PooledBlock
+{
+    char *buffer = nullptr;
+    size_t length = 0;
+
+public:
+    PooledBlock() = default;
+
+    explicit PooledBlock(size_t size, char fill = 0);
+
+    PooledBlock(const PooledBlock &other);
+
+    PooledBlock(PooledBlock &&other) noexcept;
+
+    PooledBlock &operator=(PooledBlock other) noexcept;
+
+    ~PooledBlock();
+
+    char *data() { return buffer; }
+
+    const char *data() const { return buffer; }
+
+    size_t size() const { return length; }
+
+    bool empty() const { return length == 0; }
+
+    char &operator[](size_t i) { return buffer[i]; }
+
+    const char &operator[](size_t i) const { return buffer[i]; }
+
+    char *begin() { return buffer; }
+
+    char *end() { return buffer + length; }
+
+    const char *begin() const { return buffer; }
+
+    const char *end() const { return buffer + length; }
+
+    bool operator==(const PooledBlock &other) const;
+
+    // Keeps the content up to the new size, what is added is filled.
+    void resize(size_t size, char fill = 0);
+};
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef __CLIENT_HPP__
+#define __CLIENT_HPP__
+
+#include <cstdint>
+#include <string>
+
+#include "fs.hpp"
+#include "protocol.hpp"
+
+// A connection to a Server. Requests can be sent ahead of their responses
+// with send and the responses collected in the same order with receive,
+// or the calls are made one at a time with the named methods, which throw
+// RemoteException when the call failed on the server.
+//
+// With a shared buffer the bulk data of reads and writes goes through
+// memory both processes map instead of through the socket. Data that
+// already is in the buffer is not copied at all.
+class Client
+{
+    int socket = -1;
+    uint32_t next_id = 0;
+    // received bytes that are not a whole response yet
+    std::string input;
+    char *shared = nullptr;
+    uint64_t shared_size = 0;
+
+    Response call(Request &request);
+
+    // The offset of size bytes at data in the shared buffer, or -1 when
+    // they are not all in it.
+    int64_t shared_offset(const char *data, uint64_t size) const;
+
+    // Makes a read call and places its data at data.
+    uint64_t read_into(Request &request, char *data, uint64_t size);
+
+public:
+    // Connects to the server listening at socket_path and attaches a
+    // shared buffer of shared_bytes (0 - none).
+    explicit Client(const std::string &socket_path, uint64_t shared_bytes = 0);
+
+    Client(const Client &) = delete;
+
+    ~Client();
+
+    char *shared_buffer();
+
+    uint64_t shared_buffer_size() const;
+
+    // Sends a request without waiting for its response, gives it the
+    // next id and returns that.
+    uint32_t send(Request &request);
+
+    // The response to the oldest request not answered yet.
+    Response receive();
+
+    FileHandle open(const std::string &name);
+
+    uint64_t read(FileHandle handle, uint64_t offset, char *data,
+                  uint64_t size);
+
+    void write(FileHandle handle, uint64_t offset, const char *data,
+               uint64_t size);
+
+    uint64_t read(const std::string &name, uint64_t offset, char *data,
+                  uint64_t size);
+
+    void mkdir(const std::string &name);
+
+    void rm(const std::string &name);
+
+    void extend(const std::string &name, uint64_t bytes);
+
+    void truncate(const std::string &name, uint64_t bytes);
+
+    std::string ls(const std::string &directory);
+
+    std::string df();
+
+    // The local files are opened by the server, by paths relative to the
+    // directory it shares.
+    void upload(const std::string &local_name,
+                const std::string &virtual_name);
+
+    void extract(const std::string &virtual_name,
+                 const std::string &local_name);
+
+    void reflink(const std::string &source, const std::string &destination);
+
+    std::string snapshot(const std::string &name);
+
+    void set_compression(const std::string &name, bool enabled);
+
+    std::string stats(bool json);
+
+    void sync();
+};
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef __CRC32C_HPP__
+#define __CRC32C_HPP__
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32C (Castagnoli). Uses the SSE4.2 or ARMv8 CRC instructions when the
+// CPU has them and a slicing-by-8 table otherwise. The crc argument allows
+// continuing a previous computation.
+uint32_t crc32c(const void *data, size_t size, uint32_t crc = 0);
+
+#endif
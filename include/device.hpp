@@ -0,0 +1,244 @@
+#ifndef __DEVICE_HPP__
+#define __DEVICE_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/uio.h>
+
+class ThreadPoolExecutor;
+
+// Storage behind an image, addressed by byte offset. Calls may run
+// concurrently, the caller keeps them from overlapping.
+class Device
+{
+public:
+    virtual ~Device() = default;
+
+    // Bytes past the end of the stored data read as zeros.
+    virtual void read(uint64_t offset, char *data, uint64_t size) = 0;
+
+    virtual void write(uint64_t offset, const char *data, uint64_t size) = 0;
+
+    // Sets the size of the image, the new space reads as zeros.
+    virtual void resize(uint64_t size) = 0;
+
+    // Mirrored devices keep several copies of every byte, the others one.
+    virtual uint32_t copy_count() { return 1; }
+
+    // Reads a single copy, for checking and repairing them.
+    virtual void read_copy(uint32_t copy, uint64_t offset, char *data,
+                           uint64_t size);
+
+    // Waits until the written data is on stable storage, memory has
+    // nothing to wait for.
+    virtual void sync() {}
+
+    // Copy between the device and a local file descriptor without the
+    // data passing through a buffer of the caller. Return how many bytes
+    // were copied, the caller moves the rest itself (0 - not supported).
+    virtual uint64_t copy_out(uint64_t, int, uint64_t, uint64_t)
+    {
+        return 0;
+    }
+
+    virtual uint64_t copy_in(int, uint64_t, uint64_t, uint64_t) { return 0; }
+};
+
+// A single backing file, accessed with positional reads and writes. With
+// direct I/O the page cache is bypassed; requests that are not aligned in
+// offset, size and memory go through an aligned buffer of the pool, writes
+// reading the partial sectors at their ends first.
+class FileDevice : public Device
+{
+    // the largest piece an unaligned request is split into
+    static const uint64_t BOUNCE_SIZE = 1 << 20;
+
+    int descriptor;
+    bool direct;
+    // unaligned writes rewrite whole sectors, two must not share one
+    std::mutex unaligned_lock;
+
+    bool aligned(uint64_t offset, const char *data, uint64_t size) const;
+
+    // aligned requests only
+    void read_direct(uint64_t offset, char *data, uint64_t size);
+
+    void read_unaligned(uint64_t offset, char *data, uint64_t size);
+
+    void write_unaligned(uint64_t offset, const char *data, uint64_t size);
+
+public:
+    // create truncates an existing file
+    FileDevice(const std::string &path, bool create, bool direct_io = false);
+
+    ~FileDevice() override;
+
+    void read(uint64_t offset, char *data, uint64_t size) override;
+
+    void write(uint64_t offset, const char *data, uint64_t size) override;
+
+    void resize(uint64_t size) override;
+
+    // Transfers consecutive bytes of the file from or to the scattered
+    // pieces of memory, with as few calls as possible.
+    void transfer(uint64_t offset, std::vector<iovec> &pieces, bool write);
+
+    void sync() override;
+
+    // copy_file_range, or sendfile where the files are on different file
+    // systems of an older kernel
+    uint64_t copy_out(uint64_t offset, int local, uint64_t position,
+                      uint64_t size) override;
+
+    uint64_t copy_in(int local, uint64_t position, uint64_t offset,
+                     uint64_t size) override;
+
+    uint64_t size();
+};
+
+// The image is cut into stripe units dealt round-robin to the backing
+// files: unit k lives in file k % N at offset (k / N) * stripe_unit. A
+// request spanning several files is split into one request per file and
+// those are issued in parallel.
+class StripedDevice : public Device
+{
+    std::vector<std::unique_ptr<FileDevice>> devices;
+    uint64_t stripe_unit;
+    // kept for the life of the device, they take the pieces of a request
+    // that spans several files but the first, which the caller does itself
+    std::unique_ptr<ThreadPoolExecutor> workers;
+
+    void transfer(uint64_t offset, char *data, uint64_t size, bool write);
+
+public:
+    StripedDevice(const std::vector<std::string> &paths, uint64_t unit,
+                  bool create, bool direct_io = false);
+
+    ~StripedDevice() override;
+
+    void read(uint64_t offset, char *data, uint64_t size) override;
+
+    void write(uint64_t offset, const char *data, uint64_t size) override;
+
+    void resize(uint64_t size) override;
+
+    void sync() override;
+};
+
+// RAID-1: every write goes to all backing files, a read to the file with
+// the fewest requests in flight, or split over all of them when it is
+// large. Regions are marked in a dirty bitmap file before their first
+// write. A region is cleared again once every mirror has acknowledged its
+// writes and been synced: on sync, after SETTLED_REGIONS such regions
+// piled up, and on a clean close. After a crash only the marked regions
+// are copied from the first mirror to the others.
+class MirroredDevice : public Device
+{
+    static const uint64_t REGION_SIZE = 1 << 20;
+    // reads at least this long are split over the mirrors
+    static const uint64_t SPLIT_SIZE = 256 << 10;
+    static const size_t SETTLED_REGIONS = 64;
+
+    std::vector<std::unique_ptr<FileDevice>> mirrors;
+    std::vector<std::atomic<uint32_t>> queue_depths;
+    std::atomic<uint32_t> next_mirror{0};
+    // kept for the life of the device, they take the mirrors of a split
+    // request but the first, which the caller does itself
+    std::unique_ptr<ThreadPoolExecutor> workers;
+
+    std::unique_ptr<FileDevice> dirty_file;
+    std::mutex dirty_lock;
+    std::vector<uint8_t> dirty;
+    // writes under way per dirty region, and the dirty regions whose
+    // writes all reached every mirror
+    std::unordered_map<uint64_t, uint32_t> writing;
+    std::set<uint64_t> settled;
+
+    uint32_t pick_mirror();
+
+    void mark_dirty(uint64_t offset, uint64_t size);
+
+    // Ends a write mark_dirty started once every mirror took it, true when
+    // enough regions settled to clear them. A failed write is never ended,
+    // its regions stay dirty for the next open.
+    bool settle(uint64_t offset, uint64_t size);
+
+    // Syncs the mirrors, then clears the regions that had settled before
+    // and were not written again since.
+    void clear_settled();
+
+    void resync();
+
+public:
+    MirroredDevice(const std::vector<std::string> &paths,
+                   const std::string &dirty_path, bool create,
+                   bool direct_io = false);
+
+    ~MirroredDevice() override;
+
+    void read(uint64_t offset, char *data, uint64_t size) override;
+
+    void write(uint64_t offset, const char *data, uint64_t size) override;
+
+    void resize(uint64_t size) override;
+
+    void sync() override;
+
+    // From the least busy mirror. Copying in is left to write, which
+    // marks the regions dirty and reaches every mirror.
+    uint64_t copy_out(uint64_t offset, int local, uint64_t position,
+                      uint64_t size) override;
+
+    uint32_t copy_count() override;
+
+    void read_copy(uint32_t copy, uint64_t offset, char *data,
+                   uint64_t size) override;
+};
+
+// The whole image in one anonymous mapping, on huge pages where the
+// system has them. Nothing reaches a file before dump.
+class MemoryDevice : public Device
+{
+    char *arena = nullptr;
+    uint64_t capacity = 0;
+    uint64_t length = 0;
+
+    void reserve(uint64_t size);
+
+public:
+    MemoryDevice() = default;
+
+    ~MemoryDevice() override;
+
+    void read(uint64_t offset, char *data, uint64_t size) override;
+
+    void write(uint64_t offset, const char *data, uint64_t size) override;
+
+    void resize(uint64_t size) override;
+
+    // straight from or into the mapping
+    uint64_t copy_out(uint64_t offset, int local, uint64_t position,
+                      uint64_t size) override;
+
+    uint64_t copy_in(int local, uint64_t position, uint64_t offset,
+                     uint64_t size) override;
+
+    // Replaces the contents with those of a file.
+    void load(const std::string &path);
+
+    // Writes the contents to a file, which is only replaced once the copy
+    // is complete. Returns the number of bytes written.
+    uint64_t dump(const std::string &path);
+};
+
+// Backing file i of an image: the image itself, then name.1, name.2, ...
+std::string backing_file_name(const std::string &name, uint32_t index);
+
+#endif
@@ -2,6 +2,7 @@
 #define __EXCEPTIONS_HPP__
 
 #include <exception>
+#include <string>
 
 class NoEmptyInodesException : public std::exception
 {
@@ -84,4 +85,235 @@ public:
     }
 };
 
+class InvalidGeometryException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "Unsupported block size or image size.";
+    }
+};
+
+class InvalidImageException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "Not a file system image.";
+    }
+};
+
+class ChecksumMismatchException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "Block checksum mismatch.";
+    }
+};
+
+class CorruptChunkException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "Compressed chunk is corrupted.";
+    }
+};
+
+class BlockSharingDisabledException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "The image was formatted without block sharing.";
+    }
+};
+
+class ReadOnlyException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "The file is read-only.";
+    }
+};
+
+class IncompatibleFeaturesException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "The requested features cannot be combined.";
+    }
+};
+
+class InvalidStreamException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "Not a valid send stream.";
+    }
+};
+
+class SnapshotMismatchException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "The base snapshot does not match the stream.";
+    }
+};
+
+class ChecksumsDisabledException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "The image was formatted without checksums.";
+    }
+};
+
+class LogDisabledException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "The image was formatted without a log.";
+    }
+};
+
+class DeviceException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "A backing file cannot be accessed.";
+    }
+};
+
+class NotInMemoryException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "The image is not held in memory.";
+    }
+};
+
+class InvalidTraceException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "Not a valid trace.";
+    }
+};
+
+class TraceFileException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "The trace file cannot be written.";
+    }
+};
+
+class LocalFileException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "A local file cannot be read or written.";
+    }
+};
+
+class DirectIoException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "The image cannot be opened for direct I/O.";
+    }
+};
+
+class InvalidHandleException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "The handle does not refer to an open file.";
+    }
+};
+
+class InvalidMessageException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "A message of the protocol is malformed.";
+    }
+};
+
+class ConnectionException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "The connection to the server failed.";
+    }
+};
+
+class LocalPathException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "The local path is not inside the directory the server "
+               "shares.";
+    }
+};
+
+class SharedBufferException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "The shared buffer is smaller than claimed or can shrink.";
+    }
+};
+
+class ImageLockedException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "The image is served by another process.";
+    }
+};
+
+class BlockHashException : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return "The block hash of this build does not match the image.";
+    }
+};
+
+// A call the server made failed, with the message of its exception.
+class RemoteException : public std::exception
+{
+    std::string message;
+
+public:
+    explicit RemoteException(std::string text) : message(std::move(text)) {}
+
+    const char *what() const noexcept override
+    {
+        return message.c_str();
+    }
+};
+
 #endif
\ No newline at end of file
@@ -1,24 +1,106 @@
+#ifndef __FS_HPP__
+#define __FS_HPP__
+
 #include <string>
+#include <atomic>
+#include <condition_variable>
 #include <fstream>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "buffer_pool.hpp"
+#include "device.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+class RateLimiter;
+
+// Parameters chosen when formatting a new image.
+struct FormatOptions
+{
+    uint32_t block_size = 4096;
+    // 0 picks one inode per 16 KiB of image
+    uint32_t inode_count = 0;
+    // keep a CRC32C of every block, verified on each read
+    bool checksums = false;
+    // share identical blocks between files
+    bool dedup = false;
+    // allow reflink copies and snapshots sharing blocks between files
+    bool reflink = false;
+    // pack the short last blocks of small files into shared tail blocks
+    bool tail_packing = false;
+    // write changed blocks to the head of a log of segments instead of in
+    // place, a background cleaner reclaims the segments
+    bool log_structured = false;
+    // backing files the image is striped across, in stripe_unit pieces
+    uint32_t stripe_count = 1;
+    uint32_t stripe_unit = 65536;
+    // backing files holding a full copy of the image each
+    uint32_t mirror_count = 1;
+    // keep the image in memory only, the file is written by dump
+    bool in_memory = false;
+    // open the backing files with O_DIRECT, bypassing the page cache
+    bool direct_io = false;
+};
+
+// A file opened by FileSystem::open, its inode number. It stays valid
+// until the file is removed.
+typedef uint32_t FileHandle;
+
 class FileSystem
 {
     typedef uint8_t mask_type;
     static const uint64_t ID = 0x00BEAFEDDEADBEEF;
     static const int MAX_NAME_LENGTH = 256;
-    static const uint16_t MAX_FILE_COUNT = 256;
-    static const int BLOCK_SIZE = 4096;
+    static const uint32_t MIN_FILE_COUNT = 256;
+    static const uint32_t BYTES_PER_INODE = 16384;
+    static const uint32_t MIN_BLOCK_SIZE = 512;
+    static const uint32_t MAX_BLOCK_SIZE = 65536;
     static const int INODE_PRIMARY_TABLE_SIZE = 15;
-    static const int INODE_BLOCK_POINTER_TABLE_SIZE = BLOCK_SIZE / 4;
-    static const int MAX_INODE_BLOCK_COUNT =
-        INODE_PRIMARY_TABLE_SIZE +
-        INODE_BLOCK_POINTER_TABLE_SIZE *
-            (INODE_BLOCK_POINTER_TABLE_SIZE + 1);
+    static const uint32_t FEATURE_CHECKSUMS = 0b1;
+    static const uint32_t FEATURE_DEDUP = 0b10;
+    static const uint32_t FEATURE_REFLINK = 0b100;
+    static const uint32_t FEATURE_TAILS = 0b1000;
+    static const uint32_t FEATURE_LOG = 0b10000;
+    // the blocks start at a multiple of the block size and of a page, set
+    // on every image formatted since
+    static const uint32_t FEATURE_ALIGNED_BLOCKS = 0b100000;
+    // directory holding the snapshots, left out of new snapshots
+    static constexpr const char *SNAPSHOT_DIRECTORY = ".snapshots";
+    // longest run of blocks the scrubber reads at once
+    static const uint32_t SCRUB_RUN_BLOCKS = 64;
+    // logical bytes compressed together by compressed files
+    static const uint32_t COMPRESSION_CHUNK_SIZE = 65536;
+    // bytes of a log segment, the unit the cleaner reclaims
+    static const uint32_t LOG_SEGMENT_SIZE = 1 << 20;
+    // clean segments only the cleaner may open, writers fall back to the
+    // free blocks of used segments instead
+    static const uint32_t CLEANER_RESERVE_SEGMENTS = 2;
+    // the background cleaner starts below this many clean segments and
+    // stops at twice as many
+    static const uint32_t CLEANER_LOW_SEGMENTS = 8;
+    // fuller segments cost more to move than they give back
+    static constexpr double CLEANER_MAX_UTILIZATION = 0.9;
+    // secondary, ternary and quaternary pointer tables
+    static const int INODE_TABLE_LEVELS = 3;
 
     static const mask_type INODE_USED_MASK = 0b10000000;
     static const mask_type INODE_MODE_MASK = 0b01100000;
+    // set on files stored compressed and on directories whose new files
+    // are compressed
+    static const mask_type INODE_COMPRESSED_MASK = 0b00010000;
+    // files and directories of snapshots
+    static const mask_type INODE_READONLY_MASK = 0b00001000;
+    // the last data pointer holds the byte address of a fragment in a
+    // tail block instead of a block of its own
+    static const mask_type INODE_TAIL_MASK = 0b00000100;
 
     enum FILE_TYPE
     {
@@ -29,58 +111,378 @@ class FileSystem
 
     static uint64_t get_current_time();
 
+    // Deduplicated and reflink images keep a reference count per block.
+    bool shares_blocks();
+
     struct
     {
         const uint64_t id = FileSystem::ID;
         int64_t last_modified;
-        uint32_t block_count;
-        uint32_t occupied_count;
-        uint32_t free_count;
-        uint16_t block_size;
-        uint16_t max_file_count;
-        uint16_t file_count;
+        uint64_t block_count;
+        uint64_t occupied_count;
+        uint64_t free_count;
+        uint32_t block_size;
+        uint32_t max_file_count;
+        uint32_t file_count;
+        uint32_t blocks_per_group;
+        uint32_t group_count;
+        uint32_t features;
+        // advanced by every snapshot, stamped on the inodes changed in it
+        uint64_t generation;
+        // backing files of a striped image (1 - a single file)
+        uint32_t stripe_count;
+        uint32_t stripe_unit;
+        // backing files of a mirrored image (1 - a single file)
+        uint32_t mirror_count;
     } superblock;
 
+    typedef struct
+    {
+        uint32_t free_count;
+        uint32_t directory_count;
+    } GroupDescriptor;
+
+    // In-memory state of an allocation group. The bitmap is cached and
+    // written through to the drive, so scans never touch the image.
+    struct AllocationGroup
+    {
+        std::mutex lock;
+        GroupDescriptor descriptor;
+        uint64_t first_block;
+        uint32_t block_count;
+        uint32_t next_free;
+        // loaded from the drive on first use
+        bool bitmap_loaded;
+        std::vector<uint8_t> bitmap;
+    };
+
+    // Group the calling thread last allocated from.
+    static thread_local uint32_t current_group;
+
     typedef struct
     {
         uint64_t creation_time;
         uint64_t last_modified;
+        // superblock generation of the last change, on the root directory
+        // of a snapshot the generation the snapshot was taken in
+        uint64_t generation;
         uint64_t size;
-        uint32_t data_pointers[INODE_PRIMARY_TABLE_SIZE];
-        uint32_t secondary_data_table_block;
-        uint32_t ternary_data_table_block;
+        uint64_t data_pointers[INODE_PRIMARY_TABLE_SIZE];
+        // roots of the pointer trees, table_blocks[i] has depth i + 1
+        uint64_t table_blocks[INODE_TABLE_LEVELS];
         uint16_t reference_count;
         mask_type flags; // UMMSTst0
+        uint32_t group;
     } Inode;
 
+    // page-aligned and reused, see BufferPool
+    typedef PooledBlock DataBlock;
+
+    typedef struct
+    {
+        // 0 - the index is into the direct pointers of the inode
+        uint64_t table;
+        uint64_t index;
+    } PointerSlot;
+
+    // Entry of the block reference table of images sharing blocks. Count
+    // is the number of pointers to the block, hash is its content hash
+    // when the block is in the dedup index and 0 otherwise. Everything
+    // below a shared table is shared with it, so the blocks it points to
+    // count that table once.
+    typedef struct
+    {
+        uint64_t hash;
+        uint64_t count;
+    } BlockReference;
+
+    // Progress of a send stream. A data block shared between files of the
+    // target is sent once, later pointers to it as clones.
     typedef struct
     {
-        char data[BLOCK_SIZE];
-    } DataBlock;
+        uint64_t file_count = 0;
+        uint64_t block_count = 0;
+        uint64_t clone_count = 0;
+        std::unordered_set<uint64_t> sent_blocks;
+    } SendState;
 
+    typedef struct
+    {
+        uint64_t start;
+        uint64_t length;
+        // table blocks among the length blocks
+        uint64_t table_count;
+    } Extent;
+
+    // derived from the superblock when formatting or opening an image
+    uint32_t pointers_per_block;
+    uint32_t pointer_shift;
+    uint64_t max_inode_block_count;
+    // blocks in a compression chunk
+    uint32_t chunk_blocks;
+    // blocks in a log segment and segments in the image
+    uint32_t segment_blocks;
+    uint64_t segment_count;
+
+    unsigned long groups_offset;
     unsigned long inodes_offset;
+    unsigned long inode_bitmap_offset;
     unsigned long bitmap_offset;
+    unsigned long checksums_offset;
+    unsigned long references_offset;
     unsigned long blocks_offset;
 
-    std::unique_ptr<std::fstream> drive;
+    std::string image_name;
+    bool in_memory;
+    bool direct_io;
+    Metrics metrics;
+    std::mutex trace_lock;
+    // set while calls are recorded
+    std::shared_ptr<TraceWriter> trace;
+    std::unique_ptr<Device> drive;
+    std::mutex drive_lock;
+    std::mutex superblock_lock;
+
+    std::vector<std::unique_ptr<AllocationGroup>> groups;
+
+    std::mutex inode_lock;
+    std::vector<uint8_t> inode_bitmap;
+    uint32_t next_free_inode;
+
+    // Entries of recently searched directories by name. A directory is
+    // dropped whenever it is written, add_inode_to_dir keeps it current.
+    static const size_t DIRECTORY_CACHE_SIZE = 4096;
+    std::mutex directory_cache_lock;
+    // counts the writes, see find_entry
+    uint64_t directory_generation = 0;
+    std::unordered_map<uint32_t, std::unordered_map<std::string, uint32_t>>
+        directory_cache;
+
+    // Between begin_batch and end_batch the superblock and the group
+    // descriptors stay in memory and are written once at the end.
+    std::atomic<bool> batching{false};
+    std::mutex batch_lock;
+    bool superblock_dirty = false;
+    std::set<uint32_t> dirty_groups;
+
+    // guards the block reference table and the dedup index
+    std::mutex reference_lock;
+    // content hash -> block holding it
+    std::unordered_map<uint64_t, uint64_t> dedup_index;
+
+    // A tail block starts with the number of bytes in use, followed by
+    // fragments: the owning inode, the length and the data. Fragments stay
+    // packed at the start, removing one moves the ones behind it.
+    static constexpr uint32_t TAIL_HEADER_SIZE = sizeof(uint32_t);
+    static constexpr uint32_t FRAGMENT_HEADER_SIZE = 2 * sizeof(uint32_t);
+    // guards the tail blocks and the index of their free space
+    std::mutex tail_lock;
+    // (free bytes, tail block) of every tail block, for best fit
+    std::set<std::pair<uint32_t, uint64_t>> tail_space;
+    // tail block -> free bytes
+    std::unordered_map<uint64_t, uint32_t> tail_free;
+
+    // The log is written from log_head up to log_end, the end of the
+    // segment it is in; segment_times holds the last write to a segment
+    // since the image was opened, for the age of the cost-benefit policy.
+    std::mutex log_lock;
+    uint64_t log_head = 0;
+    uint64_t log_end = 0;
+    std::vector<uint64_t> segment_times;
+
+    // Held by every public operation, shared by the ones that only read the
+    // image and exclusively by the ones that change it, and exclusively by
+    // the cleaner while it moves blocks. Reads run side by side, changes and
+    // cleaning one at a time.
+    std::shared_mutex operation_lock;
+    std::thread cleaner;
+    std::mutex cleaner_mutex;
+    std::condition_variable cleaner_wakeup;
+    bool cleaner_requested = false;
+    bool cleaner_stop = false;
+
+    enum class Access
+    {
+        READ,
+        CHANGE
+    };
+
+    // Holds operation_lock for the outermost public operation of a thread,
+    // the operations it calls run under the same hold. An operation that
+    // only reads must not call one that changes the image.
+    class CleanerPause
+    {
+        std::shared_lock<std::shared_mutex> shared;
+        std::unique_lock<std::shared_mutex> exclusive;
+        const FileSystem *outer;
+
+    public:
+        CleanerPause(FileSystem &fs, Access access);
+
+        CleanerPause(const CleanerPause &) = delete;
+
+        ~CleanerPause();
+    };
+
+    typedef struct
+    {
+        uint64_t segments;
+        uint64_t blocks;
+    } CleanerResult;
+
+    void compute_geometry();
+
+    // Opens (or creates) the backing files the superblock describes.
+    std::unique_ptr<Device> open_drive(bool create);
+
+    void load_groups();
+
+    void load_group_bitmap(uint32_t group_index);
+
+    void load_inode_bitmap();
+
+    void load_dedup_index();
+
+    void load_tail_index();
+
+    // Opens the log at the next clean segment with all ages reset.
+    void reset_log();
+
+    // Only log-structured images have a cleaner.
+    void start_cleaner();
+
+    void stop_cleaner();
+
+    void run_cleaner();
+
+    CleanerPause pause_cleaner(Access access = Access::CHANGE);
+
+    CallTimer time_call(Metrics::Operation operation,
+                        std::vector<std::string> names = {},
+                        std::vector<uint64_t> numbers = {});
+
+    void write_inode_bitmap(uint32_t index, bool used);
 
     void write_superblock();
 
+    // Writes the superblock and group descriptors a batch held back.
+    void write_deferred_metadata();
+
+    // Marks the superblock modified now and returns the time, for the
+    // inode changed along with it.
+    uint64_t touch_superblock();
+
+    // Both expect drive_lock to be held.
+    void write_checksum(uint64_t index, const char *data);
+
+    void verify_checksum(uint64_t index, const char *data);
+
+    bool heal_block(uint64_t index, char *data);
+
+    // verify_checksum, falling back to the other copies of a mirrored drive
+    void check_block(uint64_t index, char *data);
+
+    BlockReference read_block_reference(uint64_t index);
+
+    void write_block_reference(uint64_t index, const BlockReference &reference);
+
+    void write_group_descriptor(uint32_t group_index);
+
+    uint32_t get_group_index(uint64_t block_index);
+
+    uint32_t choose_directory_group();
+
     void insert_block_data(DataBlock &, char *, int, int); // done
 
-    int get_file_data_block_count(uint64_t);
+    uint64_t get_file_data_block_count(uint64_t);
+
+    uint64_t get_file_data_block_count(const Inode &);
+
+    uint64_t get_file_real_block_count(uint64_t);
+
+    uint64_t get_file_real_block_count(const Inode &);
+
+    uint32_t find_unused_block(AllocationGroup &group, uint32_t goal);
+
+    uint64_t allocate_block(uint64_t goal);
+
+    uint64_t allocate_table_block(uint64_t goal);
+
+    // Marks the given free block as used, false if it is taken.
+    bool claim_block(uint64_t index);
+
+    // Used blocks of every segment, from the group bitmaps.
+    std::vector<uint32_t> read_segment_usage();
+
+    // Next block at the head of the log, 0 when no clean segment is left to
+    // move on to (the reserved ones are only opened for the cleaner).
+    uint64_t allocate_log_block(bool cleaning);
+
+    // Moves the live blocks of up to wanted segments, picked by
+    // cost-benefit, to the head of the log and frees the segments. Takes
+    // operation_lock exclusively, the caller must not be in an operation.
+    CleanerResult clean_segments(uint64_t wanted);
+
+    // Returns the table itself when nobody else references it, a private
+    // copy of it otherwise.
+    uint64_t unshare_table(uint64_t table, uint64_t &goal);
+
+    PointerSlot find_pointer_slot(Inode &inode, uint64_t block,
+                                  uint64_t &goal);
 
-    int get_file_data_block_count(const Inode &);
+    uint64_t allocate_data_block(Inode &inode, uint64_t block,
+                                 uint64_t &goal);
 
-    int get_file_real_block_count(uint64_t);
+    // Like allocate_data_block, but a block shared with other files is
+    // replaced by a copy first (with its content when keep_content is set),
+    // so the result may be written in place.
+    uint64_t private_data_block(Inode &inode, uint64_t block, uint64_t &goal,
+                                bool keep_content);
 
-    int get_file_real_block_count(const Inode &);
+    // Points the logical block at target, creating missing tables, and
+    // returns the block it pointed at before (0 - none).
+    uint64_t map_data_block(Inode &inode, uint64_t block, uint64_t target,
+                            uint64_t &goal);
 
-    uint32_t find_unused_block(); // done
+    uint64_t release_tree(uint64_t root, int depth, uint64_t keep,
+                          uint64_t count);
 
-    uint32_t allocate_block(); // done
+    // Releases all data blocks past the first keep ones and the tables
+    // that no longer map anything.
+    void release_file_blocks(Inode &inode, uint64_t keep);
 
-    void release_block(uint32_t index); // done
+    // Visits every data and table block of the inode in logical order,
+    // each table before the blocks it points to.
+    void walk_file_blocks(
+        const Inode &inode,
+        const std::function<void(uint64_t block, bool table)> &visit);
+
+    // Contiguous runs of the data and table blocks in logical order.
+    std::vector<Extent> get_file_extents(const Inode &inode);
+
+    // First block of a free run of the given length, searched from the
+    // preferred group onwards, 0 if there is none.
+    uint64_t find_free_run(uint64_t length, uint32_t preferred_group);
+
+    // Copies the file into a single free run and switches the inode over,
+    // false if no run is free or the file changed during the copy.
+    bool defrag_file(uint32_t index, RateLimiter &limiter);
+
+    uint64_t get_data_block_pointer(const Inode &inode, uint64_t block);
+
+    template <typename Geometry>
+    uint64_t get_data_block_pointer(const Geometry &geometry,
+                                    const Inode &inode, uint64_t block);
+
+    template <typename Geometry>
+    void write_file_blocks(const Geometry &geometry, int index, char *data,
+                           uint64_t size, uint64_t pos);
+
+    template <typename Geometry>
+    void read_file_blocks(const Geometry &geometry, int index, char *dest,
+                          uint64_t size, uint64_t pos);
+
+    void release_block(uint64_t index); // done
 
     void resize_file(int index, uint64_t size); // done :)))))))))
 
@@ -89,6 +491,58 @@ class FileSystem
 
     void read_file(int index, char *dest, uint64_t size, uint64_t pos); // done
 
+    // Copy a whole file to or from a local file descriptor, see copy.cpp.
+    void copy_file_out(int index, const Inode &inode, int local);
+
+    void copy_file_in(int index, int local, uint64_t size);
+
+    // write_file of deduplicated images, every written block is looked up
+    // in the dedup index and shared blocks are copied before modification
+    void write_file_dedup(int index, char *data, uint64_t size, uint64_t pos);
+
+    // write_file of log-structured images, every written block is stored
+    // whole at the head of the log and the old one is released
+    void write_file_log(int index, char *data, uint64_t size, uint64_t pos);
+
+    bool is_chunk_compressed(const Inode &inode, uint64_t chunk,
+                             uint64_t length);
+
+    // Reads length bytes of a chunk, decompressing them when needed.
+    void load_chunk(const Inode &inode, uint64_t chunk, uint64_t length,
+                    char *dest);
+
+    // Stores the chunk compressed when that saves a block, blocks mapped
+    // by the file up to old_block_count are reused or released.
+    void store_chunk(Inode &inode, uint64_t chunk, const char *data,
+                     uint64_t length, uint64_t old_block_count,
+                     uint64_t &goal);
+
+    void read_compressed_file(const Inode &inode, char *dest, uint64_t size,
+                              uint64_t pos);
+
+    // A null data writes zeros.
+    void write_compressed_file(int index, Inode &inode, const char *data,
+                               uint64_t size, uint64_t pos);
+
+    void resize_compressed_file(int index, Inode &inode, uint64_t new_size);
+
+    // Moves the last block of a small file into a fragment when it is short
+    // enough, the inode is read and written back.
+    void pack_tail(uint32_t index);
+
+    // Gives the fragment of a packed inode a block of its own again, only
+    // the inode in memory is updated.
+    void unpack_tail(Inode &inode);
+
+    // Removes the fragment at the byte address from its tail block,
+    // releasing the block when it becomes empty.
+    void remove_fragment(uint64_t address);
+
+    // Stores the new content of a logical block whose current block is
+    // current (0 - none yet).
+    void store_data_block(Inode &inode, uint64_t block, uint64_t current,
+                          DataBlock &content, uint64_t &goal);
+
     void write_inode(int, Inode &); // done
 
     Inode read_inode(int index); // done
@@ -97,27 +551,33 @@ class FileSystem
 
     void write_block(uint64_t index, DataBlock &block); // done
 
-    DataBlock read_block(int index); // done
+    DataBlock read_block(uint64_t index); // done
+
+    // Count consecutive blocks moved with a single request to the drive.
+    void read_blocks(uint64_t first, uint64_t count, char *dest);
+
+    void write_blocks(uint64_t first, uint64_t count, const char *data);
 
     void read_from_block(DataBlock &block, char *dest, int size,
                          int pos); // done, working :)
 
-    void read_from_block(int index, char *dest, int size, int pos); // done
+    void read_from_block(uint64_t index, char *dest, int size,
+                         int pos); // done
 
-    void write_table_block_pointer(const int &table_block_index,
-                                   const int &pointer_index,
-                                   uint32_t pointer_value); // git gud
+    void write_table_block_pointer(const uint64_t &table_block_index,
+                                   const uint64_t &pointer_index,
+                                   uint64_t pointer_value); // git gud
 
-    uint64_t read_table_block_pointer(const int &table_block_index,
-                                      const int &pointer_index); // git gud
+    uint64_t read_table_block_pointer(const uint64_t &table_block_index,
+                                      const uint64_t &pointer_index); // git gud
 
-    void write_bitmap(int, const bool &); // done
+    void write_bitmap(uint64_t, const bool &); // done
 
-    bool read_bitmap(const int &); // done
+    bool read_bitmap(const uint64_t &); // done
 
     void init_inodes(); // git gud
 
-    void init_bitmap(); // git gud
+    void init_groups();
 
     void init_blocks(); // git gud
 
@@ -137,8 +597,47 @@ class FileSystem
     uint32_t
     get_dir_inode(const int &dir_index, const std::string &name); // done
 
+    bool find_entry(uint32_t dir_index, const std::string &name,
+                    uint32_t &child);
+
+    void forget_directory(uint32_t index);
+
     uint32_t find_file_in_dir(const std::string &name); // done
 
+    // Names and inodes of the entries of a directory, in order.
+    std::vector<std::pair<std::string, uint32_t>>
+    read_directory(uint32_t index);
+
+    // Adds a reference to every block the inode points at directly.
+    void share_tree(const Inode &inode);
+
+    // Makes destination a copy of source sharing all of its blocks.
+    void clone_inode(uint32_t source, uint32_t destination);
+
+    // Fills the existing directory path with clones of everything below
+    // the source directory, /.snapshots excluded.
+    void clone_tree(uint32_t source, const std::string &path,
+                    uint64_t &file_count, uint64_t &directory_count);
+
+    // Marks the inode and everything below it read-only.
+    void seal_tree(uint32_t index);
+
+    // Writes the records turning the base subtree of the given depth into
+    // the target one, subtrees both point at are skipped. Data blocks are
+    // sent whole the first time and as clones after, a missing one as a
+    // hole.
+    void send_tree(std::ostream &stream, uint64_t target, uint64_t base,
+                   int depth, uint64_t first_block, uint64_t count,
+                   SendState &state);
+
+    // Sends the changes of a file against the base file at the same path
+    // (nullptr - none), or nothing when both share all of their blocks.
+    bool send_file(std::ostream &stream, const std::string &path,
+                   const Inode &target, const Inode *base, SendState &state);
+
+    void send_directory(std::ostream &stream, const std::string &path,
+                        uint32_t target, int64_t base, SendState &state);
+
     void
     create_link(const std::string &link_name, const std::string &linked_name);
 
@@ -147,10 +646,27 @@ class FileSystem
 
     void create_file(const std::string &name, FILE_TYPE type);
 
+    // Creates an entry in a directory known by its inode, returns the
+    // inode of the new file.
+    uint32_t create_file(const std::string &name, uint32_t parent_index,
+                         FILE_TYPE type);
+
     int find_unused_inode(); // git gud
 
+    void release_inode(int index);
+
+    // The inode of an open file, throws unless the handle is one.
+    Inode read_handle(FileHandle handle);
+
 public:
-    FileSystem(const std::string &, const int &);
+    FileSystem(const std::string &file_name, uint64_t bytes,
+               const FormatOptions &options = FormatOptions());
+
+    // opens an existing image, geometry is read from its superblock; with
+    // memory_only the image is loaded into memory and only written back
+    // by dump, with direct the backing files are opened with O_DIRECT
+    explicit FileSystem(const std::string &file_name,
+                        bool memory_only = false, bool direct = false);
 
     virtual ~FileSystem();
 
@@ -162,6 +678,20 @@ public:
     void
     cpvirtual(const std::string &virtual_name, const std::string &local_name);
 
+    // Reads up to size bytes of a file starting at offset, returns how
+    // many there were.
+    uint64_t read(const std::string &name, uint64_t offset, char *data,
+                  uint64_t size);
+
+    // Looks a file up once for the calls that take a handle.
+    FileHandle open(const std::string &name);
+
+    uint64_t read(FileHandle handle, uint64_t offset, char *data,
+                  uint64_t size);
+
+    // Writes size bytes at offset, a write past the end extends the file.
+    void write(FileHandle handle, uint64_t offset, char *data, uint64_t size);
+
     void mkdir(const std::string &name);
 
     //    void rmdir(const std::string &dir_name);
@@ -170,11 +700,110 @@ public:
 
     void link(const std::string &file_name, const std::string &link_name);
 
-    void extend(const std::string &name, int bytes); // done
+    void extend(const std::string &name, uint64_t bytes); // done
 
-    void truncate(const std::string &name, int bytes); // done
+    void truncate(const std::string &name, uint64_t bytes); // done
 
     std::string ls(const std::string &directory); // done
 
     std::string df(); // done
-};
\ No newline at end of file
+
+    // Verifies the checksum of every allocated block using the given
+    // number of threads, reading at most bytes_per_second (0 - no limit).
+    std::string scrub(unsigned thread_count, uint64_t bytes_per_second);
+
+    // Rebuilds the block bitmap, inode bitmap and reference counts from
+    // the inodes and directories and compares them with the image. With
+    // repair the image is corrected to match.
+    std::string fsck(unsigned thread_count, bool repair);
+
+    // Moves every fragmented file into one contiguous run while the file
+    // system stays usable, copying at most bytes_per_second (0 - no
+    // limit). Reports the fragmentation before and after.
+    std::string defrag(uint64_t bytes_per_second);
+
+    // Reports the physical layout of a file, or of every file below a
+    // directory: extents, table blocks, average run length and a score
+    // (100 - fully contiguous).
+    std::string filefrag(const std::string &path);
+
+    // Copies a file in O(metadata): the copy shares all data blocks and
+    // pointer tables with the original until either is modified.
+    void reflink(const std::string &source, const std::string &destination);
+
+    // Creates a read-only snapshot of the whole tree in /.snapshots/name,
+    // sharing every file with the live tree.
+    std::string snapshot(const std::string &name);
+
+    // Writes the difference between the base snapshot (empty - none, a
+    // full stream) and the snapshot name to a local file. Unchanged files
+    // and subtrees are recognised by the blocks the snapshots share, no
+    // data is compared.
+    std::string send(const std::string &name, const std::string &local_name,
+                     const std::string &base);
+
+    // Applies a stream made by send, creating the snapshot it describes on
+    // top of the base snapshot of the same name and generation.
+    std::string receive(const std::string &local_name);
+
+    // Turns compression of a file on or off, rewriting its data. On a
+    // directory it applies to the files created in it later.
+    void set_compression(const std::string &name, bool enabled);
+
+    // Runs the segment cleaner of a log-structured image over up to
+    // wanted segments now, without waiting for space to run low.
+    std::string clean(uint64_t wanted);
+
+    // Writes an image held in memory to a file (empty - the file it was
+    // formatted as or loaded from).
+    std::string dump(const std::string &local_name);
+
+    // Counters of the block, bitmap, inode and directory accesses and the
+    // latencies of block requests and operations since the image was
+    // opened, as text or as a JSON object.
+    std::string stats(bool json);
+
+    const Metrics &get_metrics() const;
+
+    // The file the image was formatted as or opened from.
+    const std::string &get_image_name() const;
+
+    // Records every public call with its arguments and timing to a local
+    // file until trace_stop.
+    std::string trace_start(const std::string &local_name);
+
+    std::string trace_stop();
+
+    // Runs the calls of a trace again, as fast as possible or at their
+    // recorded times. Several replayers run the trace concurrently, each in
+    // a directory /replay<n> of its own and with snapshots named
+    // <name>.replay<n>.
+    std::string replay(const std::string &local_name, bool timed,
+                       unsigned replayers);
+
+    // Copies a local directory tree into a virtual directory, created
+    // with its parents if missing. The directories and inodes are made by
+    // one thread, the file contents are written by thread_count threads.
+    // Entries other than files and directories are skipped.
+    std::string import_tree(const std::string &local_dir,
+                            const std::string &virtual_dir,
+                            unsigned thread_count);
+
+    // Copies a virtual directory tree into a local directory. The files
+    // are read by thread_count threads in the order of their first block.
+    std::string export_tree(const std::string &virtual_dir,
+                            const std::string &local_dir,
+                            unsigned thread_count);
+
+    // Holds the superblock and group descriptor writes of the following
+    // calls back until end_batch, which writes them once and syncs.
+    void begin_batch();
+
+    void end_batch();
+
+    // Writes any held back metadata and waits until the image is on
+    // stable storage.
+    void sync();
+};
+
+#endif
\ No newline at end of file
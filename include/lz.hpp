@@ -0,0 +1,20 @@
+#ifndef __LZ_HPP__
+#define __LZ_HPP__
+
+#include <cstddef>
+#include <cstdint>
+
+// Byte oriented LZ77 codec using the LZ4 sequence layout: a token with the
+// literal and match lengths, the literals, a 16-bit match offset. Built for
+// speed over ratio.
+
+// Returns the compressed size, 0 when the result does not fit capacity.
+size_t lz_compress(const void *source, size_t size, void *destination,
+                   size_t capacity);
+
+// False when the input is corrupted or does not expand to exactly
+// destination_size bytes.
+bool lz_decompress(const void *source, size_t size, void *destination,
+                   size_t destination_size);
+
+#endif
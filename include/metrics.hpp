@@ -0,0 +1,140 @@
+#ifndef __METRICS_HPP__
+#define __METRICS_HPP__
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Latency histogram in the manner of HdrHistogram: every power of two
+// range of nanoseconds is split into 16 linear buckets, so a value is
+// known to within 1/16. Recording costs a few relaxed atomic increments.
+class LatencyHistogram
+{
+    static const int SUB_BUCKET_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    // 2^40 ns is about 18 minutes, longer samples land in the last bucket
+    static const int MAX_BITS = 40;
+    static const int BUCKET_COUNT =
+        (MAX_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    std::array<std::atomic<uint64_t>, BUCKET_COUNT> buckets{};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> maximum{0};
+
+    static int bucket_of(uint64_t value);
+
+    // the largest value counted in a bucket
+    static uint64_t bucket_top(int bucket);
+
+public:
+    // Records the time from its construction to its destruction, unless
+    // it is not sampled.
+    class Timer
+    {
+        LatencyHistogram *histogram;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        explicit Timer(LatencyHistogram &target, bool sampled = true)
+            : histogram((sampled) ? (&target) : (nullptr))
+        {
+            if (histogram != nullptr)
+                start = std::chrono::steady_clock::now();
+        }
+
+        Timer(const Timer &) = delete;
+
+        ~Timer()
+        {
+            if (histogram == nullptr)
+                return;
+            histogram->record(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start)
+                    .count());
+        }
+    };
+
+    void record(uint64_t nanoseconds);
+
+    uint64_t count() const;
+
+    uint64_t mean() const;
+
+    uint64_t max() const;
+
+    // The value at or below which the fraction of the samples lies.
+    uint64_t percentile(double fraction) const;
+};
+
+// Counters and latencies of a file system, cheap enough to stay on.
+class Metrics
+{
+    static const uint32_t BLOCK_SAMPLE_RATE = 16;
+
+public:
+    enum Operation
+    {
+        UPLOAD,
+        EXTRACT,
+        READ,
+        MKDIR,
+        RM,
+        EXTEND,
+        TRUNCATE,
+        LS,
+        DF,
+        SCRUB,
+        FSCK,
+        DEFRAG,
+        FILEFRAG,
+        REFLINK,
+        SNAPSHOT,
+        SEND,
+        RECEIVE,
+        SET_COMPRESSION,
+        CLEAN,
+        DUMP,
+        IMPORT,
+        EXPORT,
+        OPEN,
+        PREAD,
+        PWRITE,
+        OPERATION_COUNT
+    };
+
+    // all block I/O moves whole blocks, the bytes follow from the counts
+    std::atomic<uint64_t> block_reads{0};
+    std::atomic<uint64_t> block_writes{0};
+    std::atomic<uint64_t> bitmap_probes{0};
+    std::atomic<uint64_t> inode_reads{0};
+    std::atomic<uint64_t> directory_lookups{0};
+    std::atomic<uint64_t> directory_entries_scanned{0};
+
+    // one per device request, which may cover several blocks
+    LatencyHistogram block_read_latency;
+    LatencyHistogram block_write_latency;
+    std::array<LatencyHistogram, OPERATION_COUNT> operation_latency;
+
+    // Block requests are too frequent to read the clock twice for each,
+    // every BLOCK_SAMPLE_RATE-th of a thread is timed. The counters stay
+    // exact.
+    LatencyHistogram::Timer time_block(LatencyHistogram &histogram)
+    {
+        static thread_local uint32_t tick = 0;
+        return LatencyHistogram::Timer(histogram,
+                                       ++tick % BLOCK_SAMPLE_RATE == 0);
+    }
+
+    // Counters and the latencies of the operations that ran, in
+    // microseconds.
+    std::string report(uint32_t block_size) const;
+
+    // Everything as one JSON object, latencies in nanoseconds.
+    std::string json(uint32_t block_size) const;
+};
+
+#endif
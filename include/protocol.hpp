@@ -0,0 +1,99 @@
+#ifndef __PROTOCOL_HPP__
+#define __PROTOCOL_HPP__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// The messages between a Server and its Clients over a Unix domain socket.
+// Each message is its length as 4 bytes in host order followed by that
+// many bytes. Integers in the message are LEB128 varints as in a trace,
+// strings are a length and the bytes.
+//
+// A request is its id, the operation, flags, the numbers, the names and
+// the data. The id is chosen by the client and comes back in the
+// response, so requests can be sent without waiting for the answers to
+// the earlier ones. The requests of one connection run in the order they
+// were sent.
+//
+// A response is the id, a status, a number (a handle, a byte count) and
+// the data: the text of a report, the bytes read or the message of the
+// exception the call failed with.
+
+enum ProtocolOperation : uint8_t
+{
+    // numbers: size of the shared buffer; its memfd comes along as
+    // SCM_RIGHTS, at least that large and sealed with F_SEAL_SHRINK
+    PROTOCOL_ATTACH,
+    // names: path; number of the response: the handle
+    PROTOCOL_OPEN,
+    // numbers: handle, offset, size[, offset in the shared buffer]
+    PROTOCOL_PREAD,
+    PROTOCOL_PWRITE,
+    // names: path; numbers: offset, size[, offset in the shared buffer]
+    PROTOCOL_READ,
+    PROTOCOL_MKDIR,
+    PROTOCOL_RM,
+    // names: path; numbers: bytes
+    PROTOCOL_EXTEND,
+    PROTOCOL_TRUNCATE,
+    PROTOCOL_LS,
+    PROTOCOL_DF,
+    // names: local path, virtual path (upload), virtual, local (extract);
+    // the local path is relative to the directory the server shares
+    PROTOCOL_UPLOAD,
+    PROTOCOL_EXTRACT,
+    PROTOCOL_REFLINK,
+    PROTOCOL_SNAPSHOT,
+    // names: path; numbers: enabled
+    PROTOCOL_SET_COMPRESSION,
+    // numbers: json
+    PROTOCOL_STATS,
+    PROTOCOL_SYNC,
+    PROTOCOL_OPERATION_COUNT
+};
+
+// The bulk data of a pread, pwrite or read is in the shared buffer of the
+// connection instead of in the message.
+static const uint8_t PROTOCOL_SHARED = 0b1;
+
+enum ProtocolStatus : uint8_t
+{
+    PROTOCOL_OK,
+    PROTOCOL_FAILED
+};
+
+typedef struct
+{
+    uint32_t id = 0;
+    uint8_t operation = 0;
+    uint8_t flags = 0;
+    std::vector<uint64_t> numbers;
+    std::vector<std::string> names;
+    std::string data;
+} Request;
+
+typedef struct
+{
+    uint32_t id = 0;
+    uint8_t status = PROTOCOL_OK;
+    uint64_t number = 0;
+    std::string data;
+} Response;
+
+// The longest message either side accepts.
+static const uint32_t PROTOCOL_MAX_MESSAGE = 64 << 20;
+
+// Appends a message to out.
+void encode_request(const Request &request, std::string &out);
+
+void encode_response(const Response &response, std::string &out);
+
+// Takes the first message of size bytes at data if it is complete,
+// returns how many bytes it had (0 - incomplete). Malformed messages
+// throw InvalidMessageException.
+size_t decode_request(const char *data, size_t size, Request &request);
+
+size_t decode_response(const char *data, size_t size, Response &response);
+
+#endif
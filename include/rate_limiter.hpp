@@ -0,0 +1,40 @@
+#ifndef __RATE_LIMITER_HPP__
+#define __RATE_LIMITER_HPP__
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+// Spreads I/O of any number of threads evenly over time so that on
+// average at most bytes_per_second are transferred. Zero disables it.
+class RateLimiter
+{
+    typedef std::chrono::steady_clock clock;
+
+    uint64_t bytes_per_second;
+    uint64_t issued = 0;
+    clock::time_point start = clock::now();
+    std::mutex lock;
+
+public:
+    explicit RateLimiter(uint64_t rate) : bytes_per_second(rate) {}
+
+    void acquire(uint64_t bytes)
+    {
+        if (bytes_per_second == 0)
+            return;
+        clock::time_point due;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            due = start + std::chrono::duration_cast<clock::duration>(
+                              std::chrono::duration<double>(
+                                  static_cast<double>(issued) /
+                                  bytes_per_second));
+            issued += bytes;
+        }
+        std::this_thread::sleep_until(due);
+    }
+};
+
+#endif
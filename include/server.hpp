@@ -0,0 +1,105 @@
+#ifndef __SERVER_HPP__
+#define __SERVER_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "async.hpp"
+#include "fs.hpp"
+#include "protocol.hpp"
+
+// Serves a file system to the processes of the host over a Unix domain
+// socket, see protocol.hpp. One thread runs an epoll loop over the
+// listening socket and the connections, parsing requests and sending
+// responses; the calls themselves run on a pool of workers. The requests
+// of one connection run one after another in the order they came, those of
+// different connections side by side as far as the image lets them: calls
+// that only read share it, a call that changes it runs alone (see
+// operation_lock in fs.hpp). While the server runs it holds an
+// flock on the image, so a second server of it fails. Uploads and extracts
+// only reach local files below the root directory the server is given and
+// are refused without one.
+class Server
+{
+    static const int MAX_EVENTS = 64;
+    static const size_t RECEIVE_SIZE = 64 << 10;
+    // a connection is not read from while it has this many requests
+    // waiting or this many response bytes unsent, until the client catches up
+    static const size_t MAX_PENDING = 256;
+    static const size_t MAX_OUTPUT = 4 << 20;
+
+    typedef struct
+    {
+        int socket;
+        // received bytes that are not a whole request yet, and responses
+        // not sent yet
+        std::string input;
+        std::string output;
+        std::deque<Request> pending;
+        // a request of the connection is with the workers
+        bool running = false;
+        // the peer hung up or broke the protocol, what it sent before
+        // still runs
+        bool closing = false;
+        bool watched = false;
+        // a descriptor that came along with the bytes, for an attach
+        int received = -1;
+        char *shared = nullptr;
+        uint64_t shared_size = 0;
+    } Connection;
+
+    FileSystem &fs;
+    std::string socket_path;
+    // canonical, empty - no local files are served
+    std::string local_root;
+    int image_lock = -1;
+    int listener = -1;
+    int poller = -1;
+    int wake = -1;
+    std::atomic<bool> stopping{false};
+    std::unique_ptr<ThreadPoolExecutor> workers;
+    EventLoopExecutor completions;
+    // keyed by ids that are never reused, a completion can safely miss
+    std::unordered_map<uint64_t, Connection> connections;
+    uint64_t next_connection;
+
+    static bool backed_up(const Connection &connection);
+
+    void accept_clients();
+
+    void receive(uint64_t id);
+
+    // Hands the next request of an idle connection to the workers.
+    void start_next(uint64_t id);
+
+    void attach(Connection &connection, const Request &request,
+                Response &response);
+
+    void finish(uint64_t id, const Response &response);
+
+    // Sends what the socket takes, starts the next request when there is
+    // room for its response and closes a connection that is done.
+    void flush(uint64_t id);
+
+    void close_connection(uint64_t id);
+
+public:
+    Server(FileSystem &file_system, const std::string &path,
+           unsigned thread_count, const std::string &root = "");
+
+    Server(const Server &) = delete;
+
+    ~Server();
+
+    // Serves until stop is called.
+    void run();
+
+    // Safe to call from any thread and from a signal handler.
+    void stop();
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef __TRACE_HPP__
+#define __TRACE_HPP__
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "metrics.hpp"
+
+// One public call of a file system: the operation (a Metrics::Operation),
+// its start in nanoseconds since the trace began, how long it ran and its
+// arguments - paths and names, then sizes, offsets and flags.
+typedef struct
+{
+    uint8_t operation;
+    uint64_t start;
+    uint64_t duration;
+    std::vector<std::string> names;
+    std::vector<uint64_t> numbers;
+} TraceRecord;
+
+// A trace file is a magic number followed by the records in the order the
+// calls returned. All integers are LEB128 varints, the start is stored as
+// a zigzag delta to the previous record, strings as length and bytes.
+class TraceWriter
+{
+    std::ofstream stream;
+    std::mutex lock;
+    std::chrono::steady_clock::time_point origin;
+    uint64_t previous_start = 0;
+    uint64_t count = 0;
+
+    void put(uint64_t value);
+
+public:
+    explicit TraceWriter(const std::string &path);
+
+    // nanoseconds since the trace began
+    uint64_t now() const;
+
+    void append(const TraceRecord &record);
+
+    uint64_t record_count();
+};
+
+class TraceReader
+{
+    std::ifstream stream;
+    uint64_t previous_start = 0;
+
+    uint64_t get();
+
+public:
+    explicit TraceReader(const std::string &path);
+
+    // false at the end of the trace
+    bool next(TraceRecord &record);
+};
+
+// Times a public call for the metrics and, while a trace is recorded,
+// appends the call to it once it returns.
+class CallTimer
+{
+    LatencyHistogram::Timer timed;
+    std::shared_ptr<TraceWriter> trace;
+    TraceRecord record;
+
+public:
+    CallTimer(LatencyHistogram &histogram, std::shared_ptr<TraceWriter> writer,
+              Metrics::Operation operation, std::vector<std::string> names,
+              std::vector<uint64_t> numbers);
+
+    CallTimer(const CallTimer &) = delete;
+
+    ~CallTimer();
+
+    // An argument only known once the call is under way, like the size of
+    // an uploaded file.
+    void add_number(uint64_t number);
+};
+
+#endif
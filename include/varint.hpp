@@ -0,0 +1,41 @@
+#ifndef __VARINT_HPP__
+#define __VARINT_HPP__
+
+#include <cstdint>
+
+// LEB128 integers, seven bits per byte with the low bits first and the
+// high bit set on every byte but the last. Used by traces and the server
+// protocol.
+static const int VARINT_MAX_BYTES = 10;
+
+// Writes value to bytes (at least VARINT_MAX_BYTES), returns the length.
+inline int encode_varint(uint64_t value, char *bytes)
+{
+    int length = 0;
+    do
+    {
+        bytes[length++] = (value & 0x7F) | ((value >= 0x80) ? (0x80) : (0));
+        value >>= 7;
+    } while (value != 0);
+    return length;
+}
+
+// Reads a value from next_byte, which returns the next byte or -1 at the
+// end. False when the input ends early or the value is longer than 64 bits.
+template <typename NextByte>
+bool decode_varint(NextByte next_byte, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int byte = next_byte();
+        if (byte < 0)
+            return false;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,158 @@
+#include <algorithm>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "async.hpp"
+#include "exceptions.hpp"
+
+ThreadPoolExecutor::ThreadPoolExecutor(unsigned thread_count)
+{
+    auto worker = [this]()
+    {
+        std::unique_lock<std::mutex> guard(this->lock);
+        while (true)
+        {
+            this->wake.wait(guard, [this]()
+                            { return this->stopping || !this->jobs.empty(); });
+            if (this->jobs.empty())
+                return;
+            std::function<void()> job = std::move(this->jobs.front());
+            this->jobs.pop_front();
+            guard.unlock();
+            job();
+            guard.lock();
+        }
+    };
+    for (unsigned i = 0; i < std::max(thread_count, 1u); ++i)
+        this->threads.emplace_back(worker);
+}
+
+ThreadPoolExecutor::~ThreadPoolExecutor()
+{
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->stopping = true;
+    }
+    this->wake.notify_all();
+    for (auto &thread : this->threads)
+        thread.join();
+}
+
+void ThreadPoolExecutor::post(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->jobs.push_back(std::move(job));
+    }
+    this->wake.notify_one();
+}
+
+EventLoopExecutor::EventLoopExecutor()
+    : event(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+    if (this->event < 0)
+        throw DeviceException();
+}
+
+EventLoopExecutor::~EventLoopExecutor()
+{
+    ::close(this->event);
+}
+
+int EventLoopExecutor::descriptor() const
+{
+    return this->event;
+}
+
+void EventLoopExecutor::post(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->jobs.push_back(std::move(job));
+    }
+    uint64_t one = 1;
+    [[maybe_unused]] ssize_t written = ::write(this->event, &one, sizeof(one));
+}
+
+size_t EventLoopExecutor::run_pending()
+{
+    uint64_t count;
+    [[maybe_unused]] ssize_t got = ::read(this->event, &count, sizeof(count));
+    std::vector<std::function<void()>> ready;
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        ready.swap(this->jobs);
+    }
+    for (auto &job : ready)
+        job();
+    return ready.size();
+}
+
+AsyncFileSystem::AsyncFileSystem(FileSystem &file_system,
+                                 Executor &io_executor,
+                                 Executor &resume_executor)
+    : fs(file_system), io(io_executor), resume(resume_executor)
+{
+}
+
+// The lambdas are made outside the co_await expressions, see call.
+
+Task<FileHandle> AsyncFileSystem::open(std::string name)
+{
+    Task<FileHandle> opened =
+        call<FileHandle>([&]() { return this->fs.open(name); });
+    co_return co_await opened;
+}
+
+Task<uint64_t> AsyncFileSystem::read(FileHandle handle, uint64_t offset,
+                                     char *data, uint64_t size)
+{
+    uint64_t done = 0;
+    while (done < size)
+    {
+        uint64_t length = std::min(size - done, RUN_SIZE);
+        Task<uint64_t> run = call<uint64_t>(
+            [&]()
+            { return this->fs.read(handle, offset + done, data + done,
+                                   length); });
+        uint64_t got = co_await run;
+        done += got;
+        if (got < length)
+            break;
+    }
+    co_return done;
+}
+
+Task<void> AsyncFileSystem::write(FileHandle handle, uint64_t offset,
+                                  char *data, uint64_t size)
+{
+    for (uint64_t done = 0; done < size;)
+    {
+        uint64_t length = std::min(size - done, RUN_SIZE);
+        Task<void> run = call<void>(
+            [&]()
+            { this->fs.write(handle, offset + done, data + done, length); });
+        co_await run;
+        done += length;
+    }
+}
+
+Task<void> AsyncFileSystem::mkdir(std::string name)
+{
+    Task<void> made = call<void>([&]() { this->fs.mkdir(name); });
+    co_await made;
+}
+
+Task<void> AsyncFileSystem::rm(std::string name)
+{
+    Task<void> removed = call<void>([&]() { this->fs.rm(name); });
+    co_await removed;
+}
+
+Task<std::string> AsyncFileSystem::ls(std::string directory)
+{
+    Task<std::string> listed =
+        call<std::string>([&]() { return this->fs.ls(directory); });
+    co_return co_await listed;
+}
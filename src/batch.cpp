@@ -0,0 +1,50 @@
+#include "fs.hpp"
+
+void FileSystem::begin_batch()
+{
+    this->batching = true;
+}
+
+void FileSystem::end_batch()
+{
+    this->batching = false;
+    sync();
+}
+
+void FileSystem::sync()
+{
+    write_deferred_metadata();
+    std::lock_guard<std::mutex> guard(this->drive_lock);
+    this->drive->sync();
+}
+
+void FileSystem::write_deferred_metadata()
+{
+    bool superblock_changed;
+    std::set<uint32_t> groups_changed;
+    {
+        std::lock_guard<std::mutex> guard(this->batch_lock);
+        superblock_changed = this->superblock_dirty;
+        this->superblock_dirty = false;
+        groups_changed.swap(this->dirty_groups);
+    }
+    // the descriptors are written directly, write_group_descriptor would
+    // hold them back again while a batch runs
+    for (uint32_t group_index : groups_changed)
+    {
+        AllocationGroup &group = *this->groups[group_index];
+        std::lock_guard<std::mutex> group_guard(group.lock);
+        std::lock_guard<std::mutex> guard(this->drive_lock);
+        this->drive->write(
+            groups_offset + group_index * sizeof(GroupDescriptor),
+            reinterpret_cast<char *>(&group.descriptor),
+            sizeof(GroupDescriptor));
+    }
+    if (superblock_changed)
+    {
+        std::lock_guard<std::mutex> superblock_guard(this->superblock_lock);
+        std::lock_guard<std::mutex> guard(this->drive_lock);
+        this->drive->write(0, reinterpret_cast<char *>(&this->superblock),
+                           sizeof(this->superblock));
+    }
+}
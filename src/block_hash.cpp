@@ -0,0 +1,145 @@
+#include <cstring>
+
+#include "block_hash.hpp"
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    const size_t STRIPE_SIZE = 64;
+    const int LANE_COUNT = 8;
+    const int SECRET_SIZE = 16;
+
+    // the first eight words repeat at the end, so the words of a stripe
+    // are always read in one piece without wrapping
+    const uint64_t SECRET[SECRET_SIZE + LANE_COUNT] = {
+        0xBE4BA423396CFEB8, 0x1CAD21F72C81017C, 0xDB979083E96DD4DE,
+        0x1F67B3B7A4A44072, 0x78E5C0CC4EE679CB, 0x2172FFCC7DD05A82,
+        0x8E2443F7744608B8, 0x4C263A81E69035E0, 0xCB00C391BB52283C,
+        0xA32E531B8B65D088, 0x4EF90DA297486471, 0xD8ACDEA946EF1938,
+        0x3F349CE33F76FAA8, 0x1D4F0BC7C7BBDCF9, 0x3159B4CD4BE0518A,
+        0x647378D9C97E9FC8, 0xBE4BA423396CFEB8, 0x1CAD21F72C81017C,
+        0xDB979083E96DD4DE, 0x1F67B3B7A4A44072, 0x78E5C0CC4EE679CB,
+        0x2172FFCC7DD05A82, 0x8E2443F7744608B8, 0x4C263A81E69035E0};
+
+    const uint64_t PRIME_1 = 0x9E3779B185EBCA87;
+    const uint64_t PRIME_2 = 0xC2B2AE3D27D4EB4F;
+
+    // Lane i of stripe s is keyed with SECRET[(2s + i) % 16], so every
+    // pair of lanes reads two adjacent secret words.
+    const uint64_t *stripe_secret(size_t stripe)
+    {
+        return SECRET + ((2 * stripe) & (SECRET_SIZE - 1));
+    }
+
+    // acc[i] += lo32(x ^ k) * hi32(x ^ k) + x of the neighbouring lane
+    void accumulate_software(uint64_t *acc, const unsigned char *data,
+                             size_t stripe_count)
+    {
+        for (size_t stripe = 0; stripe < stripe_count; ++stripe)
+        {
+            const uint64_t *secret = stripe_secret(stripe);
+            uint64_t words[LANE_COUNT];
+            std::memcpy(words, data + stripe * STRIPE_SIZE, STRIPE_SIZE);
+            for (int i = 0; i < LANE_COUNT; ++i)
+            {
+                uint64_t keyed = words[i] ^ secret[i];
+                acc[i] += (keyed & 0xFFFFFFFF) * (keyed >> 32) +
+                          words[i ^ 1];
+            }
+        }
+    }
+
+#if defined(__x86_64__)
+    void accumulate(uint64_t *acc, const unsigned char *data,
+                    size_t stripe_count)
+    {
+        __m128i lanes[LANE_COUNT / 2];
+        std::memcpy(lanes, acc, sizeof(lanes));
+        for (size_t stripe = 0; stripe < stripe_count; ++stripe)
+        {
+            const uint64_t *secret = stripe_secret(stripe);
+            for (int i = 0; i < LANE_COUNT / 2; ++i)
+            {
+                __m128i words =
+                    _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+                        data + stripe * STRIPE_SIZE + 16 * i));
+                __m128i key = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(secret + 2 * i));
+                __m128i keyed = _mm_xor_si128(words, key);
+                __m128i high =
+                    _mm_shuffle_epi32(keyed, _MM_SHUFFLE(3, 3, 1, 1));
+                __m128i product = _mm_mul_epu32(keyed, high);
+                __m128i swapped =
+                    _mm_shuffle_epi32(words, _MM_SHUFFLE(1, 0, 3, 2));
+                lanes[i] = _mm_add_epi64(lanes[i],
+                                         _mm_add_epi64(product, swapped));
+            }
+        }
+        std::memcpy(acc, lanes, sizeof(lanes));
+    }
+#else
+    void accumulate(uint64_t *acc, const unsigned char *data,
+                    size_t stripe_count)
+    {
+        accumulate_software(acc, data, stripe_count);
+    }
+#endif
+
+    uint64_t avalanche(uint64_t hash)
+    {
+        hash ^= hash >> 33;
+        hash *= PRIME_2;
+        hash ^= hash >> 29;
+        hash *= PRIME_1;
+        hash ^= hash >> 32;
+        return hash;
+    }
+}
+
+uint64_t block_hash(const void *data, size_t size)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    uint64_t acc[LANE_COUNT];
+    for (int i = 0; i < LANE_COUNT; ++i)
+        acc[i] = PRIME_1 * (i + 1);
+
+    size_t stripe_count = size / STRIPE_SIZE;
+    accumulate(acc, bytes, stripe_count);
+    if (size % STRIPE_SIZE != 0)
+    {
+        // the tail is hashed as a zero padded stripe
+        unsigned char tail[STRIPE_SIZE] = {0};
+        std::memcpy(tail, bytes + stripe_count * STRIPE_SIZE,
+                    size % STRIPE_SIZE);
+        accumulate_software(acc, tail, 1);
+    }
+
+    uint64_t hash = size * PRIME_1;
+    for (int i = 0; i < LANE_COUNT; ++i)
+        hash = (hash ^ avalanche(acc[i] + i)) * PRIME_2;
+    return avalanche(hash);
+}
+
+bool block_hash_self_check()
+{
+    // one block and a tail, hashed when the table was fixed
+    const uint64_t KNOWN_BLOCK = 0x030754EC338099F2;
+    const uint64_t KNOWN_TAIL = 0xEF019BAB2E6BF6AB;
+    static const bool passed = []()
+    {
+        unsigned char data[4096 + 100];
+        for (size_t i = 0; i < sizeof(data); ++i)
+            data[i] = (i * 131 + (i >> 8)) & 0xFF;
+        uint64_t fast[LANE_COUNT] = {0};
+        uint64_t portable[LANE_COUNT] = {0};
+        accumulate(fast, data, 4096 / STRIPE_SIZE);
+        accumulate_software(portable, data, 4096 / STRIPE_SIZE);
+        return std::memcmp(fast, portable, sizeof(fast)) == 0 &&
+               block_hash(data, 4096) == KNOWN_BLOCK &&
+               block_hash(data, sizeof(data)) == KNOWN_TAIL;
+    }();
+    return passed;
+}
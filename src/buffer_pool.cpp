@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "buffer_pool.hpp"
+
+BufferPool &BufferPool::instance()
+{
+    static BufferPool pool;
+    return pool;
+}
+
+// the caches of the threads go first, the main thread's included
+BufferPool::~BufferPool()
+{
+    for (auto &[size, buffers] : this->free_buffers)
+        for (char *buffer : buffers)
+            std::free(buffer);
+}
+
+BufferPool::ThreadCache &BufferPool::thread_cache()
+{
+    static thread_local ThreadCache cache;
+    return cache;
+}
+
+BufferPool::ThreadCache::~ThreadCache()
+{
+    for (auto &[size, buffer] : this->buffers)
+        instance().share(buffer, size);
+}
+
+// every buffer covers whole pages, so buffers of nearby sizes are shared
+size_t BufferPool::rounded(size_t size)
+{
+    return (std::max<size_t>(size, 1) + ALIGNMENT - 1) / ALIGNMENT *
+           ALIGNMENT;
+}
+
+char *BufferPool::acquire(size_t size)
+{
+    size = rounded(size);
+    auto &cached = thread_cache().buffers;
+    for (size_t i = cached.size(); i-- > 0;)
+    {
+        if (cached[i].first != size)
+            continue;
+        char *buffer = cached[i].second;
+        cached.erase(cached.begin() + i);
+        return buffer;
+    }
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        auto found = this->free_buffers.find(size);
+        if (found != this->free_buffers.end() && !found->second.empty())
+        {
+            char *buffer = found->second.back();
+            found->second.pop_back();
+            this->pooled_bytes -= size;
+            return buffer;
+        }
+    }
+    void *buffer = std::aligned_alloc(ALIGNMENT, size);
+    if (buffer == nullptr)
+        throw std::bad_alloc();
+    return static_cast<char *>(buffer);
+}
+
+void BufferPool::release(char *buffer, size_t size)
+{
+    size = rounded(size);
+    auto &cached = thread_cache().buffers;
+    if (size <= MAX_CACHED_SIZE && cached.size() < THREAD_CACHE_SIZE)
+    {
+        cached.emplace_back(size, buffer);
+        return;
+    }
+    share(buffer, size);
+}
+
+void BufferPool::share(char *buffer, size_t size)
+{
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        if (this->pooled_bytes + size <= MAX_POOLED_BYTES)
+        {
+            this->free_buffers[size].push_back(buffer);
+            this->pooled_bytes += size;
+            return;
+        }
+    }
+    std::free(buffer);
+}
+
+PooledBlock::PooledBlock(size_t size, char fill) : length(size)
+{
+    if (size == 0)
+        return;
+    this->buffer = BufferPool::instance().acquire(size);
+    std::memset(this->buffer, fill, size);
+}
+
+PooledBlock::PooledBlock(const PooledBlock &other) : length(other.length)
+{
+    if (this->length == 0)
+        return;
+    this->buffer = BufferPool::instance().acquire(this->length);
+    std::memcpy(this->buffer, other.buffer, this->length);
+}
+
+PooledBlock::PooledBlock(PooledBlock &&other) noexcept
+    : buffer(other.buffer), length(other.length)
+{
+    other.buffer = nullptr;
+    other.length = 0;
+}
+
+PooledBlock &PooledBlock::operator=(PooledBlock other) noexcept
+{
+    std::swap(this->buffer, other.buffer);
+    std::swap(this->length, other.length);
+    return *this;
+}
+
+PooledBlock::~PooledBlock()
+{
+    if (this->buffer != nullptr)
+        BufferPool::instance().release(this->buffer, this->length);
+}
+
+bool PooledBlock::operator==(const PooledBlock &other) const
+{
+    return this->length == other.length &&
+           (this->length == 0 ||
+            std::memcmp(this->buffer, other.buffer, this->length) == 0);
+}
+
+void PooledBlock::resize(size_t size, char fill)
+{
+    if (size == this->length)
+        return;
+    PooledBlock resized(size, fill);
+    if (size > 0 && this->length > 0)
+        std::memcpy(resized.buffer, this->buffer,
+                    std::min(size, this->length));
+    *this = std::move(resized);
+}
@@ -0,0 +1,343 @@
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "client.hpp"
+#include "exceptions.hpp"
+
+static const size_t RECEIVE_SIZE = 64 << 10;
+
+// Writes all of a message, with a descriptor along with its first byte.
+static void send_all(int socket, const std::string &message,
+                     int descriptor = -1)
+{
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    for (size_t sent = 0; sent < message.size();)
+    {
+        iovec piece = {const_cast<char *>(message.data()) + sent,
+                       message.size() - sent};
+        msghdr header = {};
+        header.msg_iov = &piece;
+        header.msg_iovlen = 1;
+        if (descriptor >= 0 && sent == 0)
+        {
+            header.msg_control = control;
+            header.msg_controllen = sizeof(control);
+            cmsghdr *rights = CMSG_FIRSTHDR(&header);
+            rights->cmsg_level = SOL_SOCKET;
+            rights->cmsg_type = SCM_RIGHTS;
+            rights->cmsg_len = CMSG_LEN(sizeof(int));
+            std::memcpy(CMSG_DATA(rights), &descriptor, sizeof(int));
+        }
+        ssize_t done = ::sendmsg(socket, &header, MSG_NOSIGNAL);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            throw ConnectionException();
+        sent += done;
+    }
+}
+
+Client::Client(const std::string &socket_path, uint64_t shared_bytes)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+        throw ConnectionException();
+    std::memcpy(address.sun_path, socket_path.c_str(),
+                socket_path.size() + 1);
+    this->socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (this->socket < 0 ||
+        ::connect(this->socket, reinterpret_cast<sockaddr *>(&address),
+                  sizeof(address)) != 0)
+    {
+        if (this->socket >= 0)
+            ::close(this->socket);
+        throw ConnectionException();
+    }
+    if (shared_bytes == 0)
+        return;
+
+    // the server maps the same memfd, sealed so it cannot shrink under it
+    int memory = ::memfd_create("fs-client", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    void *mapped = MAP_FAILED;
+    if (memory >= 0 && ::ftruncate(memory, shared_bytes) == 0 &&
+        ::fcntl(memory, F_ADD_SEALS, F_SEAL_SHRINK) == 0)
+        mapped = ::mmap(nullptr, shared_bytes, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, memory, 0);
+    try
+    {
+        if (mapped == MAP_FAILED)
+            throw ConnectionException();
+        this->shared = static_cast<char *>(mapped);
+        this->shared_size = shared_bytes;
+        Request request;
+        request.operation = PROTOCOL_ATTACH;
+        request.id = this->next_id++;
+        request.numbers = {shared_bytes};
+        std::string message;
+        encode_request(request, message);
+        send_all(this->socket, message, memory);
+        Response response = receive();
+        if (response.status != PROTOCOL_OK)
+            throw RemoteException(response.data);
+    }
+    catch (...)
+    {
+        if (memory >= 0)
+            ::close(memory);
+        if (mapped != MAP_FAILED)
+            ::munmap(mapped, shared_bytes);
+        ::close(this->socket);
+        throw;
+    }
+    ::close(memory);
+}
+
+Client::~Client()
+{
+    if (this->shared != nullptr)
+        ::munmap(this->shared, this->shared_size);
+    ::close(this->socket);
+}
+
+char *Client::shared_buffer()
+{
+    return this->shared;
+}
+
+uint64_t Client::shared_buffer_size() const
+{
+    return this->shared_size;
+}
+
+uint32_t Client::send(Request &request)
+{
+    request.id = this->next_id++;
+    std::string message;
+    encode_request(request, message);
+    send_all(this->socket, message);
+    return request.id;
+}
+
+Response Client::receive()
+{
+    Response response;
+    while (true)
+    {
+        size_t length = decode_response(this->input.data(),
+                                        this->input.size(), response);
+        if (length > 0)
+        {
+            this->input.erase(0, length);
+            return response;
+        }
+        char buffer[RECEIVE_SIZE];
+        ssize_t got = ::recv(this->socket, buffer, sizeof(buffer), 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            throw ConnectionException();
+        this->input.append(buffer, got);
+    }
+}
+
+Response Client::call(Request &request)
+{
+    send(request);
+    Response response = receive();
+    if (response.status != PROTOCOL_OK)
+        throw RemoteException(response.data);
+    return response;
+}
+
+int64_t Client::shared_offset(const char *data, uint64_t size) const
+{
+    if (this->shared == nullptr || data < this->shared)
+        return -1;
+    uint64_t offset = data - this->shared;
+    if (offset > this->shared_size || size > this->shared_size - offset)
+        return -1;
+    return offset;
+}
+
+uint64_t Client::read_into(Request &request, char *data, uint64_t size)
+{
+    // data in the shared buffer is read in place, other data through the
+    // start of the buffer when it fits
+    int64_t in_place = shared_offset(data, size);
+    bool through = in_place < 0 && this->shared != nullptr &&
+                   size <= this->shared_size;
+    if (in_place >= 0 || through)
+    {
+        request.flags = PROTOCOL_SHARED;
+        request.numbers.push_back((through) ? (0) : (in_place));
+    }
+    Response response = call(request);
+    if (through)
+        std::memcpy(data, this->shared, response.number);
+    else if (in_place < 0)
+        std::memcpy(data, response.data.data(), response.number);
+    return response.number;
+}
+
+FileHandle Client::open(const std::string &name)
+{
+    Request request;
+    request.operation = PROTOCOL_OPEN;
+    request.names = {name};
+    return call(request).number;
+}
+
+uint64_t Client::read(FileHandle handle, uint64_t offset, char *data,
+                      uint64_t size)
+{
+    Request request;
+    request.operation = PROTOCOL_PREAD;
+    request.numbers = {handle, offset, size};
+    return read_into(request, data, size);
+}
+
+void Client::write(FileHandle handle, uint64_t offset, const char *data,
+                   uint64_t size)
+{
+    Request request;
+    request.operation = PROTOCOL_PWRITE;
+    request.numbers = {handle, offset, size};
+    int64_t in_place = shared_offset(data, size);
+    if (in_place < 0 && this->shared != nullptr && size <= this->shared_size)
+    {
+        std::memcpy(this->shared, data, size);
+        in_place = 0;
+    }
+    if (in_place >= 0)
+    {
+        request.flags = PROTOCOL_SHARED;
+        request.numbers.push_back(in_place);
+    }
+    else
+        request.data.assign(data, size);
+    call(request);
+}
+
+uint64_t Client::read(const std::string &name, uint64_t offset, char *data,
+                      uint64_t size)
+{
+    Request request;
+    request.operation = PROTOCOL_READ;
+    request.names = {name};
+    request.numbers = {offset, size};
+    return read_into(request, data, size);
+}
+
+void Client::mkdir(const std::string &name)
+{
+    Request request;
+    request.operation = PROTOCOL_MKDIR;
+    request.names = {name};
+    call(request);
+}
+
+void Client::rm(const std::string &name)
+{
+    Request request;
+    request.operation = PROTOCOL_RM;
+    request.names = {name};
+    call(request);
+}
+
+void Client::extend(const std::string &name, uint64_t bytes)
+{
+    Request request;
+    request.operation = PROTOCOL_EXTEND;
+    request.names = {name};
+    request.numbers = {bytes};
+    call(request);
+}
+
+void Client::truncate(const std::string &name, uint64_t bytes)
+{
+    Request request;
+    request.operation = PROTOCOL_TRUNCATE;
+    request.names = {name};
+    request.numbers = {bytes};
+    call(request);
+}
+
+std::string Client::ls(const std::string &directory)
+{
+    Request request;
+    request.operation = PROTOCOL_LS;
+    request.names = {directory};
+    return call(request).data;
+}
+
+std::string Client::df()
+{
+    Request request;
+    request.operation = PROTOCOL_DF;
+    return call(request).data;
+}
+
+void Client::upload(const std::string &local_name,
+                    const std::string &virtual_name)
+{
+    Request request;
+    request.operation = PROTOCOL_UPLOAD;
+    request.names = {local_name, virtual_name};
+    call(request);
+}
+
+void Client::extract(const std::string &virtual_name,
+                     const std::string &local_name)
+{
+    Request request;
+    request.operation = PROTOCOL_EXTRACT;
+    request.names = {virtual_name, local_name};
+    call(request);
+}
+
+void Client::reflink(const std::string &source,
+                     const std::string &destination)
+{
+    Request request;
+    request.operation = PROTOCOL_REFLINK;
+    request.names = {source, destination};
+    call(request);
+}
+
+std::string Client::snapshot(const std::string &name)
+{
+    Request request;
+    request.operation = PROTOCOL_SNAPSHOT;
+    request.names = {name};
+    return call(request).data;
+}
+
+void Client::set_compression(const std::string &name, bool enabled)
+{
+    Request request;
+    request.operation = PROTOCOL_SET_COMPRESSION;
+    request.names = {name};
+    request.numbers = {enabled};
+    call(request);
+}
+
+std::string Client::stats(bool json)
+{
+    Request request;
+    request.operation = PROTOCOL_STATS;
+    request.numbers = {json};
+    return call(request).data;
+}
+
+void Client::sync()
+{
+    Request request;
+    request.operation = PROTOCOL_SYNC;
+    call(request);
+}
@@ -0,0 +1,233 @@
+#include <algorithm>
+#include <cstring>
+
+#include "fs.hpp"
+#include "exceptions.hpp"
+#include "lz.hpp"
+
+// A compressed file is stored in chunks of chunk_blocks logical blocks. A
+// chunk that compresses into fewer blocks keeps a uint32_t with the
+// compressed size and the compressed bytes in its first blocks, the
+// pointers of the remaining blocks are holes. A chunk whose last pointer
+// is a hole is therefore compressed, any other chunk is stored raw.
+
+bool FileSystem::is_chunk_compressed(const Inode &inode, uint64_t chunk,
+                                     uint64_t length)
+{
+    uint64_t last_block = chunk * this->chunk_blocks +
+                          get_file_data_block_count(length) - 1;
+    return get_data_block_pointer(inode, last_block) == 0;
+}
+
+void FileSystem::load_chunk(const Inode &inode, uint64_t chunk,
+                            uint64_t length, char *dest)
+{
+    const uint32_t block_size = this->superblock.block_size;
+    uint64_t first_block = chunk * this->chunk_blocks;
+    uint64_t block_count = get_file_data_block_count(length);
+    if (!is_chunk_compressed(inode, chunk, length))
+    {
+        for (uint64_t i = 0; i < block_count; ++i)
+            read_from_block(get_data_block_pointer(inode, first_block + i),
+                            dest + i * block_size,
+                            std::min<uint64_t>(block_size,
+                                               length - i * block_size),
+                            0);
+        return;
+    }
+    DataBlock stored = read_block(get_data_block_pointer(inode, first_block));
+    uint32_t compressed_size;
+    std::memcpy(&compressed_size, stored.data(), sizeof(uint32_t));
+    uint64_t stored_size = sizeof(uint32_t) + compressed_size;
+    if (stored_size > static_cast<uint64_t>(block_count - 1) * block_size)
+        throw CorruptChunkException();
+    stored.resize(get_file_data_block_count(stored_size) * block_size);
+    for (uint64_t i = 1; i * block_size < stored_size; ++i)
+        read_from_block(get_data_block_pointer(inode, first_block + i),
+                        stored.data() + i * block_size, block_size, 0);
+    if (!lz_decompress(stored.data() + sizeof(uint32_t), compressed_size,
+                       dest, length))
+        throw CorruptChunkException();
+}
+
+void FileSystem::store_chunk(Inode &inode, uint64_t chunk, const char *data,
+                             uint64_t length, uint64_t old_block_count,
+                             uint64_t &goal)
+{
+    const uint32_t block_size = this->superblock.block_size;
+    uint64_t first_block = chunk * this->chunk_blocks;
+    uint64_t block_count = get_file_data_block_count(length);
+
+    // compressed only when it saves at least one block
+    DataBlock stored((block_count - 1) * block_size);
+    size_t compressed_size =
+        (block_count > 1)
+            ? (lz_compress(data, length, stored.data() + sizeof(uint32_t),
+                           stored.size() - sizeof(uint32_t)))
+            : (0);
+    uint64_t stored_block_count = block_count;
+    if (compressed_size > 0)
+    {
+        uint32_t size_field = compressed_size;
+        std::memcpy(stored.data(), &size_field, sizeof(uint32_t));
+        stored_block_count =
+            get_file_data_block_count(sizeof(uint32_t) + compressed_size);
+        data = stored.data();
+    }
+
+    DataBlock block(block_size);
+    for (uint64_t i = 0; i < stored_block_count; ++i)
+    {
+        uint64_t logical = first_block + i;
+        uint64_t available = (compressed_size > 0)
+                                 ? (stored.size())
+                                 : (length);
+        uint64_t copied =
+            std::min<uint64_t>(block_size, available - i * block_size);
+        std::memcpy(block.data(), data + i * block_size, copied);
+        std::fill(block.begin() + copied, block.end(), 0);
+
+        // blocks shared with other files are replaced, never overwritten
+        write_block(private_data_block(inode, logical, goal, false), block);
+    }
+    // the rest of the chunk becomes holes
+    for (uint64_t logical = first_block + stored_block_count;
+         logical < std::min(first_block + this->chunk_blocks,
+                            old_block_count);
+         ++logical)
+    {
+        if (get_data_block_pointer(inode, logical) != 0)
+            release_block(map_data_block(inode, logical, 0, goal));
+    }
+}
+
+void FileSystem::read_compressed_file(const Inode &inode, char *dest,
+                                      uint64_t size, uint64_t pos)
+{
+    uint64_t chunk_size =
+        static_cast<uint64_t>(this->chunk_blocks) * superblock.block_size;
+    std::vector<char> buffer(chunk_size);
+    for (uint64_t end_pos = pos + size; pos < end_pos;)
+    {
+        uint64_t chunk = pos / chunk_size;
+        uint64_t start = chunk * chunk_size;
+        uint64_t length = std::min(chunk_size, inode.size - start);
+        uint64_t copied = std::min(start + length, end_pos) - pos;
+        load_chunk(inode, chunk, length, buffer.data());
+        std::memcpy(dest, buffer.data() + (pos - start), copied);
+        dest += copied;
+        pos += copied;
+    }
+}
+
+void FileSystem::write_compressed_file(int index, Inode &inode,
+                                       const char *data, uint64_t size,
+                                       uint64_t pos)
+{
+    uint64_t chunk_size =
+        static_cast<uint64_t>(this->chunk_blocks) * superblock.block_size;
+    uint64_t result_size = std::max(inode.size, pos + size);
+    if (get_file_data_block_count(result_size) > this->max_inode_block_count)
+        throw FileSizeTooBigException();
+
+    uint64_t old_block_count = get_file_data_block_count(inode);
+    // the first block of a chunk is never a hole
+    uint64_t last_chunk_block =
+        (old_block_count > 0)
+            ? ((old_block_count - 1) / this->chunk_blocks * this->chunk_blocks)
+            : (0);
+    uint64_t goal =
+        (old_block_count > 0)
+            ? (get_data_block_pointer(inode, last_chunk_block) + 1)
+            : (this->groups[inode.group]->first_block);
+    // every chunk from the old end of the file (zero filled) or the write
+    // position up to the end of the write is stored again
+    std::vector<char> buffer(chunk_size);
+    uint64_t end_pos = pos + size;
+    for (uint64_t chunk = std::min(pos, inode.size) / chunk_size;
+         size > 0 && chunk * chunk_size < end_pos; ++chunk)
+    {
+        uint64_t start = chunk * chunk_size;
+        uint64_t old_length =
+            (inode.size > start) ? (std::min(chunk_size, inode.size - start))
+                                 : (0);
+        uint64_t length = std::min(chunk_size, result_size - start);
+        uint64_t from = std::max(pos, start);
+        uint64_t to = std::min(end_pos, start + length);
+        std::fill(buffer.begin(), buffer.end(), 0);
+        if (old_length > 0 && (from > start || to < start + length))
+            load_chunk(inode, chunk, old_length, buffer.data());
+        if (data != nullptr && from < to)
+            std::memcpy(buffer.data() + (from - start), data + (from - pos),
+                        to - from);
+        store_chunk(inode, chunk, buffer.data(), length, old_block_count,
+                    goal);
+    }
+
+    inode.size = result_size;
+    inode.last_modified = touch_superblock();
+    inode.generation = superblock.generation;
+    write_inode(index, inode);
+}
+
+void FileSystem::resize_compressed_file(int index, Inode &inode,
+                                        uint64_t new_size)
+{
+    if (new_size >= inode.size)
+    {
+        // zeros are written through the chunks, like any other data
+        write_compressed_file(index, inode, nullptr, new_size - inode.size,
+                              inode.size);
+        return;
+    }
+    uint64_t chunk_size =
+        static_cast<uint64_t>(this->chunk_blocks) * superblock.block_size;
+    uint64_t chunk = new_size / chunk_size;
+    uint64_t start = chunk * chunk_size;
+    std::vector<char> buffer;
+    if (new_size > start)
+    {
+        // the chunk cut in the middle is decompressed and stored shorter
+        buffer.resize(chunk_size);
+        load_chunk(inode, chunk, std::min(chunk_size, inode.size - start),
+                   buffer.data());
+    }
+    release_file_blocks(inode, chunk * this->chunk_blocks);
+    if (new_size > start)
+    {
+        uint64_t goal = this->groups[inode.group]->first_block;
+        store_chunk(inode, chunk, buffer.data(), new_size - start,
+                    chunk * this->chunk_blocks, goal);
+    }
+    inode.size = new_size;
+    inode.last_modified = touch_superblock();
+    inode.generation = superblock.generation;
+    write_inode(index, inode);
+}
+
+void FileSystem::set_compression(const std::string &name, bool enabled)
+{
+    auto timed = time_call(Metrics::SET_COMPRESSION, {name}, {enabled});
+    auto paused = pause_cleaner();
+    uint32_t index = find_file_in_dir(name);
+    Inode inode = read_inode(index);
+    mask_type type = inode.flags & INODE_MODE_MASK;
+    if (type != FILE_TYPE::FILE && type != FILE_TYPE::DIR)
+        throw NotAFileException();
+    if (static_cast<bool>(inode.flags & INODE_COMPRESSED_MASK) == enabled)
+        return;
+    // a directory only passes the attribute to the files created in it
+    if (type == FILE_TYPE::DIR)
+    {
+        inode.flags ^= INODE_COMPRESSED_MASK;
+        write_inode(index, inode);
+        return;
+    }
+    std::vector<char> content(inode.size);
+    read_file(index, content.data(), inode.size, 0);
+    resize_file(index, 0);
+    inode = read_inode(index);
+    inode.flags ^= INODE_COMPRESSED_MASK;
+    write_inode(index, inode);
+    write_file(index, content.data(), content.size(), 0);
+}
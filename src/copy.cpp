@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <vector>
+
+#include <unistd.h>
+
+#include "fs.hpp"
+#include "exceptions.hpp"
+
+// the drive stays locked for one run at most this long, longer runs are
+// split; also the size of the buffer of everything copied through memory
+static const uint64_t COPY_RUN_SIZE = 16 << 20;
+
+// Runs of blocks that follow each other in the image are moved between the
+// drive and the local file by the kernel. Everything else - holes, a
+// packed tail, compressed data, blocks that need a checksum and whatever
+// the drive leaves - goes through a buffer with read_file and write_file.
+
+void FileSystem::copy_file_out(int index, const Inode &inode, int local)
+{
+    const uint64_t block_size = this->superblock.block_size;
+    std::vector<char> buffer;
+    auto copy_buffered = [&](uint64_t pos, uint64_t size)
+    {
+        buffer.resize(std::min(size, COPY_RUN_SIZE));
+        for (uint64_t end = pos + size; pos < end;)
+        {
+            uint64_t length = std::min<uint64_t>(buffer.size(), end - pos);
+            read_file(index, buffer.data(), length, pos);
+            for (uint64_t done = 0; done < length;)
+            {
+                ssize_t written = ::pwrite(local, buffer.data() + done,
+                                           length - done, pos + done);
+                if (written <= 0)
+                    throw LocalFileException();
+                done += written;
+            }
+            pos += length;
+        }
+    };
+
+    // only whole blocks can be copied as they are, and only when nothing
+    // has to be checked or decoded
+    uint64_t direct_blocks = 0;
+    if (!(this->superblock.features & FEATURE_CHECKSUMS) &&
+        !(inode.flags & INODE_COMPRESSED_MASK))
+    {
+        direct_blocks = inode.size / block_size;
+        if (inode.flags & INODE_TAIL_MASK)
+            direct_blocks =
+                std::min(direct_blocks, get_file_data_block_count(inode) - 1);
+    }
+    for (uint64_t block = 0; block < direct_blocks;)
+    {
+        uint64_t first = get_data_block_pointer(inode, block);
+        if (first == 0)
+        {
+            copy_buffered(block * block_size, block_size);
+            ++block;
+            continue;
+        }
+        uint64_t count = 1;
+        while (block + count < direct_blocks &&
+               count * block_size < COPY_RUN_SIZE &&
+               get_data_block_pointer(inode, block + count) == first + count)
+            ++count;
+        uint64_t copied;
+        {
+            std::lock_guard<std::mutex> guard(this->drive_lock);
+            copied = this->drive->copy_out(blocks_offset + first * block_size,
+                                           local, block * block_size,
+                                           count * block_size);
+        }
+        // what is left is counted by read_file
+        this->metrics.block_reads += copied / block_size;
+        if (copied < count * block_size)
+            copy_buffered(block * block_size + copied,
+                          count * block_size - copied);
+        block += count;
+    }
+    copy_buffered(direct_blocks * block_size,
+                  inode.size - direct_blocks * block_size);
+}
+
+void FileSystem::copy_file_in(int index, int local, uint64_t size)
+{
+    const uint64_t block_size = this->superblock.block_size;
+    std::vector<char> buffer;
+    auto copy_buffered = [&](uint64_t pos, uint64_t length)
+    {
+        buffer.resize(std::min(length, COPY_RUN_SIZE));
+        for (uint64_t end = pos + length; pos < end;)
+        {
+            uint64_t piece = std::min<uint64_t>(buffer.size(), end - pos);
+            for (uint64_t done = 0; done < piece;)
+            {
+                ssize_t got = ::pread(local, buffer.data() + done,
+                                      piece - done, pos + done);
+                if (got <= 0)
+                    throw LocalFileException();
+                done += got;
+            }
+            write_file(index, buffer.data(), piece, pos);
+            pos += piece;
+        }
+    };
+
+    // the dedup index and the log need to see the data, a checksum or
+    // compression needs to compute from it
+    Inode inode = read_inode(index);
+    if ((this->superblock.features &
+         (FEATURE_CHECKSUMS | FEATURE_DEDUP | FEATURE_LOG)) ||
+        (inode.flags & INODE_COMPRESSED_MASK))
+    {
+        copy_buffered(0, size);
+        return;
+    }
+
+    // released blocks are zeroed, so a partial last block can be copied
+    // as it is
+    resize_file(index, size);
+    inode = read_inode(index);
+    uint64_t block_count = get_file_data_block_count(inode);
+    for (uint64_t block = 0; block < block_count;)
+    {
+        uint64_t first = get_data_block_pointer(inode, block);
+        uint64_t count = 1;
+        while (block + count < block_count &&
+               count * block_size < COPY_RUN_SIZE &&
+               get_data_block_pointer(inode, block + count) == first + count)
+            ++count;
+        uint64_t length =
+            std::min(count * block_size, size - block * block_size);
+        uint64_t copied;
+        {
+            std::lock_guard<std::mutex> guard(this->drive_lock);
+            copied = this->drive->copy_in(local, block * block_size,
+                                          blocks_offset + first * block_size,
+                                          length);
+        }
+        this->metrics.block_writes += (copied + block_size - 1) / block_size;
+        if (copied < length)
+            copy_buffered(block * block_size + copied, length - copied);
+        block += count;
+    }
+    pack_tail(index);
+}
@@ -0,0 +1,166 @@
+#include <array>
+#include <cstring>
+
+#include "crc32c.hpp"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace
+{
+    const uint32_t POLYNOMIAL = 0x82F63B78;
+
+    // Lanes processed side by side by the hardware kernel, hiding the
+    // latency of the crc instruction.
+    const size_t LANE_SIZE = 1024;
+
+    typedef std::array<std::array<uint32_t, 256>, 8> SliceTable;
+
+    SliceTable make_slice_table()
+    {
+        SliceTable table;
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (crc >> 1) ^ ((crc & 1) ? (POLYNOMIAL) : (0));
+            table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; ++i)
+            for (int slice = 1; slice < 8; ++slice)
+                table[slice][i] = (table[slice - 1][i] >> 8) ^
+                                  table[0][table[slice - 1][i] & 0xFF];
+        return table;
+    }
+
+    const SliceTable slice_table = make_slice_table();
+
+    // Works on the raw register, without the initial and final inversion.
+    uint32_t update_software(uint32_t crc, const unsigned char *data,
+                             size_t size)
+    {
+        for (; size >= 8; size -= 8, data += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, data, sizeof(word));
+            word ^= crc;
+            crc = slice_table[7][word & 0xFF] ^
+                  slice_table[6][(word >> 8) & 0xFF] ^
+                  slice_table[5][(word >> 16) & 0xFF] ^
+                  slice_table[4][(word >> 24) & 0xFF] ^
+                  slice_table[3][(word >> 32) & 0xFF] ^
+                  slice_table[2][(word >> 40) & 0xFF] ^
+                  slice_table[1][(word >> 48) & 0xFF] ^
+                  slice_table[0][word >> 56];
+        }
+        for (; size > 0; --size, ++data)
+            crc = (crc >> 8) ^ slice_table[0][(crc ^ *data) & 0xFF];
+        return crc;
+    }
+
+    // shift_table[k][b] is the register obtained by feeding LANE_SIZE zero
+    // bytes after the register b << 8k, so advancing a lane result past the
+    // following lane costs four lookups.
+    typedef std::array<std::array<uint32_t, 256>, 4> ShiftTable;
+
+    ShiftTable make_shift_table()
+    {
+        ShiftTable table;
+        unsigned char zeros[LANE_SIZE] = {0};
+        for (int k = 0; k < 4; ++k)
+            for (uint32_t b = 0; b < 256; ++b)
+                table[k][b] = update_software(b << (8 * k), zeros, LANE_SIZE);
+        return table;
+    }
+
+    const ShiftTable shift_table = make_shift_table();
+
+    uint32_t shift_lane(uint32_t crc)
+    {
+        return shift_table[0][crc & 0xFF] ^ shift_table[1][(crc >> 8) & 0xFF] ^
+               shift_table[2][(crc >> 16) & 0xFF] ^ shift_table[3][crc >> 24];
+    }
+
+#if defined(__x86_64__)
+    __attribute__((target("sse4.2"))) uint32_t
+    update_hardware_lane(uint32_t crc, const unsigned char *data, size_t size)
+    {
+        uint64_t crc64 = crc;
+        for (; size >= 8; size -= 8, data += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, data, sizeof(word));
+            crc64 = _mm_crc32_u64(crc64, word);
+        }
+        crc = crc64;
+        for (; size > 0; --size, ++data)
+            crc = _mm_crc32_u8(crc, *data);
+        return crc;
+    }
+
+    __attribute__((target("sse4.2"))) uint32_t
+    update_hardware(uint32_t crc, const unsigned char *data, size_t size)
+    {
+        for (; size >= 3 * LANE_SIZE; size -= 3 * LANE_SIZE,
+                                      data += 3 * LANE_SIZE)
+        {
+            uint64_t crc0 = crc, crc1 = 0, crc2 = 0;
+            for (size_t i = 0; i < LANE_SIZE; i += 8)
+            {
+                uint64_t word0, word1, word2;
+                std::memcpy(&word0, data + i, sizeof(uint64_t));
+                std::memcpy(&word1, data + LANE_SIZE + i, sizeof(uint64_t));
+                std::memcpy(&word2, data + 2 * LANE_SIZE + i,
+                            sizeof(uint64_t));
+                crc0 = _mm_crc32_u64(crc0, word0);
+                crc1 = _mm_crc32_u64(crc1, word1);
+                crc2 = _mm_crc32_u64(crc2, word2);
+            }
+            crc = shift_lane(shift_lane(crc0) ^ crc1) ^ crc2;
+        }
+        return update_hardware_lane(crc, data, size);
+    }
+
+    const bool has_hardware = []
+    {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.2");
+    }();
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    uint32_t update_hardware(uint32_t crc, const unsigned char *data,
+                             size_t size)
+    {
+        for (; size >= 8; size -= 8, data += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, data, sizeof(word));
+            crc = __crc32cd(crc, word);
+        }
+        for (; size > 0; --size, ++data)
+            crc = __crc32cb(crc, *data);
+        return crc;
+    }
+
+    const bool has_hardware = true;
+#else
+    uint32_t update_hardware(uint32_t crc, const unsigned char *data,
+                             size_t size)
+    {
+        return update_software(crc, data, size);
+    }
+
+    const bool has_hardware = false;
+#endif
+}
+
+uint32_t crc32c(const void *data, size_t size, uint32_t crc)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+    crc = (has_hardware) ? (update_hardware(crc, bytes, size))
+                         : (update_software(crc, bytes, size));
+    return ~crc;
+}
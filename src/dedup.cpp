@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <cstring>
+
+#include "fs.hpp"
+#include "exceptions.hpp"
+#include "block_hash.hpp"
+
+FileSystem::BlockReference FileSystem::read_block_reference(uint64_t index)
+{
+    BlockReference reference;
+    std::lock_guard<std::mutex> guard(this->drive_lock);
+    this->drive->read(references_offset + index * sizeof(BlockReference),
+                      reinterpret_cast<char *>(&reference),
+                      sizeof(BlockReference));
+    return reference;
+}
+
+void FileSystem::write_block_reference(uint64_t index,
+                                       const BlockReference &reference)
+{
+    std::lock_guard<std::mutex> guard(this->drive_lock);
+    this->drive->write(references_offset + index * sizeof(BlockReference),
+                       reinterpret_cast<const char *>(&reference),
+                       sizeof(BlockReference));
+}
+
+void FileSystem::load_dedup_index()
+{
+    this->dedup_index.clear();
+    if (!(this->superblock.features & FEATURE_DEDUP))
+        return;
+    if (!block_hash_self_check())
+        throw BlockHashException();
+    // the index is rebuilt from the hashes kept in the reference table
+    const uint64_t CHUNK = 4096;
+    std::vector<BlockReference> references(CHUNK);
+    for (uint64_t first = 0; first < this->superblock.block_count;
+         first += CHUNK)
+    {
+        uint64_t count =
+            std::min(CHUNK, this->superblock.block_count - first);
+        this->drive->read(references_offset + first * sizeof(BlockReference),
+                          reinterpret_cast<char *>(references.data()),
+                          count * sizeof(BlockReference));
+        for (uint64_t i = 0; i < count; ++i)
+            if (references[i].hash != 0 && references[i].count > 0)
+                this->dedup_index.emplace(references[i].hash, first + i);
+    }
+}
+
+void FileSystem::write_file_dedup(int index, char *data, uint64_t size,
+                                  uint64_t pos)
+{
+    Inode inode = this->read_inode(index);
+    if (size == 0)
+        return;
+    if (inode.flags & INODE_COMPRESSED_MASK)
+    {
+        write_compressed_file(index, inode, data, size, pos);
+        return;
+    }
+
+    const uint32_t block_size = this->superblock.block_size;
+    uint64_t result_size = std::max(inode.size, pos + size);
+    if (get_file_data_block_count(result_size) > this->max_inode_block_count)
+        throw FileSizeTooBigException();
+
+    // blocks are only allocated when their content is not in the index,
+    // a gap between the old end and pos is filled with zeroed blocks
+    uint64_t old_block_count = get_file_data_block_count(inode);
+    uint64_t goal =
+        (old_block_count > 0)
+            ? (get_data_block_pointer(inode, old_block_count - 1) + 1)
+            : (this->groups[inode.group]->first_block);
+    for (uint64_t i = old_block_count; i < pos / block_size; ++i)
+        allocate_data_block(inode, i, goal);
+
+    uint64_t mapped_block_count = std::max(old_block_count, pos / block_size);
+    DataBlock content(block_size);
+    for (uint64_t end_pos = pos + size; pos < end_pos;)
+    {
+        uint64_t block = pos / block_size;
+        uint32_t offset = pos % block_size;
+        uint32_t length =
+            std::min<uint64_t>(block_size - offset, end_pos - pos);
+        // tables shared with other files are copied on the way
+        uint64_t current = (block < mapped_block_count)
+                               ? (allocate_data_block(inode, block, goal))
+                               : (0);
+        if (length != block_size)
+        {
+            if (current != 0)
+                content = read_block(current);
+            else
+                std::fill(content.begin(), content.end(), 0);
+        }
+        std::memcpy(content.data() + offset, data, length);
+        store_data_block(inode, block, current, content, goal);
+        mapped_block_count = std::max(mapped_block_count, block + 1);
+        data += length;
+        pos += length;
+    }
+
+    inode.last_modified = touch_superblock();
+    inode.generation = superblock.generation;
+    inode.size = result_size;
+    this->write_inode(index, inode);
+}
+
+void FileSystem::store_data_block(Inode &inode, uint64_t block,
+                                  uint64_t current, DataBlock &content,
+                                  uint64_t &goal)
+{
+    uint64_t hash = block_hash(content.data(), content.size());
+    // 0 marks blocks outside of the index
+    if (hash == 0)
+        hash = 1;
+
+    std::unique_lock<std::mutex> guard(this->reference_lock);
+    auto found = this->dedup_index.find(hash);
+    // equal hashes are confirmed by comparing the content
+    bool duplicate = found != this->dedup_index.end() &&
+                     read_block(found->second) == content;
+    if (duplicate && found->second == current)
+        return;
+    if (duplicate)
+    {
+        uint64_t shared = found->second;
+        BlockReference reference = read_block_reference(shared);
+        ++reference.count;
+        write_block_reference(shared, reference);
+        guard.unlock();
+        map_data_block(inode, block, shared, goal);
+        if (current != 0)
+            release_block(current);
+        return;
+    }
+
+    uint64_t target = current;
+    BlockReference reference = {0, 0};
+    if (current != 0)
+        reference = read_block_reference(current);
+    if (current == 0 || reference.count > 1)
+    {
+        // copy on write, the other owners keep the old block; mapped after
+        // the lock is released, the tables on the way may need copying too
+        target = allocate_block(goal);
+        goal = target + 1;
+    }
+    else if (reference.hash != 0)
+    {
+        // a private block is rewritten in place and leaves the index
+        auto stale = this->dedup_index.find(reference.hash);
+        if (stale != this->dedup_index.end() && stale->second == current)
+            this->dedup_index.erase(stale);
+    }
+
+    this->write_block(target, content);
+    // on a hash collision the block stays out of the index
+    bool indexed = this->dedup_index.emplace(hash, target).second;
+    write_block_reference(target, {(indexed) ? (hash) : (0), 1});
+    guard.unlock();
+
+    if (target != current)
+    {
+        map_data_block(inode, block, target, goal);
+        if (current != 0)
+            release_block(current);
+    }
+}
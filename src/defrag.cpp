@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <utility>
+
+#include "fs.hpp"
+#include "exceptions.hpp"
+#include "rate_limiter.hpp"
+
+uint64_t FileSystem::find_free_run(uint64_t length, uint32_t preferred_group)
+{
+    uint32_t group_count = this->superblock.group_count;
+    uint64_t run_start = 0;
+    uint64_t run_length = 0;
+    // groups are adjacent on the drive, so a run may continue into the next
+    // one, except when the scan wraps around to the first group
+    for (uint32_t n = 0; n < group_count; ++n)
+    {
+        uint32_t group_index = (preferred_group + n) % group_count;
+        if (group_index == 0)
+            run_length = 0;
+        AllocationGroup &group = *this->groups[group_index];
+        std::vector<uint8_t> bitmap;
+        {
+            std::lock_guard<std::mutex> guard(group.lock);
+            if (group.descriptor.free_count == 0)
+            {
+                run_length = 0;
+                continue;
+            }
+            load_group_bitmap(group_index);
+            bitmap = group.bitmap;
+        }
+        for (uint32_t i = 0; i < group.block_count;)
+        {
+            uint8_t byte = bitmap[i >> 3];
+            // whole bytes are skipped or taken at once
+            if ((i & 7) == 0 && i + 8 <= group.block_count &&
+                (byte == 0xFF || byte == 0))
+            {
+                if (byte == 0xFF)
+                    run_length = 0;
+                else
+                {
+                    if (run_length == 0)
+                        run_start = group.first_block + i;
+                    run_length += 8;
+                    if (run_length >= length)
+                        return run_start;
+                }
+                i += 8;
+                continue;
+            }
+            if (byte & (1 << (i & 7)))
+                run_length = 0;
+            else
+            {
+                if (run_length == 0)
+                    run_start = group.first_block + i;
+                if (++run_length >= length)
+                    return run_start;
+            }
+            ++i;
+        }
+    }
+    return 0;
+}
+
+bool FileSystem::defrag_file(uint32_t index, RateLimiter &limiter)
+{
+    Inode inode = read_inode(index);
+    uint64_t data_block_count = get_file_data_block_count(inode);
+    std::vector<uint64_t> old_blocks;
+    old_blocks.reserve(data_block_count);
+    // moving a shared block or table would store a second copy of it
+    bool sharing = shares_blocks();
+    bool shared = false;
+    walk_file_blocks(inode, [&](uint64_t block, bool table)
+                     {
+                         if (!table)
+                             old_blocks.push_back(block);
+                         if (sharing && block != 0 &&
+                             read_block_reference(block).count > 1)
+                             shared = true;
+                     });
+    if (shared)
+        return false;
+    uint64_t start = find_free_run(get_file_real_block_count(inode),
+                                   inode.group);
+    if (start == 0)
+        return false;
+
+    // the copy gets a new pointer tree, laid out in one run from start
+    Inode moved = inode;
+    std::fill(std::begin(moved.data_pointers), std::end(moved.data_pointers),
+              0);
+    std::fill(std::begin(moved.table_blocks), std::end(moved.table_blocks), 0);
+    uint64_t goal = start;
+    // a packed tail stays in its tail block
+    for (uint64_t i = 0; i < old_blocks.size(); ++i)
+    {
+        if (old_blocks[i] == 0)
+            continue;
+        limiter.acquire(this->superblock.block_size);
+        DataBlock data = read_block(old_blocks[i]);
+        write_block(allocate_data_block(moved, i, goal), data);
+    }
+
+    // the file changed while it was copied, the copy is dropped and the
+    // file is left for the next run
+    Inode current = read_inode(index);
+    if (current.size != inode.size ||
+        current.last_modified != inode.last_modified)
+    {
+        release_file_blocks(moved, 0);
+        return false;
+    }
+    if (inode.flags & INODE_TAIL_MASK)
+    {
+        moved.data_pointers[data_block_count - 1] =
+            std::exchange(inode.data_pointers[data_block_count - 1], 0);
+        inode.flags &= ~INODE_TAIL_MASK;
+    }
+    // writing the inode switches the file to the new blocks at once
+    write_inode(index, moved);
+    release_file_blocks(inode, 0);
+    return true;
+}
+
+std::string FileSystem::defrag(uint64_t bytes_per_second)
+{
+    auto timed = time_call(Metrics::DEFRAG, {}, {bytes_per_second});
+    auto paused = pause_cleaner();
+    struct Fragmentation
+    {
+        uint64_t files = 0;
+        uint64_t fragmented_files = 0;
+        uint64_t extents = 0;
+        uint64_t blocks = 0;
+    };
+
+    std::vector<uint32_t> used_inodes;
+    {
+        std::lock_guard<std::mutex> guard(this->inode_lock);
+        for (uint32_t i = 0; i < this->superblock.max_file_count; ++i)
+            if (this->inode_bitmap[i >> 3] & (1 << (i & 7)))
+                used_inodes.push_back(i);
+    }
+
+    auto measure = [&]()
+    {
+        Fragmentation result;
+        for (uint32_t index : used_inodes)
+        {
+            Inode inode = read_inode(index);
+            if (!(inode.flags & INODE_USED_MASK) || inode.size == 0)
+                continue;
+            uint64_t extents = get_file_extents(inode).size();
+            ++result.files;
+            result.fragmented_files += (extents > 1);
+            result.extents += extents;
+            result.blocks += get_file_real_block_count(inode);
+        }
+        return result;
+    };
+    auto print = [](std::stringstream &out, const std::string &title,
+                    const Fragmentation &state)
+    {
+        out << title << ": " << state.files << " files, "
+            << state.fragmented_files << " fragmented, " << state.extents
+            << " extents over " << state.blocks << " blocks";
+        if (state.extents > 0)
+            out << " (" << static_cast<double>(state.blocks) / state.extents
+                << " blocks per extent)";
+        out << "." << std::endl;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    Fragmentation before = measure();
+    RateLimiter limiter(bytes_per_second);
+    uint64_t moved_files = 0;
+    uint64_t moved_blocks = 0;
+    uint64_t skipped_files = 0;
+    for (uint32_t index : used_inodes)
+    {
+        Inode inode = read_inode(index);
+        if (!(inode.flags & INODE_USED_MASK) || inode.size == 0 ||
+            get_file_extents(inode).size() <= 1)
+            continue;
+        if (defrag_file(index, limiter))
+        {
+            ++moved_files;
+            moved_blocks += get_file_data_block_count(inode);
+        }
+        else
+            ++skipped_files;
+    }
+    Fragmentation after = measure();
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+
+    std::stringstream result;
+    print(result, "Before", before);
+    print(result, "After", after);
+    result << "Moved " << moved_files << " files (" << moved_blocks
+           << " blocks), skipped " << skipped_files << " in " << seconds
+           << " s." << std::endl;
+    return result.str();
+}
@@ -0,0 +1,776 @@
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <latch>
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "async.hpp"
+#include "buffer_pool.hpp"
+#include "device.hpp"
+#include "exceptions.hpp"
+
+// Runs job(0) to job(count - 1), the first on the calling thread and the
+// others on the workers, and rethrows the first failure once all of them
+// ended.
+static void run_jobs(ThreadPoolExecutor *workers, uint64_t count,
+                     const std::function<void(uint64_t)> &job)
+{
+    std::vector<std::exception_ptr> errors(count);
+    auto run = [&](uint64_t index)
+    {
+        try
+        {
+            job(index);
+        }
+        catch (...)
+        {
+            errors[index] = std::current_exception();
+        }
+    };
+    if (workers == nullptr || count <= 1)
+    {
+        for (uint64_t index = 0; index < count; ++index)
+            run(index);
+    }
+    else
+    {
+        std::latch done(count - 1);
+        for (uint64_t index = 1; index < count; ++index)
+            workers->post(
+                [&, index]()
+                {
+                    run(index);
+                    done.count_down();
+                });
+        run(0);
+        done.wait();
+    }
+    for (auto &error : errors)
+        if (error)
+            std::rethrow_exception(error);
+}
+
+void Device::read_copy(uint32_t, uint64_t offset, char *data, uint64_t size)
+{
+    this->read(offset, data, size);
+}
+
+FileDevice::FileDevice(const std::string &path, bool create, bool direct_io)
+    : direct(direct_io)
+{
+    int flags = O_RDWR | ((create) ? (O_CREAT | O_TRUNC) : (0)) |
+                ((direct) ? (O_DIRECT) : (0));
+    this->descriptor = ::open(path.c_str(), flags, 0644);
+    // file systems like tmpfs have no direct I/O
+    if (this->descriptor < 0 && direct && errno == EINVAL)
+        throw DirectIoException();
+    if (this->descriptor < 0)
+        throw DeviceException();
+}
+
+FileDevice::~FileDevice()
+{
+    ::close(this->descriptor);
+}
+
+bool FileDevice::aligned(uint64_t offset, const char *data,
+                         uint64_t size) const
+{
+    const uint64_t mask = BufferPool::ALIGNMENT - 1;
+    return !this->direct || ((offset | size |
+                              reinterpret_cast<uintptr_t>(data)) &
+                             mask) == 0;
+}
+
+void FileDevice::read(uint64_t offset, char *data, uint64_t size)
+{
+    if (!aligned(offset, data, size))
+    {
+        read_unaligned(offset, data, size);
+        return;
+    }
+    read_direct(offset, data, size);
+}
+
+void FileDevice::read_direct(uint64_t offset, char *data, uint64_t size)
+{
+    while (size > 0)
+    {
+        ssize_t done = ::pread(this->descriptor, data, size, offset);
+        if (done < 0)
+            throw DeviceException();
+        // past the end of the file; direct reads only stop short there and
+        // could not continue from the unaligned offset
+        if (done == 0 ||
+            (this->direct && static_cast<uint64_t>(done) < size))
+        {
+            data += done;
+            size -= done;
+            std::memset(data, 0, size);
+            return;
+        }
+        data += done;
+        offset += done;
+        size -= done;
+    }
+}
+
+void FileDevice::read_unaligned(uint64_t offset, char *data, uint64_t size)
+{
+    const uint64_t alignment = BufferPool::ALIGNMENT;
+    PooledBuffer bounce(BOUNCE_SIZE);
+    while (size > 0)
+    {
+        uint64_t start = offset / alignment * alignment;
+        uint64_t skip = offset - start;
+        uint64_t length = std::min(size, BOUNCE_SIZE - skip);
+        uint64_t window = (skip + length + alignment - 1) / alignment *
+                          alignment;
+        read_direct(start, bounce.data(), window);
+        std::memcpy(data, bounce.data() + skip, length);
+        data += length;
+        offset += length;
+        size -= length;
+    }
+}
+
+void FileDevice::write_unaligned(uint64_t offset, const char *data,
+                                 uint64_t size)
+{
+    const uint64_t alignment = BufferPool::ALIGNMENT;
+    PooledBuffer bounce(BOUNCE_SIZE);
+    std::lock_guard<std::mutex> guard(this->unaligned_lock);
+    while (size > 0)
+    {
+        uint64_t start = offset / alignment * alignment;
+        uint64_t skip = offset - start;
+        uint64_t length = std::min(size, BOUNCE_SIZE - skip);
+        uint64_t window = (skip + length + alignment - 1) / alignment *
+                          alignment;
+        // the bytes around the request in its first and last sector stay
+        if (skip != 0)
+            read_direct(start, bounce.data(), alignment);
+        if ((skip + length) % alignment != 0 &&
+            (skip == 0 || window > alignment))
+            read_direct(start + window - alignment,
+                        bounce.data() + window - alignment, alignment);
+        std::memcpy(bounce.data() + skip, data, length);
+        write(start, bounce.data(), window);
+        data += length;
+        offset += length;
+        size -= length;
+    }
+}
+
+void FileDevice::write(uint64_t offset, const char *data, uint64_t size)
+{
+    if (!aligned(offset, data, size))
+    {
+        write_unaligned(offset, data, size);
+        return;
+    }
+    while (size > 0)
+    {
+        ssize_t done = ::pwrite(this->descriptor, data, size, offset);
+        if (done <= 0)
+            throw DeviceException();
+        data += done;
+        offset += done;
+        size -= done;
+    }
+}
+
+void FileDevice::resize(uint64_t size)
+{
+    if (::ftruncate(this->descriptor, size) != 0)
+        throw DeviceException();
+}
+
+void FileDevice::sync()
+{
+    if (::fdatasync(this->descriptor) != 0)
+        throw DeviceException();
+}
+
+// Copies within the kernel, stopping at the end of the source or at the
+// first error, which the caller meets again when it copies the rest.
+static uint64_t kernel_copy(int source, uint64_t source_offset, int target,
+                            uint64_t target_offset, uint64_t size)
+{
+    loff_t from = source_offset, to = target_offset;
+    uint64_t copied = 0;
+    while (copied < size)
+    {
+        ssize_t done = ::copy_file_range(source, &from, target, &to,
+                                         size - copied, 0);
+        if (done <= 0)
+            break;
+        copied += done;
+    }
+    if (copied == size ||
+        ::lseek(target, target_offset + copied, SEEK_SET) < 0)
+        return copied;
+    off_t offset = source_offset + copied;
+    while (copied < size)
+    {
+        ssize_t done = ::sendfile(target, source, &offset, size - copied);
+        if (done <= 0)
+            break;
+        copied += done;
+    }
+    return copied;
+}
+
+uint64_t FileDevice::copy_out(uint64_t offset, int local,
+                              uint64_t position, uint64_t size)
+{
+    // the kernel would copy through the page cache the image avoids
+    if (this->direct)
+        return 0;
+    return kernel_copy(this->descriptor, offset, local, position, size);
+}
+
+uint64_t FileDevice::copy_in(int local, uint64_t position,
+                             uint64_t offset, uint64_t size)
+{
+    if (this->direct)
+        return 0;
+    return kernel_copy(local, position, this->descriptor, offset, size);
+}
+
+uint64_t FileDevice::size()
+{
+    struct stat status;
+    if (::fstat(this->descriptor, &status) != 0)
+        throw DeviceException();
+    return status.st_size;
+}
+
+void FileDevice::transfer(uint64_t offset, std::vector<iovec> &pieces,
+                          bool write)
+{
+    // one unaligned piece and each of them goes on its own
+    bool all_aligned = true;
+    for (const iovec &piece : pieces)
+        all_aligned = all_aligned &&
+                      aligned(offset, static_cast<char *>(piece.iov_base),
+                              piece.iov_len);
+    if (!all_aligned)
+    {
+        for (iovec &piece : pieces)
+        {
+            char *data = static_cast<char *>(piece.iov_base);
+            if (write)
+                this->write(offset, data, piece.iov_len);
+            else
+                this->read(offset, data, piece.iov_len);
+            offset += piece.iov_len;
+        }
+        return;
+    }
+    for (size_t first = 0; first < pieces.size(); first += IOV_MAX)
+    {
+        int count = std::min<size_t>(IOV_MAX, pieces.size() - first);
+        ssize_t done =
+            (write) ? (::pwritev(this->descriptor, &pieces[first], count,
+                                 offset))
+                    : (::preadv(this->descriptor, &pieces[first], count,
+                                offset));
+        if (done < 0)
+            throw DeviceException();
+        // whatever a short transfer left is finished piece by piece
+        for (int i = 0; i < count; ++i)
+        {
+            iovec &piece = pieces[first + i];
+            uint64_t skip = std::min<uint64_t>(done, piece.iov_len);
+            done -= skip;
+            if (skip < piece.iov_len)
+            {
+                char *data = static_cast<char *>(piece.iov_base) + skip;
+                if (write)
+                    this->write(offset + skip, data, piece.iov_len - skip);
+                else
+                    this->read(offset + skip, data, piece.iov_len - skip);
+            }
+            offset += piece.iov_len;
+        }
+    }
+}
+
+StripedDevice::StripedDevice(const std::vector<std::string> &paths,
+                             uint64_t unit, bool create, bool direct_io)
+    : stripe_unit(unit)
+{
+    for (const std::string &path : paths)
+        this->devices.push_back(
+            std::make_unique<FileDevice>(path, create, direct_io));
+    if (paths.size() > 1)
+        this->workers = std::make_unique<ThreadPoolExecutor>(paths.size() - 1);
+}
+
+StripedDevice::~StripedDevice() = default;
+
+void StripedDevice::transfer(uint64_t offset, char *data, uint64_t size,
+                             bool write)
+{
+    const uint64_t count = this->devices.size();
+    // most requests are a block or less and stay within one unit
+    if (offset % this->stripe_unit + size <= this->stripe_unit)
+    {
+        uint64_t unit = offset / this->stripe_unit;
+        uint64_t device_offset =
+            (unit / count) * this->stripe_unit + offset % this->stripe_unit;
+        if (write)
+            this->devices[unit % count]->write(device_offset, data, size);
+        else
+            this->devices[unit % count]->read(device_offset, data, size);
+        return;
+    }
+    // consecutive units of one file follow each other in it, only the
+    // memory they go to is scattered
+    std::vector<uint64_t> starts(count);
+    std::vector<std::vector<iovec>> pieces(count);
+    while (size > 0)
+    {
+        uint64_t unit = offset / this->stripe_unit;
+        uint64_t within = offset % this->stripe_unit;
+        uint64_t length = std::min(size, this->stripe_unit - within);
+        if (pieces[unit % count].empty())
+            starts[unit % count] = (unit / count) * this->stripe_unit + within;
+        pieces[unit % count].push_back({data, length});
+        offset += length;
+        data += length;
+        size -= length;
+    }
+
+    // the files with pieces run them side by side
+    std::vector<uint64_t> busy;
+    for (uint64_t device = 0; device < count; ++device)
+        if (!pieces[device].empty())
+            busy.push_back(device);
+    run_jobs(this->workers.get(), busy.size(),
+             [&](uint64_t index)
+             {
+                 uint64_t device = busy[index];
+                 this->devices[device]->transfer(starts[device],
+                                                 pieces[device], write);
+             });
+}
+
+void StripedDevice::read(uint64_t offset, char *data, uint64_t size)
+{
+    transfer(offset, data, size, false);
+}
+
+void StripedDevice::write(uint64_t offset, const char *data, uint64_t size)
+{
+    transfer(offset, const_cast<char *>(data), size, true);
+}
+
+void StripedDevice::resize(uint64_t size)
+{
+    const uint64_t count = this->devices.size();
+    uint64_t units = (size + this->stripe_unit - 1) / this->stripe_unit;
+    for (uint64_t device = 0; device < count; ++device)
+        this->devices[device]->resize(
+            (units / count + (device < units % count)) * this->stripe_unit);
+}
+
+void StripedDevice::sync()
+{
+    for (auto &device : this->devices)
+        device->sync();
+}
+
+MirroredDevice::MirroredDevice(const std::vector<std::string> &paths,
+                               const std::string &dirty_path, bool create,
+                               bool direct_io)
+    : queue_depths(paths.size())
+{
+    for (const std::string &path : paths)
+        this->mirrors.push_back(
+            std::make_unique<FileDevice>(path, create, direct_io));
+    if (paths.size() > 1)
+        this->workers = std::make_unique<ThreadPoolExecutor>(paths.size() - 1);
+    this->dirty_file = std::make_unique<FileDevice>(dirty_path, create);
+    if (!create)
+        resync();
+}
+
+MirroredDevice::~MirroredDevice()
+{
+    // the bitmap may only be cleared once every copy is on disk
+    try
+    {
+        for (auto &mirror : this->mirrors)
+            mirror->sync();
+        // only the regions of failed writes stay marked
+        std::fill(this->dirty.begin(), this->dirty.end(), 0);
+        for (auto &[region, count] : this->writing)
+            if (region / 8 < this->dirty.size())
+                this->dirty[region / 8] |= 1 << (region % 8);
+        this->dirty_file->write(0, reinterpret_cast<char *>(this->dirty.data()),
+                                this->dirty.size());
+        this->dirty_file->sync();
+    }
+    catch (const DeviceException &)
+    {
+        // left dirty, the next open resyncs
+    }
+}
+
+void MirroredDevice::resync()
+{
+    this->dirty.resize(this->dirty_file->size());
+    this->dirty_file->read(0, reinterpret_cast<char *>(this->dirty.data()),
+                           this->dirty.size());
+    std::vector<char> region(REGION_SIZE);
+    bool copied = false;
+    for (uint64_t byte = 0; byte < this->dirty.size(); ++byte)
+    {
+        for (uint32_t bit = 0; bit < 8; ++bit)
+        {
+            if (!(this->dirty[byte] & (1 << bit)))
+                continue;
+            // the first mirror is as good as any other: a write that was
+            // interrupted may land on either side
+            uint64_t offset = (byte * 8 + bit) * REGION_SIZE;
+            this->mirrors[0]->read(offset, region.data(), REGION_SIZE);
+            for (uint64_t i = 1; i < this->mirrors.size(); ++i)
+                this->mirrors[i]->write(offset, region.data(), REGION_SIZE);
+            copied = true;
+        }
+    }
+    if (!copied)
+        return;
+    // regions copied past the end of the image grew the other mirrors
+    uint64_t size = this->mirrors[0]->size();
+    for (uint64_t i = 1; i < this->mirrors.size(); ++i)
+    {
+        this->mirrors[i]->resize(size);
+        this->mirrors[i]->sync();
+    }
+    std::fill(this->dirty.begin(), this->dirty.end(), 0);
+    this->dirty_file->write(0, reinterpret_cast<char *>(this->dirty.data()),
+                            this->dirty.size());
+    this->dirty_file->sync();
+}
+
+void MirroredDevice::mark_dirty(uint64_t offset, uint64_t size)
+{
+    uint64_t first = offset / REGION_SIZE;
+    uint64_t last = (offset + size - 1) / REGION_SIZE;
+    std::lock_guard<std::mutex> guard(this->dirty_lock);
+    if (this->dirty.size() <= last / 8)
+        this->dirty.resize(last / 8 + 1, 0);
+    uint64_t low = this->dirty.size(), high = 0;
+    for (uint64_t region = first; region <= last; ++region)
+    {
+        ++this->writing[region];
+        this->settled.erase(region);
+        uint8_t mask = 1 << (region % 8);
+        if (this->dirty[region / 8] & mask)
+            continue;
+        this->dirty[region / 8] |= mask;
+        low = std::min(low, region / 8);
+        high = region / 8;
+    }
+    // a region written again before it is cleared costs no bitmap write
+    if (low > high)
+        return;
+    this->dirty_file->write(
+        low, reinterpret_cast<char *>(this->dirty.data() + low),
+        high - low + 1);
+    this->dirty_file->sync();
+}
+
+bool MirroredDevice::settle(uint64_t offset, uint64_t size)
+{
+    uint64_t first = offset / REGION_SIZE;
+    uint64_t last = (offset + size - 1) / REGION_SIZE;
+    std::lock_guard<std::mutex> guard(this->dirty_lock);
+    for (uint64_t region = first; region <= last; ++region)
+    {
+        auto found = this->writing.find(region);
+        if (--found->second > 0)
+            continue;
+        this->writing.erase(found);
+        this->settled.insert(region);
+    }
+    return this->settled.size() >= SETTLED_REGIONS;
+}
+
+void MirroredDevice::clear_settled()
+{
+    std::set<uint64_t> regions;
+    {
+        std::lock_guard<std::mutex> guard(this->dirty_lock);
+        regions.swap(this->settled);
+    }
+    // the writes of the regions are on disk in every copy after this
+    for (auto &mirror : this->mirrors)
+        mirror->sync();
+    if (regions.empty())
+        return;
+    std::lock_guard<std::mutex> guard(this->dirty_lock);
+    uint64_t low = this->dirty.size(), high = 0;
+    for (uint64_t region : regions)
+    {
+        // written again meanwhile, it settles anew
+        if (region / 8 >= this->dirty.size() ||
+            this->writing.count(region) || this->settled.count(region))
+            continue;
+        this->dirty[region / 8] &= ~(1 << (region % 8));
+        low = std::min(low, region / 8);
+        high = region / 8;
+    }
+    // a cleared bit that does not reach the disk only costs a copy
+    if (low <= high)
+        this->dirty_file->write(
+            low, reinterpret_cast<char *>(this->dirty.data() + low),
+            high - low + 1);
+}
+
+uint32_t MirroredDevice::pick_mirror()
+{
+    const uint32_t count = this->mirrors.size();
+    // ties rotate, so a single reader still spreads over the mirrors
+    uint32_t start = this->next_mirror++ % count;
+    uint32_t best = start;
+    for (uint32_t i = 1; i < count; ++i)
+    {
+        uint32_t mirror = (start + i) % count;
+        if (this->queue_depths[mirror] < this->queue_depths[best])
+            best = mirror;
+    }
+    return best;
+}
+
+void MirroredDevice::read(uint64_t offset, char *data, uint64_t size)
+{
+    const uint64_t count = this->mirrors.size();
+    if (size < SPLIT_SIZE)
+    {
+        uint32_t mirror = pick_mirror();
+        ++this->queue_depths[mirror];
+        try
+        {
+            this->mirrors[mirror]->read(offset, data, size);
+        }
+        catch (...)
+        {
+            --this->queue_depths[mirror];
+            throw;
+        }
+        --this->queue_depths[mirror];
+        return;
+    }
+    // every mirror reads its own slice
+    uint64_t slice = (size / count + 4095) / 4096 * 4096;
+    run_jobs(this->workers.get(), count,
+             [&](uint64_t mirror)
+             {
+                 uint64_t start = mirror * slice;
+                 if (start >= size)
+                     return;
+                 ++this->queue_depths[mirror];
+                 try
+                 {
+                     this->mirrors[mirror]->read(
+                         offset + start, data + start,
+                         std::min(slice, size - start));
+                 }
+                 catch (...)
+                 {
+                     --this->queue_depths[mirror];
+                     throw;
+                 }
+                 --this->queue_depths[mirror];
+             });
+}
+
+void MirroredDevice::write(uint64_t offset, const char *data, uint64_t size)
+{
+    if (size == 0)
+        return;
+    mark_dirty(offset, size);
+    if (size < SPLIT_SIZE)
+    {
+        for (auto &mirror : this->mirrors)
+            mirror->write(offset, data, size);
+    }
+    else
+        run_jobs(this->workers.get(), this->mirrors.size(),
+                 [&](uint64_t mirror)
+                 { this->mirrors[mirror]->write(offset, data, size); });
+    if (settle(offset, size))
+        clear_settled();
+}
+
+void MirroredDevice::resize(uint64_t size)
+{
+    for (auto &mirror : this->mirrors)
+        mirror->resize(size);
+    std::lock_guard<std::mutex> guard(this->dirty_lock);
+    uint64_t regions = (size + REGION_SIZE - 1) / REGION_SIZE;
+    this->dirty.resize((regions + 7) / 8, 0);
+    this->dirty_file->resize(this->dirty.size());
+}
+
+void MirroredDevice::sync()
+{
+    clear_settled();
+}
+
+uint64_t MirroredDevice::copy_out(uint64_t offset, int local,
+                                  uint64_t position, uint64_t size)
+{
+    uint32_t mirror = pick_mirror();
+    ++this->queue_depths[mirror];
+    uint64_t copied =
+        this->mirrors[mirror]->copy_out(offset, local, position, size);
+    --this->queue_depths[mirror];
+    return copied;
+}
+
+uint32_t MirroredDevice::copy_count()
+{
+    return this->mirrors.size();
+}
+
+void MirroredDevice::read_copy(uint32_t copy, uint64_t offset, char *data,
+                               uint64_t size)
+{
+    this->mirrors[copy]->read(offset, data, size);
+}
+
+MemoryDevice::~MemoryDevice()
+{
+    if (this->arena != nullptr)
+        ::munmap(this->arena, this->capacity);
+}
+
+void MemoryDevice::reserve(uint64_t size)
+{
+    const uint64_t huge_page = 2 << 20;
+    if (size <= this->capacity)
+        return;
+    uint64_t wanted = std::max(size, 2 * this->capacity);
+    wanted = (wanted + huge_page - 1) / huge_page * huge_page;
+    void *memory = ::mmap(nullptr, wanted, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    // without reserved huge pages transparent ones are the next best
+    if (memory == MAP_FAILED)
+    {
+        memory = ::mmap(nullptr, wanted, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            throw std::bad_alloc();
+        ::madvise(memory, wanted, MADV_HUGEPAGE);
+    }
+    if (this->arena != nullptr)
+    {
+        std::memcpy(memory, this->arena, this->length);
+        ::munmap(this->arena, this->capacity);
+    }
+    this->arena = static_cast<char *>(memory);
+    this->capacity = wanted;
+}
+
+void MemoryDevice::read(uint64_t offset, char *data, uint64_t size)
+{
+    uint64_t stored = (offset < this->length)
+                          ? (std::min(size, this->length - offset))
+                          : (0);
+    if (stored > 0)
+        std::memcpy(data, this->arena + offset, stored);
+    std::memset(data + stored, 0, size - stored);
+}
+
+void MemoryDevice::write(uint64_t offset, const char *data, uint64_t size)
+{
+    if (offset + size > this->length)
+        resize(offset + size);
+    std::memcpy(this->arena + offset, data, size);
+}
+
+void MemoryDevice::resize(uint64_t size)
+{
+    reserve(size);
+    // a later growth has to read as zeros again
+    if (size < this->length)
+        std::memset(this->arena + size, 0, this->length - size);
+    this->length = size;
+}
+
+uint64_t MemoryDevice::copy_out(uint64_t offset, int local,
+                                uint64_t position, uint64_t size)
+{
+    uint64_t stored = (offset < this->length)
+                          ? (std::min(size, this->length - offset))
+                          : (0);
+    uint64_t copied = 0;
+    while (copied < stored)
+    {
+        ssize_t done = ::pwrite(local, this->arena + offset + copied,
+                                stored - copied, position + copied);
+        if (done <= 0)
+            break;
+        copied += done;
+    }
+    return copied;
+}
+
+uint64_t MemoryDevice::copy_in(int local, uint64_t position,
+                               uint64_t offset, uint64_t size)
+{
+    if (offset + size > this->length)
+        resize(offset + size);
+    uint64_t copied = 0;
+    while (copied < size)
+    {
+        ssize_t done = ::pread(local, this->arena + offset + copied,
+                               size - copied, position + copied);
+        if (done <= 0)
+            break;
+        copied += done;
+    }
+    return copied;
+}
+
+void MemoryDevice::load(const std::string &path)
+{
+    FileDevice file(path, false);
+    uint64_t size = file.size();
+    resize(size);
+    file.read(0, this->arena, size);
+}
+
+uint64_t MemoryDevice::dump(const std::string &path)
+{
+    std::string temporary = path + ".tmp";
+    {
+        FileDevice file(temporary, true);
+        file.write(0, this->arena, this->length);
+        file.sync();
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0)
+        throw DeviceException();
+    return this->length;
+}
+
+std::string backing_file_name(const std::string &name, uint32_t index)
+{
+    return (index == 0) ? (name) : (name + "." + std::to_string(index));
+}
@@ -0,0 +1,98 @@
+#include <cstring>
+#include <functional>
+#include <sstream>
+
+#include "fs.hpp"
+#include "exceptions.hpp"
+
+std::string FileSystem::filefrag(const std::string &path)
+{
+    auto timed = time_call(Metrics::FILEFRAG, {path});
+    auto paused = pause_cleaner(Access::READ);
+    struct Totals
+    {
+        uint64_t files = 0;
+        uint64_t data_blocks = 0;
+        uint64_t table_blocks = 0;
+        uint64_t extents = 0;
+    } totals;
+
+    std::stringstream result;
+    std::string root_path = (path.empty()) ? ("/") : (path);
+    uint32_t root = find_file_in_dir(root_path);
+    bool single_file =
+        (read_inode(root).flags & INODE_MODE_MASK) != FILE_TYPE::DIR;
+
+    // one line per file, the score is the share of block transitions that
+    // stay contiguous (100 - laid out in a single run)
+    auto report = [&](const std::string &name, const Inode &inode)
+    {
+        std::vector<Extent> extents = get_file_extents(inode);
+        // counted from the extents, compressed files leave holes
+        uint64_t blocks = 0;
+        uint64_t table_blocks = 0;
+        for (const Extent &extent : extents)
+        {
+            blocks += extent.length;
+            table_blocks += extent.table_count;
+        }
+        double score = (blocks > 1)
+                           ? (100.0 * (blocks - extents.size()) / (blocks - 1))
+                           : (100.0);
+        result << name << ": size " << inode.size << ", "
+               << blocks - table_blocks << " data blocks, " << table_blocks
+               << " table blocks, " << extents.size() << " extents";
+        if ((inode.flags & INODE_COMPRESSED_MASK) &&
+            (inode.flags & INODE_MODE_MASK) == FILE_TYPE::FILE)
+            result << ", compressed";
+        if (inode.flags & INODE_TAIL_MASK)
+            result << ", tail packed";
+        if (!extents.empty())
+            result << ", average run "
+                   << static_cast<double>(blocks) / extents.size();
+        result << ", score " << score << "." << std::endl;
+        if (single_file)
+        {
+            for (size_t i = 0; i < extents.size(); ++i)
+                result << "  extent " << i << ": blocks " << extents[i].start
+                       << "-" << extents[i].start + extents[i].length - 1
+                       << " (" << extents[i].length << ", "
+                       << extents[i].table_count << " tables)" << std::endl;
+        }
+        ++totals.files;
+        totals.data_blocks += blocks - table_blocks;
+        totals.table_blocks += table_blocks;
+        totals.extents += extents.size();
+    };
+
+    std::function<void(uint32_t, const std::string &)> walk =
+        [&](uint32_t index, const std::string &name)
+    {
+        Inode inode = read_inode(index);
+        report(name, inode);
+        if ((inode.flags & INODE_MODE_MASK) != FILE_TYPE::DIR)
+            return;
+        for (auto &[child_name, child] : read_directory(index))
+        {
+            if (child_name != "." && child_name != "..")
+                walk(child, ((name.back() == '/') ? (name) : (name + "/")) +
+                                child_name);
+        }
+    };
+    walk(root, root_path);
+
+    if (!single_file)
+    {
+        result << "Total: " << totals.files << " files, "
+               << totals.data_blocks << " data blocks, "
+               << totals.table_blocks << " table blocks, " << totals.extents
+               << " extents";
+        if (totals.extents > 0)
+            result << ", average run "
+                   << static_cast<double>(totals.data_blocks +
+                                          totals.table_blocks) /
+                          totals.extents;
+        result << "." << std::endl;
+    }
+    return result.str();
+}
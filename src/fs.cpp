@@ -4,9 +4,71 @@
 #include <sstream>
 #include <algorithm>
 #include <iostream>
+#include <bit>
+#include <cstring>
+#include <functional>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "fs.hpp"
 #include "exceptions.hpp"
+#include "crc32c.hpp"
+#include "block_hash.hpp"
+
+thread_local uint32_t FileSystem::current_group = 0;
+
+namespace
+{
+    // Compile-time geometry for the common block sizes, so that the data
+    // path is compiled with constant shifts, masks and copy lengths.
+    template <uint32_t Size>
+    struct StaticGeometry
+    {
+        static constexpr uint32_t block_size = Size;
+        static constexpr uint32_t block_shift = std::countr_zero(Size);
+        static constexpr uint32_t pointers_per_block = Size / sizeof(uint64_t);
+        static constexpr uint32_t pointer_shift =
+            std::countr_zero(pointers_per_block);
+    };
+
+    struct DynamicGeometry
+    {
+        uint32_t block_size;
+        uint32_t block_shift;
+        uint32_t pointers_per_block;
+        uint32_t pointer_shift;
+
+        explicit DynamicGeometry(uint32_t size)
+            : block_size(size), block_shift(std::countr_zero(size)),
+              pointers_per_block(size / sizeof(uint64_t)),
+              pointer_shift(std::countr_zero(size / sizeof(uint64_t)))
+        {
+        }
+    };
+
+    template <typename Function>
+    auto dispatch_geometry(uint32_t block_size, Function &&function)
+    {
+        switch (block_size)
+        {
+        case 1024:
+            return function(StaticGeometry<1024>{});
+        case 4096:
+            return function(StaticGeometry<4096>{});
+        case 65536:
+            return function(StaticGeometry<65536>{});
+        default:
+            return function(DynamicGeometry(block_size));
+        }
+    }
+}
+
+bool FileSystem::shares_blocks()
+{
+    return this->superblock.features & (FEATURE_DEDUP | FEATURE_REFLINK);
+}
 
 uint64_t FileSystem::get_current_time()
 {
@@ -16,40 +78,192 @@ uint64_t FileSystem::get_current_time()
         .count();
 }
 
+// Reserves the returned inode in the inode bitmap.
 int FileSystem::find_unused_inode()
 {
-    this->drive->seekg(this->inodes_offset);
-    Inode inode;
-    for (int i = 0; i < this->superblock.max_file_count; ++i)
+    std::lock_guard<std::mutex> guard(this->inode_lock);
+    uint32_t count = this->superblock.max_file_count;
+    for (uint32_t i = 0; i < count;)
     {
-        this->drive->read(reinterpret_cast<char *>(&inode), sizeof(Inode));
-        if (!(inode.flags & INODE_USED_MASK))
+        uint32_t candidate = (this->next_free_inode + i) % count;
+        uint8_t byte = this->inode_bitmap[candidate >> 3];
+        if (byte == 0xFF)
         {
-            return i;
+            i += 8 - (candidate & 7);
+            continue;
         }
+        if (!(byte & (1 << (candidate & 7))))
+        {
+            write_inode_bitmap(candidate, true);
+            this->next_free_inode = (candidate + 1) % count;
+            return candidate;
+        }
+        ++i;
     }
     throw NoEmptyInodesException();
 }
 
+void FileSystem::release_inode(int index)
+{
+    forget_directory(index);
+    std::lock_guard<std::mutex> guard(this->inode_lock);
+    write_inode_bitmap(index, false);
+}
+
+// The caller has to hold inode_lock.
+void FileSystem::write_inode_bitmap(uint32_t index, bool used)
+{
+    uint8_t &existing = this->inode_bitmap[index >> 3];
+    existing = existing & ~(1 << (index & 7));
+    if (used)
+        existing = existing | (1 << (index & 7));
+    std::lock_guard<std::mutex> guard(this->drive_lock);
+    this->drive->write(inode_bitmap_offset + (index >> 3),
+                       reinterpret_cast<char *>(&existing), 1);
+}
+
 void FileSystem::write_superblock()
 {
-    this->drive->seekp(0);
-    this->drive->write(reinterpret_cast<char *>(&superblock),
+    if (this->batching)
+    {
+        std::lock_guard<std::mutex> guard(this->batch_lock);
+        this->superblock_dirty = true;
+        return;
+    }
+    std::lock_guard<std::mutex> guard(this->drive_lock);
+    this->drive->write(0, reinterpret_cast<char *>(&superblock),
                        sizeof(superblock));
 }
 
-void FileSystem::insert_block_data(DataBlock &block, char *data, int size, int pos)
+uint64_t FileSystem::touch_superblock()
+{
+    uint64_t now = get_current_time();
+    std::lock_guard<std::mutex> guard(this->superblock_lock);
+    this->superblock.last_modified = now;
+    return now;
+}
+
+void FileSystem::write_checksum(uint64_t index, const char *data)
+{
+    if (!(this->superblock.features & FEATURE_CHECKSUMS))
+        return;
+    uint32_t checksum = crc32c(data, this->superblock.block_size);
+    this->drive->write(checksums_offset + index * sizeof(uint32_t),
+                       reinterpret_cast<char *>(&checksum), sizeof(uint32_t));
+}
+
+// A stored zero means the block was never written since formatting.
+void FileSystem::verify_checksum(uint64_t index, const char *data)
+{
+    if (!(this->superblock.features & FEATURE_CHECKSUMS))
+        return;
+    uint32_t stored;
+    this->drive->read(checksums_offset + index * sizeof(uint32_t),
+                      reinterpret_cast<char *>(&stored), sizeof(uint32_t));
+    if (stored != 0 && stored != crc32c(data, this->superblock.block_size))
+        throw ChecksumMismatchException();
+}
+
+// Looks for a copy of the block matching its checksum on a mirrored drive
+// and writes it over all copies. Expects drive_lock to be held.
+bool FileSystem::heal_block(uint64_t index, char *data)
 {
-    char *data_pointer = data;
-    int end_pos = pos + size;
-    for (int i = pos; i < end_pos && i < BLOCK_SIZE; ++i, ++data_pointer)
+    const uint32_t block_size = this->superblock.block_size;
+    if (!(this->superblock.features & FEATURE_CHECKSUMS) ||
+        this->drive->copy_count() <= 1)
+        return false;
+    uint32_t stored;
+    this->drive->read(checksums_offset + index * sizeof(uint32_t),
+                      reinterpret_cast<char *>(&stored), sizeof(uint32_t));
+    for (uint32_t copy = 0; copy < this->drive->copy_count(); ++copy)
     {
-        block.data[i] = *data_pointer;
+        this->drive->read_copy(copy, blocks_offset + index * block_size, data,
+                               block_size);
+        if (stored == crc32c(data, block_size))
+        {
+            this->drive->write(blocks_offset + index * block_size, data,
+                               block_size);
+            return true;
+        }
     }
+    return false;
+}
+
+void FileSystem::check_block(uint64_t index, char *data)
+{
+    try
+    {
+        verify_checksum(index, data);
+    }
+    catch (const ChecksumMismatchException &)
+    {
+        if (!heal_block(index, data))
+            throw;
+    }
+}
+
+void FileSystem::write_group_descriptor(uint32_t group_index)
+{
+    if (this->batching)
+    {
+        std::lock_guard<std::mutex> guard(this->batch_lock);
+        this->dirty_groups.insert(group_index);
+        return;
+    }
+    std::lock_guard<std::mutex> guard(this->drive_lock);
+    this->drive->write(
+        groups_offset + group_index * sizeof(GroupDescriptor),
+        reinterpret_cast<char *>(&this->groups[group_index]->descriptor),
+        sizeof(GroupDescriptor));
+}
+
+uint32_t FileSystem::get_group_index(uint64_t block_index)
+{
+    return block_index / this->superblock.blocks_per_group;
+}
+
+uint32_t FileSystem::choose_directory_group()
+{
+    // Spread directories: among the groups with at least the average
+    // amount of free blocks pick the one holding the fewest directories.
+    uint64_t average_free = this->superblock.free_count /
+                            this->superblock.group_count;
+    uint32_t best = 0;
+    uint32_t best_directories = UINT32_MAX;
+    for (uint32_t i = 0; i < this->superblock.group_count; ++i)
+    {
+        AllocationGroup &group = *this->groups[i];
+        std::lock_guard<std::mutex> guard(group.lock);
+        if (group.descriptor.free_count >= average_free &&
+            group.descriptor.directory_count < best_directories)
+        {
+            best = i;
+            best_directories = group.descriptor.directory_count;
+        }
+    }
+    return best;
+}
+
+void FileSystem::insert_block_data(DataBlock &block, char *data, int size, int pos)
+{
+    int end_pos = std::min<int>(pos + size, block.size());
+    std::memcpy(block.data() + pos, data, end_pos - pos);
 }
 
 void FileSystem::write_block(uint64_t index, char *data, int size, int pos)
 {
+    if (pos == 0 && size == static_cast<int>(this->superblock.block_size))
+    {
+        auto timed =
+            this->metrics.time_block(this->metrics.block_write_latency);
+        ++this->metrics.block_writes;
+        std::lock_guard<std::mutex> guard(this->drive_lock);
+        this->drive->write(blocks_offset +
+                               index * this->superblock.block_size,
+                           data, size);
+        write_checksum(index, data);
+        return;
+    }
     DataBlock block = this->read_block(index);
     this->insert_block_data(block, data, size, pos);
     this->write_block(index, block);
@@ -57,94 +271,463 @@ void FileSystem::write_block(uint64_t index, char *data, int size, int pos)
 
 void FileSystem::write_block(uint64_t index, DataBlock &block)
 {
-    this->drive->seekp(blocks_offset + index * sizeof(DataBlock));
-    this->drive->write(reinterpret_cast<char *>(&block), sizeof(DataBlock));
+    auto timed = this->metrics.time_block(this->metrics.block_write_latency);
+    ++this->metrics.block_writes;
+    std::lock_guard<std::mutex> guard(this->drive_lock);
+    this->drive->write(blocks_offset + index * this->superblock.block_size,
+                       block.data(), block.size());
+    write_checksum(index, block.data());
 }
 
-FileSystem::DataBlock FileSystem::read_block(int index)
+FileSystem::DataBlock FileSystem::read_block(uint64_t index)
 {
-    DataBlock result;
-    this->drive->seekg(blocks_offset + index * sizeof(DataBlock));
-    this->drive->read(reinterpret_cast<char *>(&result), sizeof(DataBlock));
+    DataBlock result(this->superblock.block_size);
+    auto timed = this->metrics.time_block(this->metrics.block_read_latency);
+    ++this->metrics.block_reads;
+    std::lock_guard<std::mutex> guard(this->drive_lock);
+    this->drive->read(blocks_offset + index * this->superblock.block_size,
+                      result.data(), result.size());
+    check_block(index, result.data());
     return result;
 }
 
+void FileSystem::read_blocks(uint64_t first, uint64_t count, char *dest)
+{
+    const uint32_t block_size = this->superblock.block_size;
+    auto timed = this->metrics.time_block(this->metrics.block_read_latency);
+    this->metrics.block_reads += count;
+    std::lock_guard<std::mutex> guard(this->drive_lock);
+    this->drive->read(blocks_offset + first * block_size, dest,
+                      count * block_size);
+    for (uint64_t i = 0; i < count; ++i)
+        check_block(first + i, dest + i * block_size);
+}
+
+void FileSystem::write_blocks(uint64_t first, uint64_t count,
+                              const char *data)
+{
+    const uint32_t block_size = this->superblock.block_size;
+    auto timed = this->metrics.time_block(this->metrics.block_write_latency);
+    this->metrics.block_writes += count;
+    std::lock_guard<std::mutex> guard(this->drive_lock);
+    this->drive->write(blocks_offset + first * block_size, data,
+                       count * block_size);
+    for (uint64_t i = 0; i < count; ++i)
+        write_checksum(first + i, data + i * block_size);
+}
+
 FileSystem::Inode FileSystem::read_inode(int index)
 {
     Inode result;
-    this->drive->seekg(inodes_offset + index * sizeof(Inode));
-    this->drive->read(reinterpret_cast<char *>(&result), sizeof(Inode));
+    ++this->metrics.inode_reads;
+    std::lock_guard<std::mutex> guard(this->drive_lock);
+    this->drive->read(inodes_offset + index * sizeof(Inode),
+                      reinterpret_cast<char *>(&result), sizeof(Inode));
     return result;
 }
 
-int FileSystem::get_file_data_block_count(uint64_t size)
+uint64_t FileSystem::get_file_data_block_count(uint64_t size)
 {
     return (size + this->superblock.block_size - 1) /
            this->superblock.block_size;
 }
 
-int FileSystem::get_file_real_block_count(const Inode &inode)
+uint64_t FileSystem::get_file_real_block_count(const Inode &inode)
 {
     return get_file_real_block_count(inode.size);
 }
 
-int FileSystem::get_file_real_block_count(uint64_t size)
+uint64_t FileSystem::get_file_real_block_count(uint64_t size)
 {
-    int data_block_count = get_file_data_block_count(size);
-    int result = data_block_count;
-    if (data_block_count > INODE_PRIMARY_TABLE_SIZE)
+    // data blocks plus every table of the pointer trees they need
+    uint64_t data_block_count = get_file_data_block_count(size);
+    uint64_t result = data_block_count;
+    if (data_block_count <= INODE_PRIMARY_TABLE_SIZE)
     {
-        ++result;
+        return result;
     }
-    if (data_block_count >
-        INODE_PRIMARY_TABLE_SIZE + INODE_BLOCK_POINTER_TABLE_SIZE)
+    uint64_t remaining = data_block_count - INODE_PRIMARY_TABLE_SIZE;
+    for (int level = 1; level <= INODE_TABLE_LEVELS && remaining > 0;
+         ++level)
     {
-        result += 1 + (data_block_count - INODE_PRIMARY_TABLE_SIZE - 1) /
-                          this->superblock.block_size;
+        uint64_t span = 1ull << (this->pointer_shift * level);
+        uint64_t count = std::min(remaining, span);
+        for (int depth = 1; depth <= level; ++depth)
+        {
+            uint64_t table_span = 1ull << (this->pointer_shift * depth);
+            result += (count + table_span - 1) / table_span;
+        }
+        remaining -= count;
     }
     return result;
 }
 
-uint32_t FileSystem::find_unused_block()
+uint32_t FileSystem::find_unused_block(AllocationGroup &group, uint32_t goal)
 {
-    for (uint32_t i = 0; i < this->superblock.block_count; ++i)
+    // next-fit scan of the cached group bitmap starting at goal, skipping
+    // fully used bytes
+    uint64_t probes = 0;
+    for (uint32_t i = 0; i < group.block_count; ++probes)
     {
-        if (!read_bitmap(i))
+        uint32_t candidate = (goal + i) % group.block_count;
+        uint8_t byte = group.bitmap[candidate >> 3];
+        if (byte == 0xFF)
+        {
+            i += 8 - (candidate & 7);
+            continue;
+        }
+        if (!(byte & (1 << (candidate & 7))))
         {
-            return i;
+            this->metrics.bitmap_probes += probes + 1;
+            return candidate;
         }
+        ++i;
     }
+    this->metrics.bitmap_probes += probes;
     throw MemoryException();
 }
 
-[[nodiscard]] uint32_t FileSystem::allocate_block()
+[[nodiscard]] uint64_t FileSystem::allocate_block(uint64_t goal)
 {
-    uint32_t new_block_index = find_unused_block();
-    write_bitmap(new_block_index, true);
-    ++this->superblock.occupied_count;
-    --this->superblock.free_count;
-    write_superblock();
-    return new_block_index;
+    // a log-structured image ignores the goal and appends to the log, until
+    // it runs out of clean segments
+    if (this->superblock.features & FEATURE_LOG)
+    {
+        uint64_t block = allocate_log_block(false);
+        if (block != 0)
+            return block;
+    }
+    uint32_t group_count = this->superblock.group_count;
+    if (goal >= this->superblock.block_count)
+        goal = 0;
+    uint32_t goal_group = get_group_index(goal);
+    uint32_t group_index = goal_group;
+    for (uint32_t tried = 0; tried <= group_count; ++tried)
+    {
+        AllocationGroup &group = *this->groups[group_index];
+        std::unique_lock<std::mutex> guard(group.lock);
+        if (group.descriptor.free_count > 0)
+        {
+            load_group_bitmap(group_index);
+            uint32_t offset = (group_index == goal_group)
+                                  ? (goal - group.first_block)
+                                  : (group.next_free);
+            uint32_t found = find_unused_block(group, offset);
+            uint64_t new_block_index = group.first_block + found;
+            write_bitmap(new_block_index, true);
+            --group.descriptor.free_count;
+            group.next_free = (found + 1) % group.block_count;
+            write_group_descriptor(group_index);
+            guard.unlock();
+
+            current_group = group_index;
+            // nobody else knows the block yet, no need for reference_lock
+            if (shares_blocks())
+                write_block_reference(new_block_index, {0, 1});
+            std::lock_guard<std::mutex> superblock_guard(this->superblock_lock);
+            ++this->superblock.occupied_count;
+            --this->superblock.free_count;
+            write_superblock();
+            return new_block_index;
+        }
+        // the goal group is full, continue in the group this thread
+        // already works in and only then move on to the next ones
+        group_index = (tried == 0) ? (current_group % group_count)
+                                   : ((group_index + 1) % group_count);
+    }
+    throw MemoryException();
 }
 
-void FileSystem::release_block(uint32_t index)
+void FileSystem::release_block(uint64_t index)
 {
-    DataBlock empty = {{0}};
-    write_bitmap(index, false);
-    write_block(index, empty);
+    if (shares_blocks())
+    {
+        // a shared block only loses one reference
+        std::lock_guard<std::mutex> guard(this->reference_lock);
+        BlockReference reference = read_block_reference(index);
+        if (reference.count > 1)
+        {
+            --reference.count;
+            write_block_reference(index, reference);
+            return;
+        }
+        auto found = this->dedup_index.find(reference.hash);
+        if (reference.hash != 0 && found != this->dedup_index.end() &&
+            found->second == index)
+            this->dedup_index.erase(found);
+        write_block_reference(index, {0, 0});
+    }
+    // the log leaves old versions where they are instead of writing to
+    // them once more, blocks it hands out to a growing file are zeroed then
+    if (!(this->superblock.features & FEATURE_LOG))
+    {
+        DataBlock empty(this->superblock.block_size, 0);
+        write_block(index, empty);
+    }
+    uint32_t group_index = get_group_index(index);
+    AllocationGroup &group = *this->groups[group_index];
+    {
+        std::lock_guard<std::mutex> guard(group.lock);
+        load_group_bitmap(group_index);
+        write_bitmap(index, false);
+        ++group.descriptor.free_count;
+        write_group_descriptor(group_index);
+    }
+    std::lock_guard<std::mutex> superblock_guard(this->superblock_lock);
     --this->superblock.occupied_count;
     ++this->superblock.free_count;
     write_superblock();
 }
 
-int FileSystem::get_file_data_block_count(const Inode &inode)
+// Tables are zeroed when allocated, a zero pointer marks a missing block
+// (block 0 is reserved at format time).
+uint64_t FileSystem::allocate_table_block(uint64_t goal)
+{
+    uint64_t table = allocate_block(goal);
+    DataBlock empty(this->superblock.block_size, 0);
+    write_block(table, empty);
+    return table;
+}
+
+uint64_t FileSystem::unshare_table(uint64_t table, uint64_t &goal)
+{
+    if (!shares_blocks())
+        return table;
+    std::unique_lock<std::mutex> guard(this->reference_lock);
+    if (read_block_reference(table).count <= 1)
+        return table;
+    guard.unlock();
+    uint64_t copy = allocate_block(goal);
+    goal = copy + 1;
+    DataBlock content = read_block(table);
+    write_block(copy, content);
+    // the children gain the copy as a second parent
+    guard.lock();
+    for (uint32_t i = 0; i < this->pointers_per_block; ++i)
+    {
+        uint64_t child;
+        std::memcpy(&child, content.data() + i * sizeof(uint64_t),
+                    sizeof(uint64_t));
+        if (child == 0)
+            continue;
+        BlockReference reference = read_block_reference(child);
+        ++reference.count;
+        write_block_reference(child, reference);
+    }
+    guard.unlock();
+    release_block(table);
+    return copy;
+}
+
+// Returns the pointer slot of the logical block: a table and an index in
+// it, or table 0 and an index into the direct pointers. Shared tables on
+// the way are copied and missing ones allocated.
+FileSystem::PointerSlot FileSystem::find_pointer_slot(Inode &inode,
+                                                      uint64_t block,
+                                                      uint64_t &goal)
+{
+    if (block < INODE_PRIMARY_TABLE_SIZE)
+        return {0, block};
+    block -= INODE_PRIMARY_TABLE_SIZE;
+    for (int level = 1; level <= INODE_TABLE_LEVELS; ++level)
+    {
+        uint64_t span = 1ull << (this->pointer_shift * level);
+        if (block >= span)
+        {
+            block -= span;
+            continue;
+        }
+        uint64_t &root = inode.table_blocks[level - 1];
+        if (root == 0)
+        {
+            root = allocate_table_block(goal);
+            goal = root + 1;
+        }
+        else
+            root = unshare_table(root, goal);
+        uint64_t table = root;
+        for (int depth = level - 1; depth > 0; --depth)
+        {
+            uint64_t index = (block >> (this->pointer_shift * depth)) &
+                             (this->pointers_per_block - 1);
+            uint64_t next = read_table_block_pointer(table, index);
+            uint64_t copy = (next == 0) ? (allocate_table_block(goal))
+                                        : (unshare_table(next, goal));
+            if (next == 0)
+                goal = copy + 1;
+            if (copy != next)
+                write_table_block_pointer(table, index, copy);
+            table = copy;
+        }
+        return {table, block & (this->pointers_per_block - 1)};
+    }
+    throw FileSizeTooBigException();
+}
+
+uint64_t FileSystem::allocate_data_block(Inode &inode, uint64_t block,
+                                         uint64_t &goal)
+{
+    PointerSlot slot = find_pointer_slot(inode, block, goal);
+    uint64_t pointer = (slot.table == 0)
+                           ? (inode.data_pointers[slot.index])
+                           : (read_table_block_pointer(slot.table,
+                                                       slot.index));
+    if (pointer == 0)
+    {
+        pointer = allocate_block(goal);
+        if (slot.table == 0)
+            inode.data_pointers[slot.index] = pointer;
+        else
+            write_table_block_pointer(slot.table, slot.index, pointer);
+    }
+    goal = pointer + 1;
+    return pointer;
+}
+
+uint64_t FileSystem::map_data_block(Inode &inode, uint64_t block,
+                                    uint64_t target, uint64_t &goal)
+{
+    PointerSlot slot = find_pointer_slot(inode, block, goal);
+    if (slot.table == 0)
+    {
+        uint64_t previous = inode.data_pointers[slot.index];
+        inode.data_pointers[slot.index] = target;
+        return previous;
+    }
+    uint64_t previous = read_table_block_pointer(slot.table, slot.index);
+    write_table_block_pointer(slot.table, slot.index, target);
+    return previous;
+}
+
+uint64_t FileSystem::private_data_block(Inode &inode, uint64_t block,
+                                        uint64_t &goal, bool keep_content)
+{
+    uint64_t pointer = allocate_data_block(inode, block, goal);
+    if (!shares_blocks())
+        return pointer;
+    {
+        std::lock_guard<std::mutex> guard(this->reference_lock);
+        if (read_block_reference(pointer).count <= 1)
+            return pointer;
+    }
+    uint64_t copy = allocate_block(goal);
+    goal = copy + 1;
+    if (keep_content)
+    {
+        DataBlock content = read_block(pointer);
+        write_block(copy, content);
+    }
+    map_data_block(inode, block, copy, goal);
+    release_block(pointer);
+    return copy;
+}
+
+// Releases everything the subtree of the given depth maps beyond its first
+// keep data blocks, count is the number of data blocks it maps now. A
+// depth 0 subtree is a single data block. Returns the new subtree root.
+uint64_t FileSystem::release_tree(uint64_t root, int depth, uint64_t keep,
+                                  uint64_t count)
+{
+    if (root == 0 || count <= keep)
+        return root;
+    if (depth > 0 && shares_blocks())
+    {
+        // a shared table is only dropped by this owner, or copied before
+        // its tail is cut off
+        uint64_t goal = root;
+        if (keep == 0)
+        {
+            std::unique_lock<std::mutex> guard(this->reference_lock);
+            if (read_block_reference(root).count > 1)
+            {
+                guard.unlock();
+                release_block(root);
+                return 0;
+            }
+        }
+        else
+            root = unshare_table(root, goal);
+    }
+    if (depth > 0)
+    {
+        uint64_t span = 1ull << (this->pointer_shift * (depth - 1));
+        DataBlock table = read_block(root);
+        bool changed = false;
+        for (uint64_t i = keep / span; i * span < count; ++i)
+        {
+            uint64_t child;
+            std::memcpy(&child, table.data() + i * sizeof(uint64_t),
+                        sizeof(uint64_t));
+            uint64_t child_keep = (keep > i * span)
+                                      ? (std::min(keep - i * span, span))
+                                      : (0);
+            uint64_t child_count = std::min(count - i * span, span);
+            uint64_t new_child = release_tree(child, depth - 1, child_keep,
+                                              child_count);
+            if (new_child != child)
+            {
+                std::memcpy(table.data() + i * sizeof(uint64_t), &new_child,
+                            sizeof(uint64_t));
+                changed = true;
+            }
+        }
+        if (keep > 0 && changed)
+            write_block(root, table);
+    }
+    if (keep == 0)
+    {
+        release_block(root);
+        return 0;
+    }
+    return root;
+}
+
+uint64_t FileSystem::get_data_block_pointer(const Inode &inode,
+                                            uint64_t block)
+{
+    return dispatch_geometry(this->superblock.block_size,
+                             [&](const auto &geometry)
+                             { return get_data_block_pointer(geometry, inode,
+                                                             block); });
+}
+
+template <typename Geometry>
+uint64_t FileSystem::get_data_block_pointer(const Geometry &geometry,
+                                            const Inode &inode, uint64_t block)
+{
+    if (block < INODE_PRIMARY_TABLE_SIZE)
+    {
+        return inode.data_pointers[block];
+    }
+    block -= INODE_PRIMARY_TABLE_SIZE;
+    for (int level = 1; level <= INODE_TABLE_LEVELS; ++level)
+    {
+        uint64_t span = 1ull << (geometry.pointer_shift * level);
+        if (block >= span)
+        {
+            block -= span;
+            continue;
+        }
+        uint64_t table = inode.table_blocks[level - 1];
+        for (int depth = level - 1; depth >= 0 && table != 0; --depth)
+        {
+            table = read_table_block_pointer(
+                table, (block >> (geometry.pointer_shift * depth)) &
+                           (geometry.pointers_per_block - 1));
+        }
+        return table;
+    }
+    throw FileSizeTooBigException();
+}
+
+uint64_t FileSystem::get_file_data_block_count(const Inode &inode)
 {
     return get_file_data_block_count(inode.size);
 }
 
-void FileSystem::write_table_block_pointer(const int &table_block_index,
-                                           const int &pointer_index,
-                                           uint32_t pointer_value)
+void FileSystem::write_table_block_pointer(const uint64_t &table_block_index,
+                                           const uint64_t &pointer_index,
+                                           uint64_t pointer_value)
 {
     this->write_block(table_block_index,
                       reinterpret_cast<char *>(&pointer_value),
@@ -155,236 +738,285 @@ void FileSystem::write_table_block_pointer(const int &table_block_index,
 void FileSystem::read_from_block(DataBlock &block, char *dest, int size,
                                  int pos)
 {
-    char *dest_p = dest;
-    for (int i = 0; i < size; ++i, ++dest_p)
-    {
-        (*dest_p) = block.data[i + pos];
-    }
+    std::memcpy(dest, block.data() + pos, size);
 }
 
-void FileSystem::read_from_block(int index, char *dest, int size, int pos)
+void FileSystem::read_from_block(uint64_t index, char *dest, int size,
+                                 int pos)
 {
     DataBlock block = read_block(index);
     read_from_block(block, dest, size, pos); // 4, 0
 }
 
-uint64_t FileSystem::read_table_block_pointer(const int &table_block_index,
-                                              const int &pointer_index)
+uint64_t FileSystem::read_table_block_pointer(const uint64_t &table_block_index,
+                                              const uint64_t &pointer_index)
 {
-    DataBlock table_block = read_block(table_block_index);
-    uint32_t pointer;
-    read_from_block(table_block,
+    uint64_t pointer;
+    read_from_block(table_block_index,
                     reinterpret_cast<char *>(&pointer),
-                    sizeof(uint32_t),
+                    sizeof(uint64_t),
                     pointer_index *
-                        sizeof(uint32_t));
+                        sizeof(uint64_t));
     return pointer;
 }
 
+void FileSystem::release_file_blocks(Inode &inode, uint64_t keep)
+{
+    uint64_t old_data_block_count = get_file_data_block_count(inode);
+    if ((inode.flags & INODE_TAIL_MASK) && keep < old_data_block_count)
+    {
+        remove_fragment(inode.data_pointers[old_data_block_count - 1]);
+        inode.data_pointers[old_data_block_count - 1] = 0;
+        inode.flags &= ~INODE_TAIL_MASK;
+    }
+    // compressed files have holes
+    for (uint64_t i = keep;
+         i < old_data_block_count && i < INODE_PRIMARY_TABLE_SIZE; ++i)
+    {
+        if (inode.data_pointers[i] != 0)
+            release_block(inode.data_pointers[i]);
+        inode.data_pointers[i] = 0;
+    }
+    uint64_t first_block = INODE_PRIMARY_TABLE_SIZE;
+    for (int level = 1; level <= INODE_TABLE_LEVELS; ++level)
+    {
+        uint64_t span = 1ull << (this->pointer_shift * level);
+        auto clamp = [&](uint64_t count)
+        {
+            return (count > first_block)
+                       ? (std::min(count - first_block, span))
+                       : (0);
+        };
+        inode.table_blocks[level - 1] = release_tree(
+            inode.table_blocks[level - 1], level, clamp(keep),
+            clamp(old_data_block_count));
+        first_block += span;
+    }
+}
+
+void FileSystem::walk_file_blocks(
+    const Inode &inode,
+    const std::function<void(uint64_t block, bool table)> &visit)
+{
+    uint64_t remaining = get_file_data_block_count(inode);
+    // a packed tail lives in a tail block shared with other files
+    uint64_t own_blocks =
+        (inode.flags & INODE_TAIL_MASK) ? (remaining - 1) : (remaining);
+    for (uint64_t i = 0; i < own_blocks && i < INODE_PRIMARY_TABLE_SIZE; ++i)
+        visit(inode.data_pointers[i], false);
+    remaining -= std::min<uint64_t>(remaining, INODE_PRIMARY_TABLE_SIZE);
+    // every table is read once, its children are visited in order
+    std::function<void(uint64_t, int, uint64_t)> walk_tree =
+        [&](uint64_t root, int depth, uint64_t count)
+    {
+        visit(root, depth > 0);
+        if (depth == 0 || root == 0)
+            return;
+        uint64_t span = 1ull << (this->pointer_shift * (depth - 1));
+        std::vector<uint64_t> children((count + span - 1) / span);
+        DataBlock table = read_block(root);
+        std::memcpy(children.data(), table.data(),
+                    children.size() * sizeof(uint64_t));
+        for (uint64_t i = 0; i < children.size(); ++i)
+            walk_tree(children[i], depth - 1,
+                      std::min(span, count - i * span));
+    };
+    for (int level = 1; level <= INODE_TABLE_LEVELS && remaining > 0; ++level)
+    {
+        uint64_t mapped =
+            std::min<uint64_t>(remaining, 1ull << (this->pointer_shift * level));
+        walk_tree(inode.table_blocks[level - 1], level, mapped);
+        remaining -= mapped;
+    }
+}
+
+std::vector<FileSystem::Extent> FileSystem::get_file_extents(
+    const Inode &inode)
+{
+    std::vector<Extent> extents;
+    walk_file_blocks(inode,
+                     [&](uint64_t block, bool table)
+                     {
+                         if (block == 0)
+                             return;
+                         if (extents.empty() ||
+                             block != extents.back().start +
+                                          extents.back().length)
+                             extents.push_back({block, 0, 0});
+                         ++extents.back().length;
+                         extents.back().table_count += table;
+                     });
+    return extents;
+}
+
 void FileSystem::resize_file(int index, uint64_t new_size)
 {
+    forget_directory(index);
     Inode inode = read_inode(index);
-    int old_real_block_count = get_file_real_block_count(inode);
-    int new_real_block_count = get_file_real_block_count(new_size);
-    int old_data_block_count = get_file_data_block_count(inode);
-    int new_data_block_count = get_file_data_block_count(new_size);
-    if (new_real_block_count > MAX_INODE_BLOCK_COUNT)
+    if (inode.flags & INODE_COMPRESSED_MASK)
+    {
+        resize_compressed_file(index, inode, new_size);
+        return;
+    }
+    uint64_t old_data_block_count = get_file_data_block_count(inode);
+    uint64_t new_data_block_count = get_file_data_block_count(new_size);
+    if (new_data_block_count > this->max_inode_block_count)
     {
         throw FileSizeTooBigException();
     }
+    // a tail that stays part of the file needs its own block again, one
+    // that is cut off goes with release_file_blocks
+    if (new_data_block_count >= old_data_block_count)
+        unpack_tail(inode);
 
     // extending the file
-    if (new_real_block_count > old_real_block_count)
+    if (new_data_block_count > old_data_block_count)
     {
-        for (int i = old_data_block_count; i < new_data_block_count; ++i)
+        // keep the file contiguous: every block is allocated right after
+        // the previous one, a new file starts in its group
+        uint64_t goal =
+            (old_data_block_count > 0)
+                ? (get_data_block_pointer(inode, old_data_block_count - 1) + 1)
+                : (this->groups[inode.group]->first_block);
+        bool log = this->superblock.features & FEATURE_LOG;
+        DataBlock empty((log) ? (this->superblock.block_size) : (0), 0);
+        for (uint64_t i = old_data_block_count; i < new_data_block_count; ++i)
         {
-            uint32_t new_block_index = allocate_block();
-            // allocating primaty table
-            if (i < INODE_PRIMARY_TABLE_SIZE)
-            {
-                inode.data_pointers[i] = new_block_index;
-            }
-            // allocating secondary blocks
-            else if (i <
-                     INODE_PRIMARY_TABLE_SIZE + INODE_BLOCK_POINTER_TABLE_SIZE)
-            {
-                // allocating secondary table block
-                if (i == INODE_PRIMARY_TABLE_SIZE)
-                {
-                    inode.secondary_data_table_block = allocate_block();
-                }
-                int secondary_index = i - INODE_PRIMARY_TABLE_SIZE;
-                // writing to the secondary table block
-                this->write_table_block_pointer(
-                    inode.secondary_data_table_block,
-                    secondary_index,
-                    new_block_index);
-            }
-            // allocating ternary blocks
-            else if (i < MAX_INODE_BLOCK_COUNT)
-            {
-                int ternary_intermediate_index = (i -
-                                                  INODE_PRIMARY_TABLE_SIZE -
-                                                  INODE_BLOCK_POINTER_TABLE_SIZE) /
-                                                 INODE_BLOCK_POINTER_TABLE_SIZE;
-                int ternary_data_index = (i - INODE_PRIMARY_TABLE_SIZE -
-                                          INODE_BLOCK_POINTER_TABLE_SIZE) %
-                                         INODE_BLOCK_POINTER_TABLE_SIZE;
-                // allocating the main ternary table block
-                if (i ==
-                    INODE_PRIMARY_TABLE_SIZE + INODE_BLOCK_POINTER_TABLE_SIZE)
-                {
-                    inode.ternary_data_table_block = allocate_block();
-                }
-                // allocating intermediate ternary table blocks
-                if (ternary_data_index == 0)
-                {
-                    this->write_table_block_pointer(
-                        inode.ternary_data_table_block,
-                        ternary_intermediate_index, allocate_block());
-                }
-                // writing actual data blocks
-                uint32_t intermediate_block_pointer =
-                    read_table_block_pointer(
-                        inode.ternary_data_table_block,
-                        ternary_intermediate_index);
-                uint32_t data_block_pointer = allocate_block();
-                write_table_block_pointer(intermediate_block_pointer,
-                                          ternary_data_index,
-                                          data_block_pointer);
-            }
+            uint64_t block = allocate_data_block(inode, i, goal);
+            if (log)
+                write_block(block, empty);
         }
     }
     // truncating the file
-    else if (new_real_block_count < old_real_block_count)
+    else if (new_data_block_count < old_data_block_count)
     {
-        for (int i = old_data_block_count - 1; i >= new_data_block_count; --i)
-        {
-            if (i < INODE_PRIMARY_TABLE_SIZE)
-            {
-                release_block(inode.data_pointers[i]);
-            }
-            else if (i <
-                     INODE_PRIMARY_TABLE_SIZE + INODE_BLOCK_POINTER_TABLE_SIZE)
-            {
-                int secondary_index = i - INODE_PRIMARY_TABLE_SIZE;
-                release_block(read_table_block_pointer(
-                    inode.secondary_data_table_block, secondary_index));
-                if (secondary_index == 0)
-                {
-                    release_block(inode.secondary_data_table_block);
-                }
-            }
-            else if (i < MAX_INODE_BLOCK_COUNT)
-            {
-                int ternary_intermediate_index =
-                    (i - INODE_PRIMARY_TABLE_SIZE -
-                     INODE_BLOCK_POINTER_TABLE_SIZE) /
-                    INODE_BLOCK_POINTER_TABLE_SIZE;
-                int ternary_data_index =
-                    (i - INODE_PRIMARY_TABLE_SIZE -
-                     INODE_BLOCK_POINTER_TABLE_SIZE) %
-                    INODE_BLOCK_POINTER_TABLE_SIZE;
-
-                uint32_t intermediate_block_pointer =
-                    read_table_block_pointer(
-                        inode.ternary_data_table_block,
-                        ternary_intermediate_index);
-                uint32_t data_block_pointer = read_table_block_pointer(
-                    intermediate_block_pointer, ternary_data_index);
-                release_block(data_block_pointer);
-                if (ternary_data_index == 0)
-                {
-                    this->release_block(intermediate_block_pointer);
-                }
-                if (intermediate_block_pointer == 0)
-                {
-                    this->release_block(inode.ternary_data_table_block);
-                }
-            }
-        }
+        release_file_blocks(inode, new_data_block_count);
     }
 
     inode.size = new_size;
-    inode.last_modified = superblock.last_modified = get_current_time();
+    inode.last_modified = touch_superblock();
+    inode.generation = superblock.generation;
     write_inode(index, inode);
 }
 
 void FileSystem::write_file(int index, char *data, uint64_t size,
                             uint64_t pos)
+{
+    forget_directory(index);
+    if (this->superblock.features & FEATURE_DEDUP)
+    {
+        write_file_dedup(index, data, size, pos);
+        return;
+    }
+    if (this->superblock.features & FEATURE_LOG)
+    {
+        write_file_log(index, data, size, pos);
+        return;
+    }
+    bool tails = this->superblock.features & FEATURE_TAILS;
+    if (tails)
+    {
+        Inode inode = read_inode(index);
+        if (inode.flags & INODE_TAIL_MASK)
+        {
+            unpack_tail(inode);
+            write_inode(index, inode);
+        }
+    }
+    dispatch_geometry(this->superblock.block_size, [&](const auto &geometry)
+                      { write_file_blocks(geometry, index, data, size, pos); });
+    if (tails)
+        pack_tail(index);
+}
+
+template <typename Geometry>
+void FileSystem::write_file_blocks(const Geometry &geometry, int index,
+                                   char *data, uint64_t size, uint64_t pos)
 {
     Inode inode = this->read_inode(index);
     if (size == 0)
         return;
-
-    uint64_t starting_block = pos / BLOCK_SIZE;
-    int starting_block_offset = pos % BLOCK_SIZE;
-    uint64_t ending_block = (pos + size - 1) / BLOCK_SIZE;
-    int ending_block_offset = (pos + size - 1) % BLOCK_SIZE;
+    if (inode.flags & INODE_COMPRESSED_MASK)
+    {
+        write_compressed_file(index, inode, data, size, pos);
+        return;
+    }
 
     uint64_t result_size = std::max(inode.size, pos + size);
 
-    uint64_t current_block_count = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    uint64_t new_block_count = (result_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint64_t current_block_count =
+        (inode.size + geometry.block_size - 1) >> geometry.block_shift;
+    uint64_t new_block_count =
+        (result_size + geometry.block_size - 1) >> geometry.block_shift;
 
     // check if the new size will be bigger
     if (new_block_count > current_block_count)
     {
         // allocate blocks
-        try
-        {
-            this->resize_file(index, size);
-        }
-        catch (const FileSizeTooBigException &e)
-        {
-            throw e;
-        }
+        this->resize_file(index, result_size);
     }
 
     inode = this->read_inode(index);
-    for (uint64_t block = starting_block;
-         block <= ending_block; ++block, data += BLOCK_SIZE)
+    bool sharing = shares_blocks();
+    uint64_t goal = 0;
+    // whole blocks that follow each other on the drive are written with one
+    // request, which a striped drive splits over its backing files
+    uint64_t run_first = 0;
+    uint64_t run_count = 0;
+    const char *run_data = nullptr;
+    auto flush_run = [&]()
+    {
+        if (run_count > 0)
+            write_blocks(run_first, run_count, run_data);
+        run_count = 0;
+    };
+    for (uint64_t end_pos = pos + size; pos < end_pos;)
     {
-        int start = (block == starting_block) ? (starting_block_offset) : (0);
-        int end = (block == ending_block) ? (ending_block_offset)
-                                          : (BLOCK_SIZE - 1);
-        if (block < INODE_PRIMARY_TABLE_SIZE)
+        uint32_t offset = pos & (geometry.block_size - 1);
+        uint32_t length = std::min<uint64_t>(geometry.block_size - offset,
+                                             end_pos - pos);
+        uint64_t block = pos >> geometry.block_shift;
+        // blocks shared with a reflink copy or a snapshot are copied first
+        uint64_t pointer =
+            (sharing) ? (private_data_block(inode, block, goal,
+                                            length != geometry.block_size))
+                      : (get_data_block_pointer(geometry, inode, block));
+        if (length == geometry.block_size)
         {
-            write_block(inode.data_pointers[block], data, end - start + 1,
-                        start);
+            if (run_count == 0 || pointer != run_first + run_count)
+            {
+                flush_run();
+                run_first = pointer;
+                run_data = data;
+            }
+            ++run_count;
         }
-        else if (block <
-                 INODE_PRIMARY_TABLE_SIZE + INODE_BLOCK_POINTER_TABLE_SIZE)
+        else
         {
-            int block_index = block - INODE_PRIMARY_TABLE_SIZE;
-            uint64_t block_pointer = read_table_block_pointer(
-                inode.secondary_data_table_block, block_index);
-            write_block(block_pointer, data, end - start + 1, start);
-        }
-        else if (block < MAX_INODE_BLOCK_COUNT)
-        {
-            int intermediate_block_index = (block - INODE_PRIMARY_TABLE_SIZE -
-                                            INODE_BLOCK_POINTER_TABLE_SIZE) /
-                                           INODE_BLOCK_POINTER_TABLE_SIZE;
-            int data_block_index = (block - INODE_PRIMARY_TABLE_SIZE -
-                                    INODE_BLOCK_POINTER_TABLE_SIZE) %
-                                   INODE_BLOCK_POINTER_TABLE_SIZE;
-            uint64_t intermediate_block_pointer = read_table_block_pointer(
-                inode.ternary_data_table_block, intermediate_block_index);
-            uint64_t data_block_pointer = read_table_block_pointer(
-                intermediate_block_pointer, data_block_index);
-            write_block(data_block_pointer, data, end - start + 1, start);
+            flush_run();
+            write_block(pointer, data, length, offset);
         }
+        data += length;
+        pos += length;
     }
+    flush_run();
 
-    inode.last_modified = superblock.last_modified = get_current_time();
+    inode.last_modified = touch_superblock();
+    inode.generation = superblock.generation;
     inode.size = result_size;
     this->write_inode(index, inode);
 }
 
 void FileSystem::read_file(int index, char *dest, uint64_t size, uint64_t pos)
 {
-    // 0, dest, 4, 0
+    dispatch_geometry(this->superblock.block_size, [&](const auto &geometry)
+                      { read_file_blocks(geometry, index, dest, size, pos); });
+}
+
+template <typename Geometry>
+void FileSystem::read_file_blocks(const Geometry &geometry, int index,
+                                  char *dest, uint64_t size, uint64_t pos)
+{
     Inode inode = this->read_inode(index);
     if (size == 0)
         return;
@@ -394,116 +1026,101 @@ void FileSystem::read_file(int index, char *dest, uint64_t size, uint64_t pos)
     {
         throw ReadTooBigException();
     }
+    if (inode.flags & INODE_COMPRESSED_MASK)
+    {
+        read_compressed_file(inode, dest, size, pos);
+        return;
+    }
 
-    uint64_t starting_block = pos / BLOCK_SIZE;
-    int starting_block_offset = pos % BLOCK_SIZE;
-    uint64_t ending_block = (pos + size - 1) / BLOCK_SIZE;
-    int ending_block_offset = (pos + size - 1) % BLOCK_SIZE;
-
-    for (uint64_t block_index = starting_block;
-         block_index <=
-         ending_block;
-         ++block_index, dest += BLOCK_SIZE)
+    uint64_t tail_block = (inode.flags & INODE_TAIL_MASK)
+                              ? (get_file_data_block_count(inode) - 1)
+                              : (UINT64_MAX);
+    // like in write_file_blocks, runs of whole blocks are read at once
+    uint64_t run_first = 0;
+    uint64_t run_count = 0;
+    char *run_dest = nullptr;
+    auto flush_run = [&]()
     {
-        int start = (block_index == starting_block) ? (starting_block_offset)
-                                                    : (0);
-        int end = (block_index == ending_block) ? (ending_block_offset)
-                                                : (BLOCK_SIZE - 1);
-        if (block_index < INODE_PRIMARY_TABLE_SIZE)
-        {
-            read_from_block(inode.data_pointers[block_index], dest,
-                            end - start + 1,
-                            start);
-        }
-        else if (block_index <
-                 INODE_PRIMARY_TABLE_SIZE + INODE_BLOCK_POINTER_TABLE_SIZE)
+        if (run_count > 0)
+            read_blocks(run_first, run_count, run_dest);
+        run_count = 0;
+    };
+    for (uint64_t end_pos = pos + size; pos < end_pos;)
+    {
+        uint32_t offset = pos & (geometry.block_size - 1);
+        uint32_t length = std::min<uint64_t>(geometry.block_size - offset,
+                                             end_pos - pos);
+        uint64_t block = pos >> geometry.block_shift;
+        uint64_t pointer = get_data_block_pointer(geometry, inode, block);
+        if (length == geometry.block_size && block != tail_block)
         {
-            int secondary_index = block_index - INODE_PRIMARY_TABLE_SIZE;
-            uint64_t block_pointer = read_table_block_pointer(
-                inode.secondary_data_table_block, secondary_index);
-            read_from_block(block_pointer, dest, end - start + 1, start);
-        }
-        else if (block_index < MAX_INODE_BLOCK_COUNT)
-        {
-            int intermediate_block_index =
-                (block_index - INODE_PRIMARY_TABLE_SIZE -
-                 INODE_BLOCK_POINTER_TABLE_SIZE) /
-                INODE_BLOCK_POINTER_TABLE_SIZE;
-            int data_block_index = (block_index - INODE_PRIMARY_TABLE_SIZE -
-                                    INODE_BLOCK_POINTER_TABLE_SIZE) %
-                                   INODE_BLOCK_POINTER_TABLE_SIZE;
-            uint64_t intermediate_block_pointer = read_table_block_pointer(
-                inode.ternary_data_table_block, intermediate_block_index);
-            uint64_t data_block_pointer = read_table_block_pointer(
-                intermediate_block_pointer, data_block_index);
-            read_from_block(data_block_pointer, dest, end - start + 1, start);
+            if (run_count == 0 || pointer != run_first + run_count)
+            {
+                flush_run();
+                run_first = pointer;
+                run_dest = dest;
+            }
+            ++run_count;
         }
-        if (block_index == ending_block)
+        else
         {
-            break;
+            flush_run();
+            // the tail pointer is the byte address of the fragment
+            if (block == tail_block)
+                read_from_block(pointer >> geometry.block_shift, dest,
+                                length,
+                                (pointer & (geometry.block_size - 1)) +
+                                    offset);
+            else
+                read_from_block(pointer, dest, length, offset);
         }
+        dest += length;
+        pos += length;
     }
-
-    // this->write_inode(index, inode);
+    flush_run();
 }
 
 void FileSystem::write_inode(int index, Inode &inode)
 {
-    this->drive->seekp(inodes_offset + index * sizeof(Inode));
-    this->drive->write(reinterpret_cast<char *>(&inode), sizeof(Inode));
+    std::lock_guard<std::mutex> guard(this->drive_lock);
+    this->drive->write(inodes_offset + index * sizeof(Inode),
+                       reinterpret_cast<char *>(&inode), sizeof(Inode));
 }
 
-bool FileSystem::read_bitmap(const int &index)
+// Bitmap accessors work on the cached group bitmap, the caller has to hold
+// the lock of the group the block belongs to and have its bitmap loaded.
+bool FileSystem::read_bitmap(const uint64_t &index)
 {
-    int index_byte = index >> 3;
-    int index_bit = 1 << (index & 7);
-    this->drive->seekg(bitmap_offset + index_byte);
-    auto gotten = this->drive->get();
-    return gotten & index_bit;
+    ++this->metrics.bitmap_probes;
+    AllocationGroup &group = *this->groups[get_group_index(index)];
+    uint32_t group_bit = index - group.first_block;
+    return group.bitmap[group_bit >> 3] & (1 << (group_bit & 7));
 }
 
-void FileSystem::write_bitmap(int index, const bool &data)
+void FileSystem::write_bitmap(uint64_t index, const bool &data)
 {
-    int index_byte = index >> 3;
-    char index_bit = 1 << (index & 7);
-    this->drive->seekg(bitmap_offset + index_byte);
-    char existing;
-    this->drive->get(existing);
+    uint32_t group_index = get_group_index(index);
+    AllocationGroup &group = *this->groups[group_index];
+    uint32_t group_bit = index - group.first_block;
+    uint32_t index_byte = group_bit >> 3;
+    uint8_t index_bit = 1 << (group_bit & 7);
+    uint8_t &existing = group.bitmap[index_byte];
     existing = existing & (~index_bit);
     if (data)
         existing = existing | index_bit;
-    this->drive->seekp(bitmap_offset + index_byte);
-    this->drive->put(existing);
-    //    this->drive->putback(existing);
+    std::lock_guard<std::mutex> guard(this->drive_lock);
+    this->drive->write(bitmap_offset +
+                           static_cast<uint64_t>(group_index) *
+                               (this->superblock.blocks_per_group >> 3) +
+                           index_byte,
+                       reinterpret_cast<char *>(&existing), 1);
 }
 
 bool FileSystem::is_name_unique(const std::string name,
                                 const uint32_t parent_index)
 {
-    Inode parent = this->read_inode(parent_index);
-    uint64_t remaining_size = parent.size;
-    for (uint64_t pos = 0; pos < remaining_size;)
-    {
-        uint32_t name_size, inode_pointer;
-        read_file(parent_index, reinterpret_cast<char *>(&inode_pointer),
-                  sizeof(uint32_t), pos);
-        pos += sizeof(uint32_t);
-        read_file(parent_index, reinterpret_cast<char *>(&name_size),
-                  sizeof(uint32_t), pos);
-        pos += sizeof(uint32_t);
-        char *name_buffer = new char[name_size + 1];
-        read_file(parent_index, name_buffer,
-                  sizeof(char) * name_size, pos);
-        name_buffer[name_size] = '\0';
-        pos += sizeof(char) * name_size;
-        if (name == name_buffer)
-        {
-            delete[] name_buffer;
-            return false;
-        }
-        delete[] name_buffer;
-    }
-    return true;
+    uint32_t child;
+    return !find_entry(parent_index, name, child);
 }
 
 void FileSystem::add_inode_to_dir(const uint32_t &parent_index,
@@ -511,22 +1128,35 @@ void FileSystem::add_inode_to_dir(const uint32_t &parent_index,
                                   const std::string &file_name)
 {
     Inode parent = read_inode(parent_index);
-    struct
+    // inode pointer, name size and name go in with a single write
+    std::string record(2 * sizeof(uint32_t) + file_name.length(), '\0');
+    uint32_t name_size = file_name.length();
+    std::memcpy(record.data(), &child_index, sizeof(uint32_t));
+    std::memcpy(record.data() + sizeof(uint32_t), &name_size,
+                sizeof(uint32_t));
+    std::memcpy(record.data() + 2 * sizeof(uint32_t), file_name.data(),
+                name_size);
+
+    // the cached entries stay valid, the new one is added to them
+    std::unordered_map<std::string, uint32_t> entries;
+    bool cached = false;
     {
-        uint32_t inode_pointer;
-        uint32_t name_size;
-        const char *name;
-    } record;
-    record.inode_pointer = child_index;
-    record.name_size = file_name.length();
-    record.name = file_name.c_str();
-
-    write_file(parent_index, reinterpret_cast<char *>(&record.inode_pointer),
-               sizeof(uint32_t), parent.size);
-    write_file(parent_index, reinterpret_cast<char *>(&record.name_size),
-               sizeof(uint32_t), parent.size + sizeof(uint32_t));
-    write_file(parent_index, const_cast<char *>(record.name),
-               record.name_size, parent.size + 2 * sizeof(uint32_t));
+        std::lock_guard<std::mutex> guard(this->directory_cache_lock);
+        auto found = this->directory_cache.find(parent_index);
+        if (found != this->directory_cache.end())
+        {
+            entries = std::move(found->second);
+            this->directory_cache.erase(found);
+            cached = true;
+        }
+    }
+    write_file(parent_index, record.data(), record.size(), parent.size);
+    if (cached)
+    {
+        entries.emplace(file_name, child_index);
+        std::lock_guard<std::mutex> guard(this->directory_cache_lock);
+        this->directory_cache.emplace(parent_index, std::move(entries));
+    }
 }
 
 void FileSystem::remove_inode_from_dir(const uint32_t &parent_index,
@@ -550,8 +1180,9 @@ void FileSystem::remove_inode_from_dir(const uint32_t &parent_index,
             read_file(parent_index, remaining_data, parent.size - pos, pos);
             write_file(parent_index, remaining_data, parent.size - pos,
                        pos - 2 * sizeof(uint32_t) - sizeof(char) * name_size);
-            parent.size = parent.size - name_size - 2 * sizeof(uint32_t);
-            this->write_inode(parent_index, parent);
+            // releases the blocks the directory no longer needs
+            resize_file(parent_index,
+                        parent.size - name_size - 2 * sizeof(uint32_t));
             delete[] remaining_data;
             break;
         }
@@ -561,28 +1192,78 @@ void FileSystem::remove_inode_from_dir(const uint32_t &parent_index,
 uint32_t FileSystem::get_dir_inode(const int &dir_index,
                                    const std::string &name)
 {
-    uint64_t remaining_size = this->read_inode(dir_index).size;
-    for (uint64_t pos = 0; pos < remaining_size;)
+    ++this->metrics.directory_lookups;
+    uint32_t child;
+    if (!find_entry(dir_index, name, child))
+        throw DirectoryNotFoundException();
+    return child;
+}
+
+// Reads a directory once and answers the lookups in it from memory until
+// it changes.
+bool FileSystem::find_entry(uint32_t dir_index, const std::string &name,
+                            uint32_t &child)
+{
+    uint64_t generation;
     {
-        uint32_t inode_pointer, name_size;
-        read_file(dir_index, reinterpret_cast<char *>(&inode_pointer),
-                  sizeof(uint32_t), pos);
-        pos += sizeof(uint32_t);
-        read_file(dir_index, reinterpret_cast<char *>(&name_size),
-                  sizeof(uint32_t), pos);
-        pos += sizeof(uint32_t);
-        char *name_buffer = new char[name_size + 1];
-        read_file(dir_index, name_buffer, sizeof(char) * name_size, pos);
-        name_buffer[name_size] = '\0';
-        pos += sizeof(char) * name_size;
-        if (name == name_buffer)
+        std::lock_guard<std::mutex> guard(this->directory_cache_lock);
+        auto found = this->directory_cache.find(dir_index);
+        if (found != this->directory_cache.end())
         {
-            delete[] name_buffer;
-            return inode_pointer;
+            auto entry = found->second.find(name);
+            if (entry == found->second.end())
+                return false;
+            child = entry->second;
+            return true;
         }
-        delete[] name_buffer;
+        generation = this->directory_generation;
+    }
+
+    // the directory is read without the lock, a write meanwhile means the
+    // entries may be stale and are not kept
+    std::unordered_map<std::string, uint32_t> entries;
+    for (auto &[entry, index] : read_directory(dir_index))
+        entries.emplace(std::move(entry), index);
+    auto entry = entries.find(name);
+    bool exists = entry != entries.end();
+    if (exists)
+        child = entry->second;
+    std::lock_guard<std::mutex> guard(this->directory_cache_lock);
+    if (generation == this->directory_generation)
+    {
+        if (this->directory_cache.size() >= DIRECTORY_CACHE_SIZE)
+            this->directory_cache.clear();
+        this->directory_cache.emplace(dir_index, std::move(entries));
     }
-    throw DirectoryNotFoundException();
+    return exists;
+}
+
+void FileSystem::forget_directory(uint32_t index)
+{
+    std::lock_guard<std::mutex> guard(this->directory_cache_lock);
+    ++this->directory_generation;
+    this->directory_cache.erase(index);
+}
+
+std::vector<std::pair<std::string, uint32_t>>
+FileSystem::read_directory(uint32_t index)
+{
+    Inode inode = read_inode(index);
+    std::string content(inode.size, '\0');
+    read_file(index, content.data(), inode.size, 0);
+    std::vector<std::pair<std::string, uint32_t>> entries;
+    for (uint64_t pos = 0; pos + 2 * sizeof(uint32_t) <= content.size();)
+    {
+        uint32_t child, name_size;
+        std::memcpy(&child, content.data() + pos, sizeof(uint32_t));
+        std::memcpy(&name_size, content.data() + pos + sizeof(uint32_t),
+                    sizeof(uint32_t));
+        pos += 2 * sizeof(uint32_t);
+        entries.emplace_back(content.substr(pos, name_size), child);
+        pos += name_size;
+    }
+    this->metrics.directory_entries_scanned += entries.size();
+    return entries;
 }
 
 uint32_t FileSystem::find_file_in_dir(const std::string &name)
@@ -615,10 +1296,19 @@ void FileSystem::create_root()
     Inode root = read_inode(0);
     root.creation_time = get_current_time();
     root.last_modified = root.creation_time;
+    root.generation = superblock.generation;
     root.size = 0;
     root.reference_count = 1;
     root.flags = 0b11000000;
+    root.group = 0;
     this->write_inode(0, root);
+    {
+        std::lock_guard<std::mutex> guard(this->inode_lock);
+        write_inode_bitmap(0, true);
+        this->next_free_inode = 1;
+    }
+    ++this->groups[0]->descriptor.directory_count;
+    write_group_descriptor(0);
     add_inode_to_dir(0, 0, static_cast<const std::string &>("."));
     add_inode_to_dir(0, 0, static_cast<const std::string &>(".."));
     superblock.file_count++;
@@ -627,24 +1317,42 @@ void FileSystem::create_root()
 void FileSystem::create_file(const std::string &name,
                              const std::string &parent_name, FILE_TYPE type)
 {
-    uint32_t parent_index = find_file_in_dir(parent_name);
+    create_file(name, find_file_in_dir(parent_name), type);
+}
+
+uint32_t FileSystem::create_file(const std::string &name,
+                                 uint32_t parent_index, FILE_TYPE type)
+{
     if (!is_name_unique(name, parent_index))
         throw NonUniqueNameException();
     Inode parent_dir = this->read_inode(parent_index);
 
     if ((parent_dir.flags & INODE_MODE_MASK) != FILE_TYPE::DIR)
         throw NotADirectoryException();
-
-    uint64_t block_index = this->allocate_block();
+    if (parent_dir.flags & INODE_READONLY_MASK)
+        throw ReadOnlyException();
 
     int child_index = this->find_unused_inode();
-    Inode inode;
+    Inode inode{};
     inode.creation_time = get_current_time();
     inode.last_modified = inode.creation_time;
-    inode.data_pointers[0] = block_index;
+    inode.generation = superblock.generation;
     inode.reference_count = 1;
-    inode.size = 1;
-    inode.flags = type | INODE_USED_MASK;
+    inode.size = 0;
+    inode.flags = type | INODE_USED_MASK |
+                  (parent_dir.flags & INODE_COMPRESSED_MASK);
+    // files stay with their directory, directories are spread out
+    inode.group = parent_dir.group;
+    if (type == FILE_TYPE::DIR)
+    {
+        inode.group = choose_directory_group();
+        AllocationGroup &group = *this->groups[inode.group];
+        {
+            std::lock_guard<std::mutex> guard(group.lock);
+            ++group.descriptor.directory_count;
+        }
+        write_group_descriptor(inode.group);
+    }
     this->write_inode(child_index, inode);
     if (type == FILE_TYPE::DIR)
     {
@@ -653,10 +1361,13 @@ void FileSystem::create_file(const std::string &name,
         add_inode_to_dir(child_index, parent_index,
                          static_cast<const std::string &>(".."));
     }
-    ++superblock.file_count;
-    write_superblock();
-    this->write_inode(child_index, inode);
+    {
+        std::lock_guard<std::mutex> guard(this->superblock_lock);
+        ++superblock.file_count;
+        write_superblock();
+    }
     this->add_inode_to_dir(parent_index, child_index, name);
+    return child_index;
 }
 
 void FileSystem::create_file(const std::string &name, FILE_TYPE type)
@@ -682,6 +1393,8 @@ void FileSystem::create_link(const std::string &link_name,
     std::string parent_name = linked_name.substr(0,
                                                  linked_name.rfind("/") + 1);
     uint32_t parent_id = find_file_in_dir(parent_name);
+    if (read_inode(parent_id).flags & INODE_READONLY_MASK)
+        throw ReadOnlyException();
     add_inode_to_dir(parent_id, linked_index, link_name);
     Inode linked = read_inode(linked_index);
     ++linked.reference_count;
@@ -690,114 +1403,449 @@ void FileSystem::create_link(const std::string &link_name,
 
 void FileSystem::init_inodes()
 {
-    this->drive->seekp(inodes_offset);
-    Inode *inodes = new Inode[this->superblock.max_file_count]{{0, 0, 0, {0}, 0, 0, 0, 0}};
-    this->drive->write(reinterpret_cast<char *>(inodes),
-                       sizeof(inodes));
-    delete[] inodes;
+    // written in chunks, the inode table may hold millions of entries
+    const uint32_t chunk_size = 4096;
+    std::vector<Inode> inodes(chunk_size, Inode{});
+    for (uint32_t i = 0; i < this->superblock.max_file_count; i += chunk_size)
+    {
+        uint32_t count = std::min(chunk_size,
+                                  this->superblock.max_file_count - i);
+        this->drive->write(inodes_offset +
+                               static_cast<uint64_t>(i) * sizeof(Inode),
+                           reinterpret_cast<char *>(inodes.data()),
+                           count * sizeof(Inode));
+    }
+    this->inode_bitmap.assign((this->superblock.max_file_count + 7) >> 3, 0);
+    this->next_free_inode = 0;
+    this->drive->write(inode_bitmap_offset,
+                       reinterpret_cast<char *>(this->inode_bitmap.data()),
+                       this->inode_bitmap.size());
 }
 
-void FileSystem::init_bitmap()
+void FileSystem::init_groups()
 {
-    int bitmap_byte_count = (this->superblock.block_count + 7) >> 3;
-    char *bitmap = new char[bitmap_byte_count]{0};
-    this->drive->seekp(bitmap_offset);
-    this->drive->write(bitmap, bitmap_byte_count);
-    delete[] bitmap;
+    this->groups.clear();
+    for (uint32_t i = 0; i < this->superblock.group_count; ++i)
+    {
+        auto group = std::make_unique<AllocationGroup>();
+        group->first_block =
+            static_cast<uint64_t>(i) * this->superblock.blocks_per_group;
+        group->block_count = std::min<uint64_t>(
+            this->superblock.blocks_per_group,
+            this->superblock.block_count - group->first_block);
+        group->next_free = 0;
+        group->descriptor.free_count = group->block_count;
+        group->descriptor.directory_count = 0;
+        // the bitmap area of a fresh image is sparse and reads as zeros
+        group->bitmap_loaded = false;
+        this->groups.push_back(std::move(group));
+    }
+    for (uint32_t i = 0; i < this->superblock.group_count; ++i)
+    {
+        this->drive->write(groups_offset + i * sizeof(GroupDescriptor),
+                           reinterpret_cast<char *>(
+                               &this->groups[i]->descriptor),
+                           sizeof(GroupDescriptor));
+    }
 }
 
 void FileSystem::init_blocks()
 {
-    this->drive->seekp(blocks_offset);
-    DataBlock *blocks = new DataBlock[this->superblock.block_count];
-    this->drive->write(reinterpret_cast<char *>(blocks),
-                       this->superblock.block_count * sizeof(DataBlock));
-    delete[] blocks;
+    // the block area is left sparse
+    this->drive->resize(blocks_offset +
+                        static_cast<uint64_t>(this->superblock.block_count) *
+                            this->superblock.block_size);
 }
 
 void FileSystem::init_drive()
 {
-    this->drive->write(reinterpret_cast<char *>(&this->superblock),
+    this->drive->write(0, reinterpret_cast<char *>(&this->superblock),
                        sizeof(this->superblock));
 
-    this->init_inodes();
+    this->init_groups();
 
-    this->init_bitmap();
+    this->init_inodes();
 
     this->init_blocks();
+
+    // block 0 is never handed out, a zero block pointer means no block
+    if (shares_blocks())
+        write_block_reference(0, {0, 1});
+    AllocationGroup &group = *this->groups[0];
+    std::lock_guard<std::mutex> guard(group.lock);
+    load_group_bitmap(0);
+    write_bitmap(0, true);
+    --group.descriptor.free_count;
+    write_group_descriptor(0);
+    ++this->superblock.occupied_count;
+    --this->superblock.free_count;
+    write_superblock();
 }
 
-FileSystem::FileSystem(const std::string &file_name, const int &bytes)
+void FileSystem::compute_geometry()
 {
-    unsigned int block_count = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    unsigned int bitmap_size = (block_count + 7) >> 3;
+    this->pointers_per_block = this->superblock.block_size / sizeof(uint64_t);
+    this->pointer_shift = std::countr_zero(this->pointers_per_block);
+    this->max_inode_block_count = INODE_PRIMARY_TABLE_SIZE;
+    for (int level = 1; level <= INODE_TABLE_LEVELS; ++level)
+    {
+        this->max_inode_block_count += 1ull << (this->pointer_shift * level);
+    }
+    this->chunk_blocks =
+        std::max(1u, COMPRESSION_CHUNK_SIZE / this->superblock.block_size);
+    // segments never cross a group, a group holds a whole number of them
+    this->segment_blocks =
+        std::max(1u, LOG_SEGMENT_SIZE / this->superblock.block_size);
+    this->segment_count =
+        (this->superblock.block_count + this->segment_blocks - 1) /
+        this->segment_blocks;
+
+    this->groups_offset = sizeof(superblock);
+    this->inodes_offset = this->groups_offset +
+                          this->superblock.group_count *
+                              sizeof(GroupDescriptor);
+    this->inode_bitmap_offset =
+        this->inodes_offset +
+        static_cast<uint64_t>(this->superblock.max_file_count) * sizeof(Inode);
+    this->bitmap_offset = this->inode_bitmap_offset +
+                          ((this->superblock.max_file_count + 7) >> 3);
+    // every group bitmap takes exactly one block worth of bytes, except
+    // the last one which may be shorter
+    this->checksums_offset = this->bitmap_offset +
+                             ((this->superblock.block_count + 7) >> 3);
+    this->references_offset = this->checksums_offset;
+    if (this->superblock.features & FEATURE_CHECKSUMS)
+        this->references_offset +=
+            this->superblock.block_count * sizeof(uint32_t);
+    this->blocks_offset = this->references_offset;
+    if (shares_blocks())
+        this->blocks_offset +=
+            this->superblock.block_count * sizeof(BlockReference);
+    // whole blocks in pooled buffers can then go to a direct drive as they
+    // are
+    if (this->superblock.features & FEATURE_ALIGNED_BLOCKS)
+    {
+        uint64_t alignment = std::max<uint64_t>(this->superblock.block_size,
+                                                BufferPool::ALIGNMENT);
+        this->blocks_offset =
+            (this->blocks_offset + alignment - 1) / alignment * alignment;
+    }
+}
+
+std::unique_ptr<Device> FileSystem::open_drive(bool create)
+{
+    if (this->in_memory)
+        return std::make_unique<MemoryDevice>();
+    if (this->superblock.mirror_count > 1)
+    {
+        std::vector<std::string> paths;
+        for (uint32_t i = 0; i < this->superblock.mirror_count; ++i)
+            paths.push_back(backing_file_name(this->image_name, i));
+        return std::make_unique<MirroredDevice>(
+            paths, this->image_name + ".dirty", create, this->direct_io);
+    }
+    if (this->superblock.stripe_count <= 1)
+        return std::make_unique<FileDevice>(this->image_name, create,
+                                            this->direct_io);
+    std::vector<std::string> paths;
+    for (uint32_t i = 0; i < this->superblock.stripe_count; ++i)
+        paths.push_back(backing_file_name(this->image_name, i));
+    return std::make_unique<StripedDevice>(paths,
+                                           this->superblock.stripe_unit,
+                                           create, this->direct_io);
+}
+
+void FileSystem::load_groups()
+{
+    this->groups.clear();
+    for (uint32_t i = 0; i < this->superblock.group_count; ++i)
+    {
+        auto group = std::make_unique<AllocationGroup>();
+        group->first_block =
+            static_cast<uint64_t>(i) * this->superblock.blocks_per_group;
+        group->block_count = std::min<uint64_t>(
+            this->superblock.blocks_per_group,
+            this->superblock.block_count - group->first_block);
+        group->next_free = 0;
+        group->bitmap_loaded = false;
+        this->drive->read(groups_offset + i * sizeof(GroupDescriptor),
+                          reinterpret_cast<char *>(&group->descriptor),
+                          sizeof(GroupDescriptor));
+        this->groups.push_back(std::move(group));
+    }
+}
+
+// The caller has to hold the group lock.
+void FileSystem::load_group_bitmap(uint32_t group_index)
+{
+    AllocationGroup &group = *this->groups[group_index];
+    if (group.bitmap_loaded)
+        return;
+    group.bitmap.resize((group.block_count + 7) >> 3);
+    std::lock_guard<std::mutex> guard(this->drive_lock);
+    this->drive->read(bitmap_offset +
+                          static_cast<uint64_t>(group_index) *
+                              (this->superblock.blocks_per_group >> 3),
+                      reinterpret_cast<char *>(group.bitmap.data()),
+                      group.bitmap.size());
+    group.bitmap_loaded = true;
+}
+
+void FileSystem::load_inode_bitmap()
+{
+    this->inode_bitmap.resize((this->superblock.max_file_count + 7) >> 3);
+    this->next_free_inode = 0;
+    this->drive->read(inode_bitmap_offset,
+                      reinterpret_cast<char *>(this->inode_bitmap.data()),
+                      this->inode_bitmap.size());
+}
+
+FileSystem::FileSystem(const std::string &file_name, uint64_t bytes,
+                       const FormatOptions &options)
+    : image_name(file_name), in_memory(options.in_memory),
+      direct_io(options.direct_io)
+{
+    uint32_t block_size = options.block_size;
+    uint32_t inode_count = options.inode_count;
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+        !std::has_single_bit(block_size))
+        throw InvalidGeometryException();
+    uint64_t block_count = (bytes + block_size - 1) / block_size;
+    if (block_count < 2 ||
+        (block_count + 8 * block_size - 1) / (8 * block_size) > UINT32_MAX)
+        throw InvalidGeometryException();
+    if (inode_count == 0)
+        inode_count = std::max<uint64_t>(MIN_FILE_COUNT,
+                                         bytes / BYTES_PER_INODE);
 
     this->superblock.last_modified = get_current_time();
-    this->superblock.block_count = static_cast<uint16_t>(block_count);
-    this->superblock.occupied_count = static_cast<uint16_t>(0);
-    this->superblock.free_count = static_cast<uint16_t>(block_count);
-    this->superblock.block_size = static_cast<uint16_t>(BLOCK_SIZE);
-    this->superblock.max_file_count = static_cast<uint16_t>(MAX_FILE_COUNT);
-    this->superblock.file_count = static_cast<uint16_t>(0);
-
-    this->drive = std::make_unique<std::fstream>(file_name,
-                                                 std::ios::in |
-                                                     std::ios::out |
-                                                     std::ios::trunc);
-
-    this->inodes_offset = sizeof(superblock);
-    this->bitmap_offset = this->inodes_offset +
-                          this->superblock.max_file_count *
-                              sizeof(Inode);
-    this->blocks_offset = this->bitmap_offset + bitmap_size;
-    std::cout << this->inodes_offset << " " << this->bitmap_offset << " "
-              << this->blocks_offset << std::endl;
+    this->superblock.block_count = block_count;
+    this->superblock.occupied_count = 0;
+    this->superblock.free_count = block_count;
+    this->superblock.block_size = block_size;
+    this->superblock.max_file_count = inode_count;
+    this->superblock.file_count = 0;
+    // one bitmap block per group
+    this->superblock.blocks_per_group = 8 * block_size;
+    this->superblock.group_count =
+        (this->superblock.block_count + this->superblock.blocks_per_group -
+         1) /
+        this->superblock.blocks_per_group;
+    this->superblock.features = FEATURE_ALIGNED_BLOCKS;
+    this->superblock.generation = 1;
+    // a block never straddles two backing files
+    if (options.stripe_count == 0 ||
+        (options.stripe_count > 1 &&
+         (options.stripe_unit < block_size ||
+          !std::has_single_bit(options.stripe_unit))))
+        throw InvalidGeometryException();
+    this->superblock.stripe_count = options.stripe_count;
+    this->superblock.stripe_unit = options.stripe_unit;
+    // the backing files are either stripes or copies
+    if (options.mirror_count == 0 ||
+        (options.mirror_count > 1 && options.stripe_count > 1) ||
+        (options.in_memory && (options.mirror_count > 1 ||
+                               options.stripe_count > 1 || options.direct_io)))
+        throw IncompatibleFeaturesException();
+    this->superblock.mirror_count = options.mirror_count;
+    if (options.checksums)
+        this->superblock.features |= FEATURE_CHECKSUMS;
+    if (options.dedup && !block_hash_self_check())
+        throw BlockHashException();
+    if (options.dedup)
+        this->superblock.features |= FEATURE_DEDUP;
+    if (options.reflink)
+        this->superblock.features |= FEATURE_REFLINK;
+    if (options.tail_packing)
+    {
+        // a fragment has a single owner, it cannot be shared
+        if (shares_blocks())
+            throw IncompatibleFeaturesException();
+        this->superblock.features |= FEATURE_TAILS;
+    }
+    if (options.log_structured)
+    {
+        // the cleaner moves a block by rewriting the one pointer to it
+        if (this->superblock.features & (FEATURE_DEDUP | FEATURE_REFLINK |
+                                         FEATURE_TAILS))
+            throw IncompatibleFeaturesException();
+        this->superblock.features |= FEATURE_LOG;
+    }
+
+    this->drive = open_drive(true);
+
+    this->compute_geometry();
+
+    this->reset_log();
 
     this->init_drive();
 
     this->create_root();
+
+    this->start_cleaner();
+}
+
+FileSystem::FileSystem(const std::string &file_name, bool memory_only,
+                       bool direct)
+    : image_name(file_name), in_memory(memory_only), direct_io(direct)
+{
+    // the superblock is at the start of the first backing file of any
+    // layout, it tells what the others are
+    this->drive = std::make_unique<FileDevice>(file_name, false);
+    uint64_t id = 0;
+    this->drive->read(0, reinterpret_cast<char *>(&id), sizeof(id));
+    if (id != ID)
+        throw InvalidImageException();
+    this->drive->read(0, reinterpret_cast<char *>(&this->superblock),
+                      sizeof(this->superblock));
+    if (this->in_memory)
+    {
+        // dump writes a single file
+        if (this->superblock.stripe_count > 1 ||
+            this->superblock.mirror_count > 1 || this->direct_io)
+            throw IncompatibleFeaturesException();
+        auto memory = std::make_unique<MemoryDevice>();
+        memory->load(file_name);
+        this->drive = std::move(memory);
+    }
+    else if (this->superblock.stripe_count > 1 ||
+             this->superblock.mirror_count > 1 || this->direct_io)
+        this->drive = open_drive(false);
+
+    this->compute_geometry();
+    this->reset_log();
+    this->load_groups();
+    this->load_inode_bitmap();
+    this->load_dedup_index();
+    this->load_tail_index();
+    this->start_cleaner();
 }
 
 FileSystem::~FileSystem()
 {
-    this->drive->close();
+    this->stop_cleaner();
+    write_deferred_metadata();
 }
 
 void FileSystem::cplocal(const std::string &local_name,
                          const std::string &virtual_name)
 {
-    std::fstream local_stream(local_name, std::ios::in);
-    local_stream.seekg(0, std::ios::end);
-    size_t size = local_stream.tellg();
-    local_stream.seekg(0);
-    char *data = new char[size];
-    local_stream.read(data, size);
-    create_file(
-        ((virtual_name[0] == '/') ? (virtual_name) : ("/" + virtual_name)),
-        FILE_TYPE::FILE);
-    int index = this->find_file_in_dir(virtual_name);
-    Inode root = read_inode(0);
-    write_file(index, data, size, 0);
-    root = read_inode(0);
-    local_stream.close();
+    auto timed = time_call(Metrics::UPLOAD, {virtual_name});
+    auto paused = pause_cleaner();
+    int local = ::open(local_name.c_str(), O_RDONLY);
+    struct stat status;
+    if (local < 0 || ::fstat(local, &status) != 0)
+    {
+        if (local >= 0)
+            ::close(local);
+        throw LocalFileException();
+    }
+    uint64_t size = status.st_size;
+    timed.add_number(size);
+    try
+    {
+        create_file(((virtual_name[0] == '/') ? (virtual_name)
+                                              : ("/" + virtual_name)),
+                    FILE_TYPE::FILE);
+        copy_file_in(this->find_file_in_dir(virtual_name), local, size);
+    }
+    catch (...)
+    {
+        ::close(local);
+        throw;
+    }
+    ::close(local);
 }
 
 void FileSystem::cpvirtual(const std::string &virtual_name,
                            const std::string &local_name)
 {
-    std::fstream local_stream(local_name, std::ios::out | std::ios::trunc);
-
+    auto timed = time_call(Metrics::EXTRACT, {virtual_name});
+    auto paused = pause_cleaner(Access::READ);
     int index = this->find_file_in_dir(virtual_name);
     Inode inode = read_inode(index);
-    char *data = new char[inode.size];
-    read_file(index, data, inode.size, 0);
-    local_stream.write(data, inode.size);
-    local_stream.close();
+    timed.add_number(inode.size);
+    int local = ::open(local_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (local < 0)
+        throw LocalFileException();
+    try
+    {
+        copy_file_out(index, inode, local);
+    }
+    catch (...)
+    {
+        ::close(local);
+        throw;
+    }
+    ::close(local);
 }
 
-void FileSystem::mkdir(const std::string &name)
+uint64_t FileSystem::read(const std::string &name, uint64_t offset,
+                          char *data, uint64_t size)
+{
+    auto timed = time_call(Metrics::READ, {name}, {offset, size});
+    auto paused = pause_cleaner(Access::READ);
+    int index = this->find_file_in_dir(name);
+    Inode inode = read_inode(index);
+    if (offset >= inode.size)
+        return 0;
+    size = std::min(size, inode.size - offset);
+    read_file(index, data, size, offset);
+    return size;
+}
+
+FileHandle FileSystem::open(const std::string &name)
+{
+    auto timed = time_call(Metrics::OPEN, {name});
+    auto paused = pause_cleaner(Access::READ);
+    FileHandle handle = this->find_file_in_dir(name);
+    if ((read_inode(handle).flags & INODE_MODE_MASK) != FILE_TYPE::FILE)
+        throw NotAFileException();
+    return handle;
+}
+
+FileSystem::Inode FileSystem::read_handle(FileHandle handle)
+{
+    {
+        std::lock_guard<std::mutex> guard(this->inode_lock);
+        if (handle >= this->superblock.max_file_count ||
+            !(this->inode_bitmap[handle >> 3] & (1 << (handle & 7))))
+            throw InvalidHandleException();
+    }
+    Inode inode = read_inode(handle);
+    if ((inode.flags & INODE_MODE_MASK) != FILE_TYPE::FILE)
+        throw InvalidHandleException();
+    return inode;
+}
+
+uint64_t FileSystem::read(FileHandle handle, uint64_t offset, char *data,
+                          uint64_t size)
 {
+    auto timed = time_call(Metrics::PREAD, {}, {handle, offset, size});
+    auto paused = pause_cleaner(Access::READ);
+    Inode inode = read_handle(handle);
+    if (offset >= inode.size)
+        return 0;
+    size = std::min(size, inode.size - offset);
+    read_file(handle, data, size, offset);
+    return size;
+}
 
+void FileSystem::write(FileHandle handle, uint64_t offset, char *data,
+                       uint64_t size)
+{
+    auto timed = time_call(Metrics::PWRITE, {}, {handle, offset, size});
+    auto paused = pause_cleaner();
+    Inode inode = read_handle(handle);
+    if (inode.flags & INODE_READONLY_MASK)
+        throw ReadOnlyException();
+    write_file(handle, data, size, offset);
+}
+
+void FileSystem::mkdir(const std::string &name)
+{
+    auto timed = time_call(Metrics::MKDIR, {name});
+    auto paused = pause_cleaner();
     std::string file_name = name;
     if (name == "/")
         throw std::exception();
@@ -839,6 +1887,8 @@ void FileSystem::rmdir(const std::string &dir_name)
 
 void FileSystem::rm(const std::string &file_name)
 {
+    auto timed = time_call(Metrics::RM, {file_name});
+    auto paused = pause_cleaner();
     std::string name = file_name;
     if (name[0] != '/')
         name = "/" + name;
@@ -850,17 +1900,23 @@ void FileSystem::rm(const std::string &file_name)
     {
         throw NotAFileException();
     }
+    if ((inode.flags | read_inode(parent_index).flags) & INODE_READONLY_MASK)
+        throw ReadOnlyException();
     --inode.reference_count;
-    if (inode.reference_count == 0)
+    remove_inode_from_dir(parent_index, index);
+    bool removed = inode.reference_count == 0;
+    if (removed)
     {
         resize_file(index, 0);
         inode = read_inode(index);
-        remove_inode_from_dir(parent_index, index);
         inode.flags = 0b00000000;
         inode.creation_time = 0;
-        --superblock.file_count;
+        release_inode(index);
     }
     write_inode(index, inode);
+    std::lock_guard<std::mutex> guard(this->superblock_lock);
+    if (removed)
+        --superblock.file_count;
     superblock.last_modified = get_current_time();
     write_superblock();
 }
@@ -873,30 +1929,42 @@ void FileSystem::rm(const std::string &file_name)
 //
 //}
 //
-void FileSystem::extend(const std::string &name, int bytes)
+void FileSystem::extend(const std::string &name, uint64_t bytes)
 {
+    auto timed = time_call(Metrics::EXTEND, {name}, {bytes});
+    auto paused = pause_cleaner();
     int dir_index = this->find_file_in_dir(name);
     Inode inode = read_inode(dir_index);
     if ((inode.flags & INODE_MODE_MASK) != FILE_TYPE::FILE)
     {
         throw NotAFileException();
     }
+    if (inode.flags & INODE_READONLY_MASK)
+        throw ReadOnlyException();
     resize_file(dir_index, inode.size + bytes);
+    pack_tail(dir_index);
 }
 
-void FileSystem::truncate(const std::string &name, int bytes)
+void FileSystem::truncate(const std::string &name, uint64_t bytes)
 {
+    auto timed = time_call(Metrics::TRUNCATE, {name}, {bytes});
+    auto paused = pause_cleaner();
     int dir_index = this->find_file_in_dir(name);
     Inode inode = read_inode(dir_index);
     if ((inode.flags & INODE_MODE_MASK) != FILE_TYPE::FILE)
     {
         throw NotAFileException();
     }
+    if (inode.flags & INODE_READONLY_MASK)
+        throw ReadOnlyException();
     resize_file(dir_index, inode.size - bytes);
+    pack_tail(dir_index);
 }
 
 std::string FileSystem::ls(const std::string &directory)
 {
+    auto timed = time_call(Metrics::LS, {directory});
+    auto paused = pause_cleaner(Access::READ);
     std::stringstream result;
     std::string dir_str = directory;
     if (directory == "")
@@ -941,13 +2009,77 @@ std::string FileSystem::ls(const std::string &directory)
     return result.str();
 }
 
+std::string FileSystem::stats(bool json)
+{
+    const uint32_t block_size = this->superblock.block_size;
+    return (json) ? (this->metrics.json(block_size) + "\n")
+                  : (this->metrics.report(block_size));
+}
+
+const Metrics &FileSystem::get_metrics() const
+{
+    return this->metrics;
+}
+
+const std::string &FileSystem::get_image_name() const
+{
+    return this->image_name;
+}
+
 std::string FileSystem::df()
 {
+    auto timed = time_call(Metrics::DF);
+    auto paused = pause_cleaner(Access::READ);
     std::stringstream result;
     result << "Block count (used/free): " << this->superblock.block_count
            << " (" << this->superblock.occupied_count << " / "
            << this->superblock.free_count << ")." << std::endl;
     result << "Inode count: " << superblock.max_file_count << " (used: "
            << superblock.file_count << ")." << std::endl;
+    result << "Block size: " << superblock.block_size << ", checksums: "
+           << ((superblock.features & FEATURE_CHECKSUMS) ? ("on") : ("off"))
+           << ", dedup: ";
+    if (superblock.features & FEATURE_DEDUP)
+    {
+        std::lock_guard<std::mutex> guard(this->reference_lock);
+        result << "on (" << this->dedup_index.size() << " indexed blocks)";
+    }
+    else
+        result << "off";
+    result << ", reflink: "
+           << ((superblock.features & FEATURE_REFLINK) ? ("on") : ("off"))
+           << ", tails: ";
+    if (superblock.features & FEATURE_TAILS)
+    {
+        std::lock_guard<std::mutex> guard(this->tail_lock);
+        result << "on (" << this->tail_free.size() << " tail blocks)";
+    }
+    else
+        result << "off";
+    result << ", log: ";
+    if (superblock.features & FEATURE_LOG)
+    {
+        std::vector<uint32_t> usage = read_segment_usage();
+        result << "on (" << std::count(usage.begin(), usage.end(), 0u)
+               << " of " << this->segment_count << " segments clean)";
+    }
+    else
+        result << "off";
+    result << "." << std::endl;
+    result << "Group count: " << superblock.group_count
+           << " (listing groups in use)." << std::endl;
+    for (uint32_t i = 0; i < superblock.group_count; ++i)
+    {
+        AllocationGroup &group = *this->groups[i];
+        std::lock_guard<std::mutex> guard(group.lock);
+        if (group.descriptor.free_count == group.block_count &&
+            group.descriptor.directory_count == 0)
+            continue;
+        result << "Group " << i << " (blocks " << group.first_block << "-"
+               << group.first_block + group.block_count - 1
+               << "): free " << group.descriptor.free_count
+               << ", directories " << group.descriptor.directory_count
+               << "." << std::endl;
+    }
     return result.str();
 }
\ No newline at end of file
@@ -0,0 +1,460 @@
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <thread>
+
+#include "fs.hpp"
+#include "exceptions.hpp"
+
+std::string FileSystem::fsck(unsigned thread_count, bool repair)
+{
+    auto timed = time_call(Metrics::FSCK, {}, {thread_count, repair});
+    auto paused = pause_cleaner();
+    if (thread_count == 0)
+        thread_count = 1;
+
+    const uint64_t block_count = this->superblock.block_count;
+    const uint32_t inode_count = this->superblock.max_file_count;
+    const uint32_t INODE_CHUNK = 1024;
+    const size_t MAX_MESSAGES = 100;
+    auto start = std::chrono::steady_clock::now();
+
+    // blocks reachable from the inodes, rebuilt from scratch
+    std::vector<std::atomic<uint64_t>> expected((block_count + 63) / 64);
+    // pointers to every block, deduplicated images share blocks
+    const bool shared_blocks = shares_blocks();
+    std::vector<std::atomic<uint32_t>> claims((shared_blocks) ? (block_count)
+                                                              : (0));
+    // directory entries naming every inode, "." and ".." excluded
+    std::vector<std::atomic<uint32_t>> references(inode_count);
+    std::vector<uint8_t> inode_used(inode_count, 0);
+
+    std::mutex report_lock;
+    std::vector<std::string> messages;
+    uint64_t problem_count = 0;
+    auto report = [&](const std::string &message)
+    {
+        std::lock_guard<std::mutex> guard(report_lock);
+        ++problem_count;
+        if (messages.size() < MAX_MESSAGES)
+            messages.push_back(message);
+    };
+
+    // Reads the drive with positional reads and a buffer of its own, so
+    // that any number of workers can walk it at the same time.
+    struct ImageReader
+    {
+        FileSystem &fs;
+        DataBlock block;
+
+        ImageReader(FileSystem &file_system)
+            : fs(file_system), block(file_system.superblock.block_size)
+        {
+        }
+
+        DataBlock &read(uint64_t index)
+        {
+            fs.drive->read(fs.blocks_offset + index * block.size(),
+                           block.data(), block.size());
+            return block;
+        }
+
+        void read_inodes(uint32_t first, uint32_t count, Inode *inodes)
+        {
+            fs.drive->read(fs.inodes_offset +
+                               static_cast<uint64_t>(first) * sizeof(Inode),
+                           reinterpret_cast<char *>(inodes),
+                           count * sizeof(Inode));
+        }
+    };
+
+    // Marks a block as expected, false when it was claimed already.
+    auto claim = [&](uint64_t block)
+    {
+        uint64_t bit = 1ull << (block & 63);
+        bool first = !(expected[block >> 6].fetch_or(bit) & bit);
+        if (!shared_blocks)
+            return first;
+        return claims[block]++ == 0;
+    };
+
+    // Claims the subtree of the given depth mapping count data blocks and
+    // appends the data blocks to data_blocks when it is not null. Holes are
+    // only allowed in compressed files.
+    std::function<void(ImageReader &, uint32_t, uint64_t, int, uint64_t,
+                       bool, std::vector<uint64_t> *)>
+        walk_tree;
+    walk_tree = [&](ImageReader &reader, uint32_t inode_index, uint64_t root,
+                    int depth, uint64_t count, bool holes,
+                    std::vector<uint64_t> *data_blocks)
+    {
+        if (root == 0 && holes)
+            return;
+        if (root == 0 || root >= block_count)
+        {
+            report("Inode " + std::to_string(inode_index) +
+                   ((root == 0) ? (" is missing a block.")
+                                : (" points past the image: " +
+                                   std::to_string(root) + ".")));
+            return;
+        }
+        bool first = claim(root);
+        if (!first && !shared_blocks)
+            report("Block " + std::to_string(root) + " of inode " +
+                   std::to_string(inode_index) + " is claimed twice.");
+        if (depth == 0)
+        {
+            if (data_blocks)
+                data_blocks->push_back(root);
+            return;
+        }
+        // the subtree of a shared table counts the table once
+        if (!first && shared_blocks)
+            return;
+        uint64_t span = 1ull << (this->pointer_shift * (depth - 1));
+        std::vector<uint64_t> children((count + span - 1) / span);
+        std::memcpy(children.data(), reader.read(root).data(),
+                    children.size() * sizeof(uint64_t));
+        for (uint64_t i = 0; i < children.size(); ++i)
+            walk_tree(reader, inode_index, children[i], depth - 1,
+                      std::min(span, count - i * span), holes, data_blocks);
+    };
+
+    auto check_directory = [&](ImageReader &reader, uint32_t index,
+                               const Inode &inode,
+                               const std::vector<uint64_t> &data_blocks)
+    {
+        std::string content;
+        for (uint64_t block : data_blocks)
+        {
+            DataBlock &data = reader.read(block);
+            content.append(data.data(), data.size());
+        }
+        content.resize(std::min<uint64_t>(inode.size, content.size()));
+        for (uint64_t pos = 0; pos < content.size();)
+        {
+            uint32_t child, name_size;
+            if (pos + 2 * sizeof(uint32_t) > content.size())
+            {
+                report("Directory " + std::to_string(index) +
+                       " has a truncated entry.");
+                return;
+            }
+            std::memcpy(&child, content.data() + pos, sizeof(uint32_t));
+            std::memcpy(&name_size, content.data() + pos + sizeof(uint32_t),
+                        sizeof(uint32_t));
+            pos += 2 * sizeof(uint32_t);
+            if (pos + name_size > content.size())
+            {
+                report("Directory " + std::to_string(index) +
+                       " has a truncated entry.");
+                return;
+            }
+            std::string name = content.substr(pos, name_size);
+            pos += name_size;
+            if (child >= inode_count)
+            {
+                report("Directory " + std::to_string(index) + " entry " +
+                       name + " points past the inode table.");
+                continue;
+            }
+            if (name != "." && name != "..")
+                ++references[child];
+        }
+    };
+
+    // phase 1: claim the blocks of every inode, count directory entries
+    std::atomic<uint32_t> next_chunk{0};
+    auto inode_worker = [&]()
+    {
+        ImageReader reader(*this);
+        std::vector<Inode> inodes(INODE_CHUNK);
+        for (uint32_t first;
+             (first = next_chunk.fetch_add(INODE_CHUNK)) < inode_count;)
+        {
+            uint32_t count = std::min(INODE_CHUNK, inode_count - first);
+            reader.read_inodes(first, count, inodes.data());
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                const Inode &inode = inodes[i];
+                uint32_t index = first + i;
+                if (!(inode.flags & INODE_USED_MASK))
+                    continue;
+                inode_used[index] = 1;
+                bool directory =
+                    (inode.flags & INODE_MODE_MASK) == FILE_TYPE::DIR;
+                bool holes =
+                    !directory && (inode.flags & INODE_COMPRESSED_MASK);
+                std::vector<uint64_t> data_blocks;
+                std::vector<uint64_t> *collect =
+                    (directory) ? (&data_blocks) : (nullptr);
+                uint64_t remaining = get_file_data_block_count(inode);
+                for (uint64_t j = 0;
+                     j < remaining && j < INODE_PRIMARY_TABLE_SIZE; ++j)
+                {
+                    // tail blocks hold the fragments of several files
+                    if ((inode.flags & INODE_TAIL_MASK) && j + 1 == remaining)
+                    {
+                        uint64_t tail = inode.data_pointers[j] /
+                                        this->superblock.block_size;
+                        if (tail == 0 || tail >= block_count)
+                            report("Inode " + std::to_string(index) +
+                                   " has a tail outside of the image.");
+                        else
+                            claim(tail);
+                        continue;
+                    }
+                    walk_tree(reader, index, inode.data_pointers[j], 0, 1,
+                              holes, collect);
+                }
+                remaining -= std::min<uint64_t>(remaining,
+                                                INODE_PRIMARY_TABLE_SIZE);
+                for (int level = 1; level <= INODE_TABLE_LEVELS &&
+                                    remaining > 0;
+                     ++level)
+                {
+                    uint64_t span = 1ull << (this->pointer_shift * level);
+                    uint64_t mapped = std::min(remaining, span);
+                    walk_tree(reader, index, inode.table_blocks[level - 1],
+                              level, mapped, holes, collect);
+                    remaining -= mapped;
+                }
+                if (directory)
+                    check_directory(reader, index, inode, data_blocks);
+            }
+        }
+    };
+    claim(0);
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < thread_count; ++i)
+        workers.emplace_back(inode_worker);
+    for (auto &thread : workers)
+        thread.join();
+    workers.clear();
+
+    // phase 2: inode bitmap, reference counts and orphans
+    uint32_t used_inode_count = 0;
+    std::vector<uint32_t> bitmap_mismatches;
+    std::vector<std::pair<uint32_t, uint16_t>> wrong_references;
+    std::vector<uint32_t> group_directories(this->superblock.group_count, 0);
+    {
+        ImageReader reader(*this);
+        std::vector<Inode> inodes(INODE_CHUNK);
+        for (uint32_t first = 0; first < inode_count; first += INODE_CHUNK)
+        {
+            uint32_t count = std::min(INODE_CHUNK, inode_count - first);
+            reader.read_inodes(first, count, inodes.data());
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                uint32_t index = first + i;
+                const Inode &inode = inodes[i];
+                bool marked = this->inode_bitmap[index >> 3] &
+                              (1 << (index & 7));
+                if (marked != static_cast<bool>(inode_used[index]))
+                {
+                    report("Inode " + std::to_string(index) + " is " +
+                           ((marked) ? ("free") : ("used")) +
+                           " but marked otherwise in the inode bitmap.");
+                    bitmap_mismatches.push_back(index);
+                }
+                if (!inode_used[index])
+                {
+                    if (references[index] > 0)
+                        report("Inode " + std::to_string(index) +
+                               " is free but named by " +
+                               std::to_string(references[index]) +
+                               " directory entries.");
+                    continue;
+                }
+                ++used_inode_count;
+                if ((inode.flags & INODE_MODE_MASK) == FILE_TYPE::DIR &&
+                    inode.group < group_directories.size())
+                    ++group_directories[inode.group];
+                // the root is not named by any entry
+                uint32_t expected_references =
+                    (index == 0) ? (1) : (references[index].load());
+                if (expected_references == 0)
+                    report("Inode " + std::to_string(index) +
+                           " is not named by any directory entry.");
+                else if (inode.reference_count != expected_references)
+                {
+                    report("Inode " + std::to_string(index) + " has " +
+                           std::to_string(inode.reference_count) +
+                           " references, expected " +
+                           std::to_string(expected_references) + ".");
+                    wrong_references.emplace_back(index,
+                                                  expected_references);
+                }
+            }
+        }
+    }
+
+    // phase 3: compare the rebuilt block bitmap with every group bitmap
+    std::atomic<uint32_t> next_group{0};
+    std::atomic<uint64_t> leaked{0}, unmarked{0};
+    std::vector<uint32_t> mismatched_groups;
+    std::vector<uint32_t> wrong_block_references;
+    std::mutex mismatched_lock;
+    auto group_worker = [&]()
+    {
+        for (uint32_t group_index;
+             (group_index = next_group++) < this->superblock.group_count;)
+        {
+            AllocationGroup &group = *this->groups[group_index];
+            std::lock_guard<std::mutex> guard(group.lock);
+            load_group_bitmap(group_index);
+            uint64_t group_leaked = 0, group_unmarked = 0, used = 0;
+            for (uint32_t i = 0; i < group.block_count; ++i)
+            {
+                uint64_t block = group.first_block + i;
+                bool want = expected[block >> 6] & (1ull << (block & 63));
+                bool have = group.bitmap[i >> 3] & (1 << (i & 7));
+                used += want;
+                if (have && !want)
+                    ++group_leaked;
+                else if (want && !have)
+                    ++group_unmarked;
+            }
+            if (shared_blocks)
+            {
+                std::vector<BlockReference> block_references(
+                    group.block_count);
+                this->drive->read(
+                    this->references_offset +
+                        group.first_block * sizeof(BlockReference),
+                    reinterpret_cast<char *>(block_references.data()),
+                    group.block_count * sizeof(BlockReference));
+                uint64_t wrong = 0;
+                for (uint32_t i = 0; i < group.block_count; ++i)
+                    wrong += block_references[i].count !=
+                             claims[group.first_block + i];
+                if (wrong > 0)
+                {
+                    report("Group " + std::to_string(group_index) + ": " +
+                           std::to_string(wrong) +
+                           " wrong block reference counts.");
+                    std::lock_guard<std::mutex> mismatched_guard(
+                        mismatched_lock);
+                    wrong_block_references.push_back(group_index);
+                }
+            }
+            if (group_leaked || group_unmarked ||
+                group.descriptor.free_count != group.block_count - used ||
+                group.descriptor.directory_count !=
+                    group_directories[group_index])
+            {
+                report("Group " + std::to_string(group_index) + ": " +
+                       std::to_string(group_leaked) + " leaked, " +
+                       std::to_string(group_unmarked) +
+                       " unmarked blocks, free count " +
+                       std::to_string(group.descriptor.free_count) +
+                       " (expected " +
+                       std::to_string(group.block_count - used) + ").");
+                std::lock_guard<std::mutex> mismatched_guard(mismatched_lock);
+                mismatched_groups.push_back(group_index);
+            }
+            leaked += group_leaked;
+            unmarked += group_unmarked;
+        }
+    };
+    for (unsigned i = 0; i < thread_count; ++i)
+        workers.emplace_back(group_worker);
+    for (auto &thread : workers)
+        thread.join();
+
+    uint64_t expected_occupied = 0;
+    for (auto &word : expected)
+        expected_occupied += std::popcount(word.load());
+    if (this->superblock.occupied_count != expected_occupied ||
+        this->superblock.free_count != block_count - expected_occupied ||
+        this->superblock.file_count != used_inode_count)
+        report("Superblock counters are wrong: " +
+               std::to_string(this->superblock.occupied_count) +
+               " used blocks (expected " + std::to_string(expected_occupied) +
+               "), " + std::to_string(this->superblock.file_count) +
+               " files (expected " + std::to_string(used_inode_count) + ").");
+
+    if (repair && problem_count > 0)
+    {
+        for (uint32_t group_index : mismatched_groups)
+        {
+            AllocationGroup &group = *this->groups[group_index];
+            std::lock_guard<std::mutex> guard(group.lock);
+            uint32_t used = 0;
+            for (uint32_t i = 0; i < group.block_count; ++i)
+            {
+                uint64_t block = group.first_block + i;
+                bool want = expected[block >> 6] & (1ull << (block & 63));
+                if (want != static_cast<bool>(group.bitmap[i >> 3] &
+                                              (1 << (i & 7))))
+                    write_bitmap(block, want);
+                used += want;
+            }
+            group.descriptor.free_count = group.block_count - used;
+            group.descriptor.directory_count = group_directories[group_index];
+            write_group_descriptor(group_index);
+        }
+        for (uint32_t group_index : wrong_block_references)
+        {
+            AllocationGroup &group = *this->groups[group_index];
+            std::lock_guard<std::mutex> guard(this->reference_lock);
+            for (uint32_t i = 0; i < group.block_count; ++i)
+            {
+                uint64_t block = group.first_block + i;
+                BlockReference reference = read_block_reference(block);
+                if (reference.count == claims[block])
+                    continue;
+                // a freed block leaves the dedup index
+                if (claims[block] == 0 && reference.hash != 0)
+                {
+                    auto found = this->dedup_index.find(reference.hash);
+                    if (found != this->dedup_index.end() &&
+                        found->second == block)
+                        this->dedup_index.erase(found);
+                    reference.hash = 0;
+                }
+                reference.count = claims[block];
+                write_block_reference(block, reference);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> guard(this->inode_lock);
+            for (uint32_t index : bitmap_mismatches)
+                write_inode_bitmap(index, inode_used[index]);
+        }
+        for (auto &[index, count] : wrong_references)
+        {
+            Inode inode = read_inode(index);
+            inode.reference_count = count;
+            write_inode(index, inode);
+        }
+        std::lock_guard<std::mutex> guard(this->superblock_lock);
+        this->superblock.occupied_count = expected_occupied;
+        this->superblock.free_count = block_count - expected_occupied;
+        this->superblock.file_count = used_inode_count;
+        write_superblock();
+    }
+
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    std::stringstream result;
+    result << "Checked " << used_inode_count << " inodes and "
+           << expected_occupied << " blocks in " << seconds << " s using "
+           << thread_count << " threads." << std::endl;
+    result << "Leaked blocks: " << leaked << ", unmarked blocks: " << unmarked
+           << "." << std::endl;
+    for (auto &message : messages)
+        result << message << std::endl;
+    if (problem_count > messages.size())
+        result << "... " << problem_count - messages.size() << " more."
+               << std::endl;
+    result << problem_count << " problems"
+           << ((repair && problem_count > 0) ? (", repaired") : (""))
+           << "." << std::endl;
+    return result.str();
+}
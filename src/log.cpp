@@ -0,0 +1,399 @@
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <sstream>
+
+#include "fs.hpp"
+#include "exceptions.hpp"
+
+// the file system whose operation the thread is in, if any
+static thread_local const FileSystem *paused_file_system = nullptr;
+
+void FileSystem::reset_log()
+{
+    std::lock_guard<std::mutex> guard(this->log_lock);
+    // the log starts over in a clean segment, ages count from now
+    this->log_head = this->log_end = 0;
+    this->segment_times.assign(this->segment_count, get_current_time());
+}
+
+void FileSystem::start_cleaner()
+{
+    if (!(this->superblock.features & FEATURE_LOG))
+        return;
+    this->cleaner_stop = false;
+    this->cleaner_requested = false;
+    this->cleaner = std::thread(&FileSystem::run_cleaner, this);
+}
+
+void FileSystem::stop_cleaner()
+{
+    if (!this->cleaner.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> guard(this->cleaner_mutex);
+        this->cleaner_stop = true;
+    }
+    this->cleaner_wakeup.notify_one();
+    this->cleaner.join();
+}
+
+// Woken by the log whenever it opens a segment, the cleaner tops up the
+// clean segments once they run low.
+void FileSystem::run_cleaner()
+{
+    std::unique_lock<std::mutex> guard(this->cleaner_mutex);
+    while (true)
+    {
+        this->cleaner_wakeup.wait(
+            guard,
+            [this]() { return this->cleaner_requested || this->cleaner_stop; });
+        if (this->cleaner_stop)
+            break;
+        // requests made during the pass ask for the next one
+        this->cleaner_requested = false;
+        guard.unlock();
+        std::vector<uint32_t> usage = read_segment_usage();
+        uint64_t clean_count = std::count(usage.begin(), usage.end(), 0u);
+        if (clean_count < CLEANER_LOW_SEGMENTS)
+            clean_segments(2 * CLEANER_LOW_SEGMENTS - clean_count);
+        guard.lock();
+    }
+}
+
+FileSystem::CleanerPause::CleanerPause(FileSystem &fs, Access access)
+    : outer(paused_file_system)
+{
+    if (this->outer == &fs)
+        return;
+    if (access == Access::READ)
+        this->shared = std::shared_lock<std::shared_mutex>(fs.operation_lock);
+    else
+        this->exclusive =
+            std::unique_lock<std::shared_mutex>(fs.operation_lock);
+    paused_file_system = &fs;
+}
+
+FileSystem::CleanerPause::~CleanerPause()
+{
+    paused_file_system = this->outer;
+}
+
+FileSystem::CleanerPause FileSystem::pause_cleaner(Access access)
+{
+    return CleanerPause(*this, access);
+}
+
+bool FileSystem::claim_block(uint64_t index)
+{
+    uint32_t group_index = get_group_index(index);
+    AllocationGroup &group = *this->groups[group_index];
+    {
+        std::lock_guard<std::mutex> guard(group.lock);
+        load_group_bitmap(group_index);
+        uint32_t offset = index - group.first_block;
+        if (group.bitmap[offset >> 3] & (1 << (offset & 7)))
+            return false;
+        write_bitmap(index, true);
+        --group.descriptor.free_count;
+        write_group_descriptor(group_index);
+    }
+    std::lock_guard<std::mutex> superblock_guard(this->superblock_lock);
+    ++this->superblock.occupied_count;
+    --this->superblock.free_count;
+    write_superblock();
+    return true;
+}
+
+std::vector<uint32_t> FileSystem::read_segment_usage()
+{
+    std::vector<uint32_t> usage(this->segment_count, 0);
+    // a segment takes whole bytes of its group bitmap
+    uint32_t segment_bytes = this->segment_blocks >> 3;
+    for (uint32_t group_index = 0; group_index < this->superblock.group_count;
+         ++group_index)
+    {
+        AllocationGroup &group = *this->groups[group_index];
+        std::lock_guard<std::mutex> guard(group.lock);
+        load_group_bitmap(group_index);
+        uint64_t first_segment = group.first_block / this->segment_blocks;
+        for (uint32_t i = 0; i < group.bitmap.size(); ++i)
+            usage[first_segment + i / segment_bytes] +=
+                std::popcount(group.bitmap[i]);
+    }
+    return usage;
+}
+
+uint64_t FileSystem::allocate_log_block(bool cleaning)
+{
+    std::lock_guard<std::mutex> guard(this->log_lock);
+    for (;;)
+    {
+        while (this->log_head < this->log_end)
+        {
+            // a block the block allocator took meanwhile is skipped
+            uint64_t block = this->log_head++;
+            if (!claim_block(block))
+                continue;
+            this->segment_times[block / this->segment_blocks] =
+                get_current_time();
+            return block;
+        }
+
+        // the segment is full, the log moves on to the next clean one
+        std::vector<uint32_t> usage = read_segment_usage();
+        uint64_t clean_count = std::count(usage.begin(), usage.end(), 0u);
+        if (clean_count < CLEANER_LOW_SEGMENTS)
+        {
+            {
+                std::lock_guard<std::mutex> wakeup(this->cleaner_mutex);
+                this->cleaner_requested = true;
+            }
+            this->cleaner_wakeup.notify_one();
+        }
+        if (clean_count == 0 ||
+            (!cleaning && clean_count <= CLEANER_RESERVE_SEGMENTS))
+            return 0;
+        uint64_t start = this->log_end / this->segment_blocks;
+        for (uint64_t n = 0; n < this->segment_count; ++n)
+        {
+            uint64_t segment = (start + n) % this->segment_count;
+            if (usage[segment] != 0)
+                continue;
+            this->log_head = segment * this->segment_blocks;
+            this->log_end = std::min(this->log_head + this->segment_blocks,
+                                     this->superblock.block_count);
+            break;
+        }
+    }
+}
+
+FileSystem::CleanerResult FileSystem::clean_segments(uint64_t wanted)
+{
+    std::unique_lock<std::shared_mutex> exclusive(this->operation_lock);
+    std::vector<uint32_t> usage = read_segment_usage();
+    std::vector<uint64_t> times;
+    uint64_t head_segment;
+    uint64_t room;
+    {
+        std::lock_guard<std::mutex> guard(this->log_lock);
+        times = this->segment_times;
+        head_segment = (this->log_end > 0)
+                           ? ((this->log_end - 1) / this->segment_blocks)
+                           : (UINT64_MAX);
+        room = this->log_end - this->log_head;
+    }
+    room += std::count(usage.begin(), usage.end(), 0u) * this->segment_blocks;
+
+    // cost-benefit: the free space a segment gives back, weighted by the age
+    // of its data, against reading it and writing its live blocks again;
+    // segment 0 holds the reserved block 0
+    uint64_t now = get_current_time();
+    std::vector<std::pair<double, uint64_t>> candidates;
+    for (uint64_t segment = 1; segment < this->segment_count; ++segment)
+    {
+        if (usage[segment] == 0 || segment == head_segment)
+            continue;
+        uint64_t length =
+            std::min<uint64_t>(this->segment_blocks,
+                               this->superblock.block_count -
+                                   segment * this->segment_blocks);
+        double utilization = static_cast<double>(usage[segment]) / length;
+        if (utilization > CLEANER_MAX_UTILIZATION)
+            continue;
+        double age = static_cast<double>(now - times[segment] + 1);
+        candidates.emplace_back(
+            (1 - utilization) * age / (1 + utilization), segment);
+    }
+    std::sort(candidates.begin(), candidates.end(), std::greater<>());
+
+    // the live blocks have to fit into the clean segments there are now
+    std::vector<bool> victims(this->segment_count, false);
+    CleanerResult result = {0, 0};
+    for (auto &[score, segment] : candidates)
+    {
+        if (result.segments == wanted)
+            break;
+        if (usage[segment] > room)
+            continue;
+        room -= usage[segment];
+        victims[segment] = true;
+        ++result.segments;
+    }
+    if (result.segments == 0)
+        return result;
+
+    // there is no owner stored with a block, the pointers to the victims
+    // are found by walking every file
+    typedef struct
+    {
+        uint64_t block;
+        uint32_t inode;
+        int depth;
+        PointerSlot slot;
+    } LiveBlock;
+    std::vector<LiveBlock> live;
+    std::vector<uint32_t> used_inodes;
+    {
+        std::lock_guard<std::mutex> guard(this->inode_lock);
+        for (uint32_t i = 0; i < this->superblock.max_file_count; ++i)
+            if (this->inode_bitmap[i >> 3] & (1 << (i & 7)))
+                used_inodes.push_back(i);
+    }
+    for (uint32_t index : used_inodes)
+    {
+        Inode inode = read_inode(index);
+        if (!(inode.flags & INODE_USED_MASK))
+            continue;
+        auto note = [&](uint64_t block, int depth, PointerSlot slot)
+        {
+            if (block != 0 && victims[block / this->segment_blocks])
+                live.push_back({block, index, depth, slot});
+        };
+        uint64_t remaining = get_file_data_block_count(inode);
+        for (uint64_t i = 0; i < remaining && i < INODE_PRIMARY_TABLE_SIZE;
+             ++i)
+            note(inode.data_pointers[i], 0, {0, i});
+        remaining -= std::min<uint64_t>(remaining, INODE_PRIMARY_TABLE_SIZE);
+        std::function<void(uint64_t, int, uint64_t, PointerSlot)> walk_tree =
+            [&](uint64_t root, int depth, uint64_t count, PointerSlot slot)
+        {
+            note(root, depth, slot);
+            if (depth == 0 || root == 0)
+                return;
+            uint64_t span = 1ull << (this->pointer_shift * (depth - 1));
+            std::vector<uint64_t> children((count + span - 1) / span);
+            DataBlock table = read_block(root);
+            std::memcpy(children.data(), table.data(),
+                        children.size() * sizeof(uint64_t));
+            for (uint64_t i = 0; i < children.size(); ++i)
+                walk_tree(children[i], depth - 1,
+                          std::min(span, count - i * span), {root, i});
+        };
+        for (int level = 1; level <= INODE_TABLE_LEVELS && remaining > 0;
+             ++level)
+        {
+            uint64_t mapped = std::min<uint64_t>(
+                remaining, 1ull << (this->pointer_shift * level));
+            walk_tree(inode.table_blocks[level - 1], level, mapped,
+                      {0, INODE_PRIMARY_TABLE_SIZE + level - 1ull});
+            remaining -= mapped;
+        }
+    }
+
+    // children move before their tables, the pointer to a child is then
+    // updated in the table before the table itself is copied
+    std::stable_sort(live.begin(), live.end(),
+                     [](const LiveBlock &a, const LiveBlock &b)
+                     { return a.depth < b.depth; });
+    for (LiveBlock &entry : live)
+    {
+        uint64_t target = allocate_log_block(true);
+        if (target == 0)
+            target = allocate_block(entry.block);
+        DataBlock content = read_block(entry.block);
+        write_block(target, content);
+        if (entry.slot.table != 0)
+            write_table_block_pointer(entry.slot.table, entry.slot.index,
+                                      target);
+        else
+        {
+            Inode inode = read_inode(entry.inode);
+            if (entry.slot.index < INODE_PRIMARY_TABLE_SIZE)
+                inode.data_pointers[entry.slot.index] = target;
+            else
+                inode.table_blocks[entry.slot.index -
+                                   INODE_PRIMARY_TABLE_SIZE] = target;
+            write_inode(entry.inode, inode);
+        }
+        release_block(entry.block);
+        ++result.blocks;
+    }
+    return result;
+}
+
+void FileSystem::write_file_log(int index, char *data, uint64_t size,
+                                uint64_t pos)
+{
+    Inode inode = this->read_inode(index);
+    if (size == 0)
+        return;
+    // compressed chunks are rewritten in place
+    if (inode.flags & INODE_COMPRESSED_MASK)
+    {
+        write_compressed_file(index, inode, data, size, pos);
+        return;
+    }
+
+    const uint32_t block_size = this->superblock.block_size;
+    uint64_t result_size = std::max(inode.size, pos + size);
+    if (get_file_data_block_count(result_size) > this->max_inode_block_count)
+        throw FileSizeTooBigException();
+
+    // the goal is not used by the log, only passed on; a gap between the
+    // old end and pos is filled with zeroed blocks
+    uint64_t goal = 0;
+    DataBlock content(block_size, 0);
+    uint64_t old_block_count = get_file_data_block_count(inode);
+    for (uint64_t i = old_block_count; i < pos / block_size; ++i)
+    {
+        uint64_t target = allocate_block(goal);
+        write_block(target, content);
+        map_data_block(inode, i, target, goal);
+    }
+
+    uint64_t mapped_block_count = std::max(old_block_count, pos / block_size);
+    for (uint64_t end_pos = pos + size; pos < end_pos;)
+    {
+        uint64_t block = pos / block_size;
+        uint32_t offset = pos % block_size;
+        uint32_t length =
+            std::min<uint64_t>(block_size - offset, end_pos - pos);
+        uint64_t current = (block < mapped_block_count)
+                               ? (get_data_block_pointer(inode, block))
+                               : (0);
+        if (length != block_size)
+        {
+            if (current != 0)
+                content = read_block(current);
+            else
+                std::fill(content.begin(), content.end(), 0);
+        }
+        std::memcpy(content.data() + offset, data, length);
+        // the new version is appended to the log, the old one becomes free
+        // space the cleaner reclaims with its segment
+        uint64_t target = allocate_block(goal);
+        write_block(target, content);
+        map_data_block(inode, block, target, goal);
+        if (current != 0)
+            release_block(current);
+        mapped_block_count = std::max(mapped_block_count, block + 1);
+        data += length;
+        pos += length;
+    }
+
+    inode.last_modified = touch_superblock();
+    inode.generation = superblock.generation;
+    inode.size = result_size;
+    this->write_inode(index, inode);
+}
+
+std::string FileSystem::clean(uint64_t wanted)
+{
+    if (!(this->superblock.features & FEATURE_LOG))
+        throw LogDisabledException();
+    // clean_segments keeps the other operations out itself
+    auto timed = time_call(Metrics::CLEAN, {}, {wanted});
+    std::vector<uint32_t> usage = read_segment_usage();
+    uint64_t before = std::count(usage.begin(), usage.end(), 0u);
+    CleanerResult result = clean_segments(wanted);
+    usage = read_segment_usage();
+    uint64_t after = std::count(usage.begin(), usage.end(), 0u);
+
+    std::stringstream report;
+    report << "Cleaned " << result.segments << " segments, moved "
+           << result.blocks << " live blocks. Clean segments: " << before
+           << " -> " << after << " of " << this->segment_count << "."
+           << std::endl;
+    return report.str();
+}
@@ -0,0 +1,158 @@
+#include <cstring>
+#include <vector>
+
+#include "lz.hpp"
+
+namespace
+{
+    const int HASH_BITS = 14;
+    const size_t MIN_MATCH = 4;
+    const size_t MAX_OFFSET = 65535;
+    // lengths of 15 and more continue in extra bytes
+    const size_t LENGTH_MASK = 15;
+    // misses before the search starts skipping bytes of incompressible data
+    const int SKIP_SHIFT = 5;
+
+    uint32_t read32(const unsigned char *data)
+    {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    uint32_t hash(uint32_t value)
+    {
+        return (value * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    // Upper bound of the bytes a sequence with these lengths takes.
+    size_t sequence_size(size_t literals, size_t match)
+    {
+        return 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1;
+    }
+
+    void write_length(unsigned char *&out, size_t length)
+    {
+        for (; length >= 255; length -= 255)
+            *out++ = 255;
+        *out++ = length;
+    }
+
+    bool read_length(const unsigned char *&in, const unsigned char *end,
+                     size_t &length)
+    {
+        for (unsigned char byte = 255; byte == 255; length += byte)
+        {
+            if (in == end)
+                return false;
+            byte = *in++;
+        }
+        return true;
+    }
+}
+
+size_t lz_compress(const void *source, size_t size, void *destination,
+                   size_t capacity)
+{
+    const unsigned char *in = static_cast<const unsigned char *>(source);
+    unsigned char *out = static_cast<unsigned char *>(destination);
+    unsigned char *out_end = out + capacity;
+    std::vector<uint32_t> table(1 << HASH_BITS, 0);
+
+    size_t anchor = 0;
+    int misses = 0;
+    for (size_t i = 0; i + MIN_MATCH <= size;)
+    {
+        uint32_t value = read32(in + i);
+        uint32_t &slot = table[hash(value)];
+        size_t candidate = slot;
+        slot = i;
+        if (candidate >= i || i - candidate > MAX_OFFSET ||
+            read32(in + candidate) != value)
+        {
+            i += 1 + (misses++ >> SKIP_SHIFT);
+            continue;
+        }
+        misses = 0;
+        size_t length = MIN_MATCH;
+        while (i + length < size && in[candidate + length] == in[i + length])
+            ++length;
+
+        size_t literals = i - anchor;
+        if (sequence_size(literals, length) >
+            static_cast<size_t>(out_end - out))
+            return 0;
+        size_t match = length - MIN_MATCH;
+        *out++ = (std::min(literals, LENGTH_MASK) << 4) |
+                 std::min(match, LENGTH_MASK);
+        if (literals >= LENGTH_MASK)
+            write_length(out, literals - LENGTH_MASK);
+        std::memcpy(out, in + anchor, literals);
+        out += literals;
+        uint16_t offset = i - candidate;
+        std::memcpy(out, &offset, sizeof(offset));
+        out += sizeof(offset);
+        if (match >= LENGTH_MASK)
+            write_length(out, match - LENGTH_MASK);
+        i += length;
+        anchor = i;
+    }
+
+    // the last sequence has literals only
+    size_t literals = size - anchor;
+    if (sequence_size(literals, 0) > static_cast<size_t>(out_end - out))
+        return 0;
+    *out++ = std::min(literals, LENGTH_MASK) << 4;
+    if (literals >= LENGTH_MASK)
+        write_length(out, literals - LENGTH_MASK);
+    std::memcpy(out, in + anchor, literals);
+    out += literals;
+    return out - static_cast<unsigned char *>(destination);
+}
+
+bool lz_decompress(const void *source, size_t size, void *destination,
+                   size_t destination_size)
+{
+    const unsigned char *in = static_cast<const unsigned char *>(source);
+    const unsigned char *in_end = in + size;
+    unsigned char *start = static_cast<unsigned char *>(destination);
+    unsigned char *out = start;
+    unsigned char *out_end = out + destination_size;
+    while (in < in_end)
+    {
+        unsigned char token = *in++;
+        size_t literals = token >> 4;
+        if (literals == LENGTH_MASK && !read_length(in, in_end, literals))
+            return false;
+        if (literals > static_cast<size_t>(in_end - in) ||
+            literals > static_cast<size_t>(out_end - out))
+            return false;
+        std::memcpy(out, in, literals);
+        in += literals;
+        out += literals;
+        if (in == in_end)
+            break;
+
+        uint16_t offset;
+        if (in_end - in < static_cast<ptrdiff_t>(sizeof(offset)))
+            return false;
+        std::memcpy(&offset, in, sizeof(offset));
+        in += sizeof(offset);
+        size_t length = token & LENGTH_MASK;
+        if (length == LENGTH_MASK && !read_length(in, in_end, length))
+            return false;
+        length += MIN_MATCH;
+        if (offset == 0 || offset > out - start ||
+            length > static_cast<size_t>(out_end - out))
+            return false;
+        // the match may overlap the bytes it produces
+        const unsigned char *match = out - offset;
+        if (offset >= length)
+            std::memcpy(out, match, length);
+        else
+            for (size_t i = 0; i < length; ++i)
+                out[i] = match[i];
+        out += length;
+    }
+    return out == out_end;
+}
@@ -2,87 +2,394 @@
 #include <fstream>
 #include <chrono>
 #include <sstream>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <csignal>
 #include "fs.hpp"
 #include "exceptions.hpp"
+#include "server.hpp"
 
-int main(int argc, char **argv)
+// One line of input, split at whitespace.
+typedef struct
+{
+    std::string command;
+    std::string first_arg;
+    std::string second_arg;
+    std::string third_arg;
+} Command;
+
+static Command parse_command(const std::string &line)
+{
+    Command parsed;
+    std::stringstream line_stream(line);
+    line_stream >> parsed.command >> parsed.first_arg >> parsed.second_arg >>
+        parsed.third_arg;
+    return parsed;
+}
+
+static void print_help(std::ostream &out)
+{
+    out << "ls <dir> - prints dir content." << std::endl;
+    out << "upload <local_file> <virtual_file> - copies a local file into "
+           "the file system."
+        << std::endl;
+    out << "extract <virtual_file> <local_file> - extracts a virtual file "
+           "into a local file."
+        << std::endl;
+    out << "import <local_dir> <virtual_dir> [threads] - copies a local "
+           "directory tree into the file system."
+        << std::endl;
+    out << "export <virtual_dir> <local_dir> [threads] - copies a virtual "
+           "directory tree into a local directory."
+        << std::endl;
+    out << "mkdir <dir> - creates a directory and its parents." << std::endl;
+    out << "extend <file> <bytes> - extends file size." << std::endl;
+    out << "truncate <file> <bytes> - truncates file size." << std::endl;
+    out << "df - prints file system usage." << std::endl;
+    out << "scrub [threads] [MiB/s] - verifies block checksums." << std::endl;
+    out << "filefrag [path] - prints the block layout of a file or tree."
+        << std::endl;
+    out << "cp <file> <copy> - copies a file sharing its blocks (reflink)."
+        << std::endl;
+    out << "snapshot <name> - creates a read-only snapshot in /.snapshots."
+        << std::endl;
+    out << "send <snapshot> <local stream> [base snapshot] - writes the "
+           "changes since the base snapshot."
+        << std::endl;
+    out << "receive <local stream> - creates the snapshot a stream "
+           "describes."
+        << std::endl;
+    out << "compress <path> [on|off] - compresses a file or the new files "
+           "of a directory."
+        << std::endl;
+    out << "defrag [MiB/s] - makes fragmented files contiguous." << std::endl;
+    out << "clean [segments] - reclaims log segments now." << std::endl;
+    out << "fsck [threads] [repair] - checks (and repairs) file system "
+           "consistency."
+        << std::endl;
+    out << "stats [json] - prints I/O counters and latencies." << std::endl;
+    out << "trace start <local file>|stop - records the calls to a trace."
+        << std::endl;
+    out << "replay <local file> [replayers] [timed] - runs a trace again."
+        << std::endl;
+    out << "dump [local file] - writes an image held in memory to a file."
+        << std::endl;
+    out << "sync - writes everything to stable storage." << std::endl;
+    out << "rm <file> - deletes a virtual file." << std::endl;
+    out << "h|help - shows this help text." << std::endl;
+}
+
+// Runs one command, reports go to out and failures to err. Returns false
+// on exit.
+static bool execute(FileSystem &fs, const Command &parsed, std::ostream &out,
+                    std::ostream &err)
 {
-    if (argc == 3)
+    const std::string &command = parsed.command;
+    const std::string &first_arg = parsed.first_arg;
+    const std::string &second_arg = parsed.second_arg;
+    const std::string &third_arg = parsed.third_arg;
+    try
     {
-        FileSystem fs(argv[1], atoi(argv[2]));
-        for (std::string line, command, first_arg, second_arg;
-             std::cout << ":> "; command = "", first_arg = "", second_arg = "")
-        {
-            if (!getline(std::cin, line))
+        if (command == "ls")
+            out << fs.ls(first_arg) << std::endl;
+        else if (command == "upload")
+            try
             {
-                return 0;
+                fs.cplocal(first_arg, second_arg);
             }
-            std::stringstream line_stream(line);
-            line_stream >> command >> first_arg >> second_arg;
-            if (command == "ls")
-                std::cout << fs.ls(first_arg) << std::endl;
-            else if (command == "upload")
-                try
-                {
-                    fs.cplocal(first_arg, second_arg);
-                }
-                catch (NonUniqueNameException &e)
-                {
-                    std::cout << e.what() << std::endl;
-                }
-            else if (command == "extract")
-                fs.cpvirtual(first_arg, second_arg);
-            else if (command == "mkdir")
+            catch (NonUniqueNameException &e)
             {
-                try
-                {
-                    fs.mkdir(first_arg);
-                }
-                catch (const std::exception &e)
-                {
-                    std::cerr << e.what() << std::endl;
-                }
+                out << e.what() << std::endl;
             }
-
-            //            else if (command == "rmdir")
-            //                fs.rmdir(first_arg);
-            else if (command == "rm")
-                fs.rm(first_arg);
-            else if (command == "extend")
-                fs.extend(first_arg, stoi(second_arg));
-            else if (command == "truncate")
-                fs.truncate(first_arg, stoi(second_arg));
-            else if (command == "remove")
-                fs.rm(first_arg);
-            else if (command == "df")
-                std::cout << fs.df() << std::endl;
-            else if (command == "help" || command == "h")
+            catch (ReadOnlyException &e)
             {
-                std::cout << "ls <dir> - prints dir content." << std::endl;
-                std::cout
-                    << "upload <local_file> <virtual_file> - copies a local file into the file system."
-                    << std::endl;
-                std::cout
-                    << "extract <virtual_file> <local_file> - extracts a virtual file into a local file."
+                out << e.what() << std::endl;
+            }
+        else if (command == "extract")
+            fs.cpvirtual(first_arg, second_arg);
+        else if (command == "import" || command == "export")
+        {
+            unsigned threads = (third_arg.empty())
+                                   ? (std::thread::hardware_concurrency())
+                                   : (std::stoul(third_arg));
+            if (command == "import")
+                out << fs.import_tree(first_arg, second_arg, threads)
                     << std::endl;
-                std::cout << "extend <file> <bytes> - extends file size."
-                          << std::endl;
-                std::cout
-                    << "truncate <file> <bytes> - truncates file size."
+            else
+                out << fs.export_tree(first_arg, second_arg, threads)
                     << std::endl;
-                std::cout << "df - prints file system usage." << std::endl;
-                std::cout << "rm <file> - deletes a virtual file."
-                          << std::endl;
-                std::cout << "h|help - shows this help text." << std::endl;
+        }
+        else if (command == "mkdir")
+            fs.mkdir(first_arg);
+        //        else if (command == "rmdir")
+        //            fs.rmdir(first_arg);
+        else if (command == "rm" || command == "remove")
+            fs.rm(first_arg);
+        else if (command == "extend")
+            fs.extend(first_arg, stoull(second_arg));
+        else if (command == "truncate")
+            fs.truncate(first_arg, stoull(second_arg));
+        else if (command == "df")
+            out << fs.df() << std::endl;
+        else if (command == "fsck")
+            out << fs.fsck((first_arg.empty())
+                               ? (std::thread::hardware_concurrency())
+                               : (std::stoul(first_arg)),
+                           second_arg == "repair")
+                << std::endl;
+        else if (command == "filefrag")
+            out << fs.filefrag(first_arg) << std::endl;
+        else if (command == "cp")
+            fs.reflink(first_arg, second_arg);
+        else if (command == "snapshot")
+            out << fs.snapshot(first_arg) << std::endl;
+        else if (command == "send")
+            out << fs.send(first_arg, second_arg, third_arg) << std::endl;
+        else if (command == "receive")
+            out << fs.receive(first_arg) << std::endl;
+        else if (command == "compress")
+            fs.set_compression(first_arg, second_arg != "off");
+        else if (command == "defrag")
+            out << fs.defrag((first_arg.empty())
+                                 ? (0)
+                                 : (std::stoull(first_arg) << 20))
+                << std::endl;
+        else if (command == "clean")
+            out << fs.clean((first_arg.empty()) ? (UINT64_MAX)
+                                                : (std::stoull(first_arg)))
+                << std::endl;
+        else if (command == "trace")
+        {
+            if (first_arg == "start")
+                out << fs.trace_start(second_arg) << std::endl;
+            else
+                out << fs.trace_stop() << std::endl;
+        }
+        // replay <trace> [<replayers>] [timed]
+        else if (command == "replay")
+            out << fs.replay(first_arg, third_arg == "timed",
+                             (second_arg.empty()) ? (1)
+                                                  : (std::stoul(second_arg)))
+                << std::endl;
+        else if (command == "stats")
+            out << fs.stats(first_arg == "json") << std::endl;
+        else if (command == "dump")
+            out << fs.dump(first_arg) << std::endl;
+        else if (command == "sync")
+            fs.sync();
+        else if (command == "scrub")
+            out << fs.scrub((first_arg.empty()) ? (1)
+                                                : (std::stoul(first_arg)),
+                            (second_arg.empty())
+                                ? (0)
+                                : (std::stoull(second_arg) << 20))
+                << std::endl;
+        else if (command == "help" || command == "h")
+            print_help(out);
+        else if (command == "exit")
+            return false;
+    }
+    catch (const std::exception &e)
+    {
+        err << e.what() << std::endl;
+    }
+    return true;
+}
+
+// Runs a script without prompts: the commands are read and parsed before
+// the first one runs, their output is collected in memory and the
+// metadata writes of all of them go to the image once, at the end.
+static int run_batch(FileSystem &fs, std::istream &input)
+{
+    std::vector<Command> commands;
+    for (std::string line; std::getline(input, line);)
+    {
+        Command parsed = parse_command(line);
+        // blank lines and # comments
+        if (parsed.command.empty() || parsed.command.starts_with("#"))
+            continue;
+        commands.push_back(std::move(parsed));
+    }
+
+    std::ios::sync_with_stdio(false);
+    std::ostringstream out;
+    fs.begin_batch();
+    for (const Command &parsed : commands)
+    {
+        if (!execute(fs, parsed, out, std::cerr))
+            break;
+        // large outputs are passed on in pieces
+        if (out.tellp() >= (1 << 16))
+        {
+            std::cout << out.str();
+            out.str("");
+        }
+    }
+    fs.end_batch();
+    std::cout << out.str() << std::flush;
+    return 0;
+}
+
+// The server of --serve, stopped by SIGINT and SIGTERM.
+static Server *running_server = nullptr;
+
+static void stop_server(int)
+{
+    if (running_server != nullptr)
+        running_server->stop();
+}
+
+static int run_server(FileSystem &fs, const std::string &socket_path,
+                      const std::string &root)
+{
+    try
+    {
+        Server server(fs, socket_path, std::thread::hardware_concurrency(),
+                      root);
+        running_server = &server;
+        std::signal(SIGINT, stop_server);
+        std::signal(SIGTERM, stop_server);
+        server.run();
+        running_server = nullptr;
+    }
+    catch (const std::exception &e)
+    {
+        running_server = nullptr;
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    fs.sync();
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::string> arguments;
+    FormatOptions options;
+    std::string stripe_count, stripe_unit, mirror_count;
+    bool batch = false;
+    std::string script;
+    std::string socket_path;
+    std::string serve_root;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string argument = argv[i];
+        if (argument == "--checksums")
+            options.checksums = true;
+        else if (argument == "--dedup")
+            options.dedup = true;
+        else if (argument == "--reflink")
+            options.reflink = true;
+        else if (argument == "--tails")
+            options.tail_packing = true;
+        else if (argument == "--log")
+            options.log_structured = true;
+        else if (argument == "--memory")
+            options.in_memory = true;
+        else if (argument == "--direct")
+            options.direct_io = true;
+        else if (argument == "--batch")
+            batch = true;
+        else if (argument.starts_with("--batch="))
+        {
+            batch = true;
+            script = argument.substr(argument.find('=') + 1);
+        }
+        else if (argument.starts_with("--serve="))
+            socket_path = argument.substr(argument.find('=') + 1);
+        else if (argument.starts_with("--serve-root="))
+            serve_root = argument.substr(argument.find('=') + 1);
+        else if (argument.starts_with("--stripe="))
+            stripe_count = argument.substr(argument.find('=') + 1);
+        else if (argument.starts_with("--stripe-unit="))
+            stripe_unit = argument.substr(argument.find('=') + 1);
+        else if (argument.starts_with("--mirror="))
+            mirror_count = argument.substr(argument.find('=') + 1);
+        else
+            arguments.push_back(argument);
+    }
+    if (arguments.size() >= 1 && arguments.size() <= 4)
+    {
+        std::unique_ptr<FileSystem> fs_pointer;
+        std::ifstream script_stream;
+        try
+        {
+            if (arguments.size() > 2)
+                options.block_size = std::stoul(arguments[2]);
+            if (arguments.size() > 3)
+                options.inode_count = std::stoul(arguments[3]);
+            if (!stripe_count.empty())
+                options.stripe_count = std::stoul(stripe_count);
+            if (!stripe_unit.empty())
+                options.stripe_unit = std::stoul(stripe_unit);
+            if (!mirror_count.empty())
+                options.mirror_count = std::stoul(mirror_count);
+            if (!script.empty())
+            {
+                script_stream.open(script);
+                if (!script_stream)
+                    throw std::runtime_error("Cannot read " + script + ".");
+            }
+            if (arguments.size() == 1)
+                fs_pointer = std::make_unique<FileSystem>(
+                    arguments[0], options.in_memory, options.direct_io);
+            else
+                fs_pointer = std::make_unique<FileSystem>(
+                    arguments[0], std::stoull(arguments[1]), options);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        FileSystem &fs = *fs_pointer;
+        if (!socket_path.empty())
+            return run_server(fs, socket_path, serve_root);
+        if (batch)
+            return run_batch(fs, (script.empty()) ? (std::cin)
+                                                  : (script_stream));
+        for (std::string line; std::cout << ":> ";)
+        {
+            if (!getline(std::cin, line))
+            {
+                return 0;
             }
-            else if (command == "exit")
+            if (!execute(fs, parse_command(line), std::cout, std::cerr))
                 break;
         }
     }
     else
     {
-        std::cout << "Usage: ./fs.out <file_name> <size_in_bytes>"
+        std::cout << "Usage: ./fs.out <file_name> [<size_in_bytes> "
+                     "[<block_size> [<inode_count>]]] [--checksums] [--dedup] "
+                     "[--reflink] [--tails] [--log] [--stripe=<files>] "
+                     "[--stripe-unit=<bytes>] [--mirror=<copies>] [--memory] "
+                     "[--direct] [--batch[=<script>]] [--serve=<socket> "
+                     "[--serve-root=<dir>]]"
+                  << std::endl;
+        std::cout << "A striped image adds the backing files "
+                     "<file_name>.1 ... <file_name>.<files - 1>, a mirrored "
+                     "one the copies <file_name>.1 ... and the dirty region "
+                     "bitmap <file_name>.dirty."
+                  << std::endl;
+        std::cout << "Without a size an existing image is opened."
+                  << std::endl;
+        std::cout << "With --memory the image lives in memory, the dump "
+                     "command writes it to <file_name>."
+                  << std::endl;
+        std::cout << "With --direct the backing files bypass the page "
+                     "cache (O_DIRECT)."
+                  << std::endl;
+        std::cout << "With --batch the commands are read from the script "
+                     "(or standard input) without prompts and the image is "
+                     "synced once at the end."
+                  << std::endl;
+        std::cout << "With --serve the image is served to other processes "
+                     "over the Unix socket until SIGINT or SIGTERM. Its "
+                     "clients upload and extract local files only below "
+                     "--serve-root, by relative paths."
                   << std::endl;
     }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,31 @@
+#include <chrono>
+#include <sstream>
+
+#include "fs.hpp"
+#include "exceptions.hpp"
+
+std::string FileSystem::dump(const std::string &local_name)
+{
+    auto timed = time_call(Metrics::DUMP, {local_name});
+    auto paused = pause_cleaner();
+    if (!this->in_memory)
+        throw NotInMemoryException();
+    write_deferred_metadata();
+    std::string path = (local_name.empty()) ? (this->image_name)
+                                            : (local_name);
+    auto start = std::chrono::steady_clock::now();
+    uint64_t bytes;
+    {
+        // every operation leaves the image consistent, no other one runs
+        std::lock_guard<std::mutex> guard(this->drive_lock);
+        MemoryDevice &memory = static_cast<MemoryDevice &>(*this->drive);
+        bytes = memory.dump(path);
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    std::stringstream result;
+    result << "Dumped " << bytes << " bytes to " << path << " in " << seconds
+           << " s." << std::endl;
+    return result.str();
+}
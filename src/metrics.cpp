@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <sstream>
+
+#include "metrics.hpp"
+
+// in the order of Metrics::Operation
+static const char *OPERATION_NAMES[Metrics::OPERATION_COUNT] = {
+    "upload",   "extract",  "read",     "mkdir",   "rm",
+    "extend",   "truncate", "ls",       "df",      "scrub",
+    "fsck",     "defrag",   "filefrag", "reflink", "snapshot",
+    "send",     "receive",  "compression", "clean", "dump",
+    "import",   "export",   "open",     "pread",   "pwrite"};
+
+int LatencyHistogram::bucket_of(uint64_t value)
+{
+    if (value < SUB_BUCKETS)
+        return value;
+    int bits = std::bit_width(value) - 1;
+    if (bits > MAX_BITS)
+        return BUCKET_COUNT - 1;
+    int shift = bits - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint64_t LatencyHistogram::bucket_top(int bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+    int shift = bucket / SUB_BUCKETS - 1;
+    uint64_t bottom = static_cast<uint64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS)
+                      << shift;
+    return bottom + (static_cast<uint64_t>(1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t nanoseconds)
+{
+    this->buckets[bucket_of(nanoseconds)].fetch_add(1,
+                                                    std::memory_order_relaxed);
+    this->total.fetch_add(1, std::memory_order_relaxed);
+    this->sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+    uint64_t seen = this->maximum.load(std::memory_order_relaxed);
+    while (seen < nanoseconds &&
+           !this->maximum.compare_exchange_weak(seen, nanoseconds,
+                                                std::memory_order_relaxed))
+        ;
+}
+
+uint64_t LatencyHistogram::count() const
+{
+    return this->total.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::mean() const
+{
+    uint64_t samples = count();
+    return (samples == 0) ? (0)
+                          : (this->sum.load(std::memory_order_relaxed) /
+                             samples);
+}
+
+uint64_t LatencyHistogram::max() const
+{
+    return this->maximum.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::percentile(double fraction) const
+{
+    uint64_t samples = count();
+    if (samples == 0)
+        return 0;
+    uint64_t wanted = std::max<uint64_t>(1, std::ceil(fraction * samples));
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < BUCKET_COUNT; ++bucket)
+    {
+        seen += this->buckets[bucket].load(std::memory_order_relaxed);
+        if (seen >= wanted)
+            return std::min(bucket_top(bucket), max());
+    }
+    return max();
+}
+
+std::string Metrics::report(uint32_t block_size) const
+{
+    std::stringstream result;
+    result << "Block reads: " << this->block_reads << " ("
+           << this->block_reads * block_size
+           << " bytes), block writes: " << this->block_writes << " ("
+           << this->block_writes * block_size << " bytes)." << std::endl;
+    result << "Bitmap probes: " << this->bitmap_probes
+           << ", inode reads: " << this->inode_reads
+           << ", directory lookups: " << this->directory_lookups << " ("
+           << this->directory_entries_scanned << " entries scanned)."
+           << std::endl;
+    result << "Latency in us (count, mean, p50, p90, p99, p99.9, max):"
+           << std::endl;
+    auto line = [&](const char *name, const LatencyHistogram &histogram)
+    {
+        if (histogram.count() == 0)
+            return;
+        result << "  " << name << ": " << histogram.count();
+        for (uint64_t value :
+             {histogram.mean(), histogram.percentile(0.5),
+              histogram.percentile(0.9), histogram.percentile(0.99),
+              histogram.percentile(0.999), histogram.max()})
+            result << ", " << value / 1000.0;
+        result << std::endl;
+    };
+    line("block read", this->block_read_latency);
+    line("block write", this->block_write_latency);
+    for (int operation = 0; operation < OPERATION_COUNT; ++operation)
+        line(OPERATION_NAMES[operation], this->operation_latency[operation]);
+    return result.str();
+}
+
+std::string Metrics::json(uint32_t block_size) const
+{
+    std::stringstream result;
+    result << "{\"counters\":{\"block_reads\":" << this->block_reads
+           << ",\"block_writes\":" << this->block_writes
+           << ",\"bytes_read\":" << this->block_reads * block_size
+           << ",\"bytes_written\":" << this->block_writes * block_size
+           << ",\"bitmap_probes\":" << this->bitmap_probes
+           << ",\"inode_reads\":" << this->inode_reads
+           << ",\"directory_lookups\":" << this->directory_lookups
+           << ",\"directory_entries_scanned\":"
+           << this->directory_entries_scanned << "},\"latency_ns\":{";
+    auto entry = [&](const char *name, const LatencyHistogram &histogram)
+    {
+        result << "\"" << name << "\":{\"count\":" << histogram.count()
+               << ",\"mean\":" << histogram.mean()
+               << ",\"p50\":" << histogram.percentile(0.5)
+               << ",\"p90\":" << histogram.percentile(0.9)
+               << ",\"p99\":" << histogram.percentile(0.99)
+               << ",\"p999\":" << histogram.percentile(0.999)
+               << ",\"max\":" << histogram.max() << "}";
+    };
+    entry("block_read", this->block_read_latency);
+    result << ",";
+    entry("block_write", this->block_write_latency);
+    for (int operation = 0; operation < OPERATION_COUNT; ++operation)
+    {
+        result << ",";
+        entry(OPERATION_NAMES[operation], this->operation_latency[operation]);
+    }
+    result << "}}";
+    return result.str();
+}
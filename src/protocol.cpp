@@ -0,0 +1,155 @@
+#include <cstring>
+
+#include "exceptions.hpp"
+#include "protocol.hpp"
+#include "varint.hpp"
+
+static void put(std::string &out, uint64_t value)
+{
+    char bytes[VARINT_MAX_BYTES];
+    out.append(bytes, encode_varint(value, bytes));
+}
+
+static void put(std::string &out, const std::string &text)
+{
+    put(out, text.size());
+    out.append(text);
+}
+
+// Reads the fields of one message, which is known to be complete.
+class MessageReader
+{
+    const char *position;
+    const char *end;
+
+public:
+    MessageReader(const char *data, size_t size)
+        : position(data), end(data + size)
+    {
+    }
+
+    uint64_t get()
+    {
+        uint64_t value;
+        auto next_byte = [this]() -> int
+        {
+            if (this->position == this->end)
+                return -1;
+            return static_cast<uint8_t>(*this->position++);
+        };
+        if (!decode_varint(next_byte, value))
+            throw InvalidMessageException();
+        return value;
+    }
+
+    // A value that has to fit a narrower field, at most max.
+    uint64_t get(uint64_t max)
+    {
+        uint64_t value = get();
+        if (value > max)
+            throw InvalidMessageException();
+        return value;
+    }
+
+    std::string get_string()
+    {
+        uint64_t length = get();
+        if (length > static_cast<uint64_t>(this->end - this->position))
+            throw InvalidMessageException();
+        std::string text(this->position, length);
+        this->position += length;
+        return text;
+    }
+
+    bool done() const { return this->position == this->end; }
+};
+
+// Wraps a message body into its length prefix.
+static void frame(std::string &out, size_t start)
+{
+    uint32_t length = out.size() - start - sizeof(length);
+    std::memcpy(out.data() + start, &length, sizeof(length));
+}
+
+// The length of the first message, 0 while it is incomplete.
+static size_t framed_length(const char *data, size_t size)
+{
+    uint32_t length;
+    if (size < sizeof(length))
+        return 0;
+    std::memcpy(&length, data, sizeof(length));
+    if (length > PROTOCOL_MAX_MESSAGE)
+        throw InvalidMessageException();
+    return (size - sizeof(length) < length) ? (0)
+                                            : (sizeof(length) + length);
+}
+
+void encode_request(const Request &request, std::string &out)
+{
+    size_t start = out.size();
+    out.append(sizeof(uint32_t), '\0');
+    put(out, request.id);
+    put(out, request.operation);
+    put(out, request.flags);
+    put(out, request.numbers.size());
+    for (uint64_t number : request.numbers)
+        put(out, number);
+    put(out, request.names.size());
+    for (const std::string &name : request.names)
+        put(out, name);
+    put(out, request.data);
+    frame(out, start);
+}
+
+void encode_response(const Response &response, std::string &out)
+{
+    size_t start = out.size();
+    out.append(sizeof(uint32_t), '\0');
+    put(out, response.id);
+    put(out, response.status);
+    put(out, response.number);
+    put(out, response.data);
+    frame(out, start);
+}
+
+size_t decode_request(const char *data, size_t size, Request &request)
+{
+    size_t length = framed_length(data, size);
+    if (length == 0)
+        return 0;
+    MessageReader reader(data + sizeof(uint32_t), length - sizeof(uint32_t));
+    request.id = reader.get(UINT32_MAX);
+    request.operation = reader.get(PROTOCOL_OPERATION_COUNT - 1);
+    request.flags = reader.get(UINT8_MAX);
+    uint64_t count = reader.get();
+    if (count > length)
+        throw InvalidMessageException();
+    request.numbers.resize(count);
+    for (uint64_t &number : request.numbers)
+        number = reader.get();
+    count = reader.get();
+    if (count > length)
+        throw InvalidMessageException();
+    request.names.resize(count);
+    for (std::string &name : request.names)
+        name = reader.get_string();
+    request.data = reader.get_string();
+    if (!reader.done())
+        throw InvalidMessageException();
+    return length;
+}
+
+size_t decode_response(const char *data, size_t size, Response &response)
+{
+    size_t length = framed_length(data, size);
+    if (length == 0)
+        return 0;
+    MessageReader reader(data + sizeof(uint32_t), length - sizeof(uint32_t));
+    response.id = reader.get(UINT32_MAX);
+    response.status = reader.get(UINT8_MAX);
+    response.number = reader.get();
+    response.data = reader.get_string();
+    if (!reader.done())
+        throw InvalidMessageException();
+    return length;
+}
@@ -0,0 +1,145 @@
+#include <functional>
+#include <sstream>
+#include <unordered_map>
+
+#include "fs.hpp"
+#include "exceptions.hpp"
+
+void FileSystem::share_tree(const Inode &inode)
+{
+    // everything below a table is shared through the table
+    std::lock_guard<std::mutex> guard(this->reference_lock);
+    auto add_reference = [&](uint64_t block)
+    {
+        if (block == 0)
+            return;
+        BlockReference reference = read_block_reference(block);
+        ++reference.count;
+        write_block_reference(block, reference);
+    };
+    uint64_t data_block_count = get_file_data_block_count(inode);
+    for (uint64_t i = 0; i < data_block_count && i < INODE_PRIMARY_TABLE_SIZE;
+         ++i)
+        add_reference(inode.data_pointers[i]);
+    for (int level = 0; level < INODE_TABLE_LEVELS; ++level)
+        add_reference(inode.table_blocks[level]);
+}
+
+void FileSystem::clone_inode(uint32_t source, uint32_t destination)
+{
+    Inode original = read_inode(source);
+    Inode clone = read_inode(destination);
+    forget_directory(destination);
+    share_tree(original);
+    clone.size = original.size;
+    clone.generation = original.generation;
+    std::copy(std::begin(original.data_pointers),
+              std::end(original.data_pointers), std::begin(clone.data_pointers));
+    std::copy(std::begin(original.table_blocks),
+              std::end(original.table_blocks), std::begin(clone.table_blocks));
+    clone.flags = (clone.flags & ~INODE_COMPRESSED_MASK) |
+                  (original.flags & INODE_COMPRESSED_MASK);
+    clone.last_modified = touch_superblock();
+    write_inode(destination, clone);
+}
+
+void FileSystem::reflink(const std::string &source,
+                         const std::string &destination)
+{
+    auto timed = time_call(Metrics::REFLINK, {source, destination});
+    auto paused = pause_cleaner();
+    if (!shares_blocks())
+        throw BlockSharingDisabledException();
+    uint32_t source_index = find_file_in_dir(source);
+    if ((read_inode(source_index).flags & INODE_MODE_MASK) != FILE_TYPE::FILE)
+        throw NotAFileException();
+    std::string name =
+        (destination[0] == '/') ? (destination) : ("/" + destination);
+    create_file(name, FILE_TYPE::FILE);
+    clone_inode(source_index, find_file_in_dir(name));
+}
+
+void FileSystem::clone_tree(uint32_t source, const std::string &path,
+                            uint64_t &file_count, uint64_t &directory_count)
+{
+    // hard linked files stay linked in the clone
+    std::unordered_map<uint32_t, uint32_t> clones;
+    std::function<void(uint32_t, const std::string &)> clone_directory =
+        [&](uint32_t index, const std::string &clone_path)
+    {
+        uint32_t clone_index = find_file_in_dir(clone_path);
+        for (auto &[entry, child] : read_directory(index))
+        {
+            if (entry == "." || entry == ".." ||
+                (index == 0 && entry == SNAPSHOT_DIRECTORY))
+                continue;
+            std::string child_path = clone_path + "/" + entry;
+            Inode inode = read_inode(child);
+            mask_type type = inode.flags & INODE_MODE_MASK;
+            if (type == FILE_TYPE::DIR)
+            {
+                create_file(child_path, FILE_TYPE::DIR);
+                clone_directory(child, child_path);
+                ++directory_count;
+                continue;
+            }
+            auto found = clones.find(child);
+            if (found != clones.end())
+            {
+                add_inode_to_dir(clone_index, found->second, entry);
+                Inode linked = read_inode(found->second);
+                ++linked.reference_count;
+                write_inode(found->second, linked);
+                continue;
+            }
+            create_file(child_path, static_cast<FILE_TYPE>(type));
+            uint32_t file_clone = find_file_in_dir(child_path);
+            clone_inode(child, file_clone);
+            clones.emplace(child, file_clone);
+            ++file_count;
+        }
+    };
+    clone_directory(source, path);
+}
+
+void FileSystem::seal_tree(uint32_t index)
+{
+    Inode inode = read_inode(index);
+    if ((inode.flags & INODE_MODE_MASK) == FILE_TYPE::DIR)
+    {
+        for (auto &[entry, child] : read_directory(index))
+            if (entry != "." && entry != "..")
+                seal_tree(child);
+    }
+    // sealed after its entries, the directory is read again
+    inode = read_inode(index);
+    inode.flags |= INODE_READONLY_MASK;
+    write_inode(index, inode);
+}
+
+std::string FileSystem::snapshot(const std::string &name)
+{
+    auto timed = time_call(Metrics::SNAPSHOT, {name});
+    auto paused = pause_cleaner();
+    if (!shares_blocks())
+        throw BlockSharingDisabledException();
+    std::string snapshots = std::string("/") + SNAPSHOT_DIRECTORY;
+    std::string path = snapshots + "/" + name;
+    mkdir(snapshots);
+    if (!is_name_unique(name, find_file_in_dir(snapshots)))
+        throw NonUniqueNameException();
+    mkdir(path);
+
+    uint64_t file_count = 0, directory_count = 0;
+    clone_tree(0, path, file_count, directory_count);
+    seal_tree(find_file_in_dir(path));
+    // later changes are told apart from the snapshot by their generation
+    uint64_t generation = superblock.generation++;
+    write_superblock();
+
+    std::stringstream result;
+    result << "Snapshot " << path << ": " << file_count << " files, "
+           << directory_count << " directories, generation " << generation
+           << "." << std::endl;
+    return result.str();
+}
@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <thread>
+
+#include "fs.hpp"
+#include "exceptions.hpp"
+#include "crc32c.hpp"
+#include "rate_limiter.hpp"
+
+std::string FileSystem::scrub(unsigned thread_count,
+                              uint64_t bytes_per_second)
+{
+    auto timed = time_call(Metrics::SCRUB, {}, {thread_count, bytes_per_second});
+    auto paused = pause_cleaner();
+    if (!(this->superblock.features & FEATURE_CHECKSUMS))
+        throw ChecksumsDisabledException();
+    if (thread_count == 0)
+        thread_count = 1;
+
+    const uint32_t block_size = this->superblock.block_size;
+    const uint32_t copies = this->drive->copy_count();
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<uint32_t> next_group{0};
+    std::atomic<uint64_t> checked{0};
+    std::mutex bad_blocks_lock;
+    std::vector<uint64_t> bad_blocks;
+    std::atomic<uint64_t> repaired{0};
+    RateLimiter limiter(bytes_per_second);
+
+    // groups are handed out one at a time, every worker verifies runs of
+    // allocated blocks with a single read per copy, a bad copy on a
+    // mirrored drive is replaced by a good one
+    auto worker = [&]()
+    {
+        std::vector<char> run(SCRUB_RUN_BLOCKS * block_size);
+        std::vector<uint32_t> checksums(SCRUB_RUN_BLOCKS);
+        for (uint32_t group_index;
+             (group_index = next_group++) < this->superblock.group_count;)
+        {
+            AllocationGroup &group = *this->groups[group_index];
+            std::vector<uint8_t> bitmap;
+            {
+                std::lock_guard<std::mutex> guard(group.lock);
+                load_group_bitmap(group_index);
+                bitmap = group.bitmap;
+            }
+            auto used = [&](uint32_t i)
+            { return bitmap[i >> 3] & (1 << (i & 7)); };
+            for (uint32_t i = 0; i < group.block_count;)
+            {
+                if (!used(i))
+                {
+                    ++i;
+                    continue;
+                }
+                uint32_t length = 1;
+                while (i + length < group.block_count &&
+                       length < SCRUB_RUN_BLOCKS && used(i + length))
+                    ++length;
+                uint64_t first = group.first_block + i;
+                this->drive->read(this->checksums_offset +
+                                      first * sizeof(uint32_t),
+                                  reinterpret_cast<char *>(checksums.data()),
+                                  length * sizeof(uint32_t));
+                for (uint32_t copy = 0; copy < copies; ++copy)
+                {
+                    limiter.acquire(static_cast<uint64_t>(length) *
+                                    block_size);
+                    this->drive->read_copy(
+                        copy, this->blocks_offset + first * block_size,
+                        run.data(), static_cast<uint64_t>(length) * block_size);
+                    for (uint32_t j = 0; j < length; ++j)
+                    {
+                        char *data = run.data() + j * block_size;
+                        if (checksums[j] == 0 ||
+                            checksums[j] == crc32c(data, block_size))
+                            continue;
+                        bool healed;
+                        {
+                            std::lock_guard<std::mutex> guard(
+                                this->drive_lock);
+                            healed = heal_block(first + j, data);
+                        }
+                        if (healed)
+                        {
+                            ++repaired;
+                            continue;
+                        }
+                        // no copy is good, each of them reports it once
+                        if (copy == 0)
+                        {
+                            std::lock_guard<std::mutex> guard(bad_blocks_lock);
+                            bad_blocks.push_back(first + j);
+                        }
+                    }
+                }
+                checked += length;
+                i += length;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < thread_count; ++i)
+        workers.emplace_back(worker);
+    for (auto &thread : workers)
+        thread.join();
+
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    double megabytes = static_cast<double>(checked) * block_size /
+                       (1024 * 1024);
+    std::stringstream result;
+    result << "Scrubbed " << checked << " blocks (" << megabytes
+           << " MiB) in " << seconds << " s using " << thread_count
+           << " threads";
+    if (seconds > 0)
+        result << " (" << megabytes / seconds << " MiB/s)";
+    result << ", " << bad_blocks.size() << " bad";
+    if (copies > 1)
+        result << ", " << repaired << " copies repaired";
+    result << "." << std::endl;
+    std::sort(bad_blocks.begin(), bad_blocks.end());
+    for (uint64_t block : bad_blocks)
+        result << "Bad block: " << block << std::endl;
+    return result.str();
+}
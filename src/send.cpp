@@ -0,0 +1,442 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+#include "fs.hpp"
+#include "exceptions.hpp"
+
+// A send stream is a header followed by records, each starting with its
+// kind. Paths are relative to the snapshot, the block and hole records
+// belong to the file record before them.
+//   header: id, block size, generation and creation time of the base and
+//           of the target, base and target name
+//   'D' path                    - directory
+//   'F' path, flags, size       - file, created or resized
+//   'B' block, source, block size bytes
+//                               - data block of the file, source is its
+//                                 number on the sending image
+//   'C' block, source           - the block of the file is the one sent
+//                                 before with that source, shared
+//   'H' block                   - the block of the file became a hole
+//   'R' path                    - removed file
+//   'E'                         - end of the stream
+namespace
+{
+    // "FSSTREA2", streams before clone records used "FSSTREAM"
+    const uint64_t STREAM_ID = 0x3241455254535346;
+    // longest path a stream may hold
+    const uint32_t MAX_PATH_LENGTH = 1 << 20;
+
+    enum class RECORD : uint8_t
+    {
+        DIRECTORY = 'D',
+        FILE = 'F',
+        BLOCK = 'B',
+        CLONE = 'C',
+        HOLE = 'H',
+        REMOVED = 'R',
+        END = 'E'
+    };
+
+    template <typename T>
+    void put(std::ostream &stream, const T &value)
+    {
+        stream.write(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    T get(std::istream &stream)
+    {
+        T value;
+        stream.read(reinterpret_cast<char *>(&value), sizeof(T));
+        if (!stream)
+            throw InvalidStreamException();
+        return value;
+    }
+
+    void put_string(std::ostream &stream, const std::string &value)
+    {
+        put<uint32_t>(stream, value.size());
+        stream.write(value.data(), value.size());
+    }
+
+    std::string get_string(std::istream &stream)
+    {
+        uint32_t size = get<uint32_t>(stream);
+        if (size > MAX_PATH_LENGTH)
+            throw InvalidStreamException();
+        std::string value(size, '\0');
+        stream.read(value.data(), size);
+        if (!stream)
+            throw InvalidStreamException();
+        return value;
+    }
+}
+
+void FileSystem::send_tree(std::ostream &stream, uint64_t target,
+                           uint64_t base, int depth, uint64_t first_block,
+                           uint64_t count, SendState &state)
+{
+    // shared with the base, nothing below changed
+    if (target == base)
+        return;
+    if (depth == 0)
+    {
+        if (target == 0)
+        {
+            put(stream, RECORD::HOLE);
+            put(stream, first_block);
+            return;
+        }
+        if (!state.sent_blocks.insert(target).second)
+        {
+            put(stream, RECORD::CLONE);
+            put(stream, first_block);
+            put(stream, target);
+            ++state.clone_count;
+            return;
+        }
+        DataBlock block = read_block(target);
+        put(stream, RECORD::BLOCK);
+        put(stream, first_block);
+        put(stream, target);
+        stream.write(block.data(), block.size());
+        ++state.block_count;
+        return;
+    }
+    // a missing table reads as a table of holes
+    DataBlock target_table(this->superblock.block_size, 0);
+    DataBlock base_table(this->superblock.block_size, 0);
+    if (target != 0)
+        target_table = read_block(target);
+    if (base != 0)
+        base_table = read_block(base);
+    uint64_t span = 1ull << (this->pointer_shift * (depth - 1));
+    for (uint64_t i = 0; i * span < count; ++i)
+    {
+        uint64_t target_child, base_child;
+        std::memcpy(&target_child, target_table.data() + i * sizeof(uint64_t),
+                    sizeof(uint64_t));
+        std::memcpy(&base_child, base_table.data() + i * sizeof(uint64_t),
+                    sizeof(uint64_t));
+        send_tree(stream, target_child, base_child, depth - 1,
+                  first_block + i * span, std::min(count - i * span, span),
+                  state);
+    }
+}
+
+bool FileSystem::send_file(std::ostream &stream, const std::string &path,
+                           const Inode &target, const Inode *base,
+                           SendState &state)
+{
+    mask_type flags =
+        target.flags & (INODE_MODE_MASK | INODE_COMPRESSED_MASK);
+    if (base != nullptr && base->size == target.size &&
+        (base->flags & (INODE_MODE_MASK | INODE_COMPRESSED_MASK)) == flags &&
+        std::equal(std::begin(target.data_pointers),
+                   std::end(target.data_pointers),
+                   std::begin(base->data_pointers)) &&
+        std::equal(std::begin(target.table_blocks),
+                   std::end(target.table_blocks),
+                   std::begin(base->table_blocks)))
+        return false;
+
+    put(stream, RECORD::FILE);
+    put_string(stream, path);
+    put(stream, flags);
+    put(stream, target.size);
+    uint64_t data_block_count = get_file_data_block_count(target);
+    for (uint64_t i = 0;
+         i < data_block_count && i < INODE_PRIMARY_TABLE_SIZE; ++i)
+        send_tree(stream, target.data_pointers[i],
+                  (base != nullptr) ? (base->data_pointers[i]) : (0), 0, i, 1,
+                  state);
+    uint64_t first_block = INODE_PRIMARY_TABLE_SIZE;
+    for (int level = 1;
+         level <= INODE_TABLE_LEVELS && first_block < data_block_count;
+         ++level)
+    {
+        uint64_t span = 1ull << (this->pointer_shift * level);
+        send_tree(stream, target.table_blocks[level - 1],
+                  (base != nullptr) ? (base->table_blocks[level - 1]) : (0),
+                  level, first_block,
+                  std::min(data_block_count - first_block, span), state);
+        first_block += span;
+    }
+    return true;
+}
+
+void FileSystem::send_directory(std::ostream &stream, const std::string &path,
+                                uint32_t target, int64_t base,
+                                SendState &state)
+{
+    auto target_entries = read_directory(target);
+    std::vector<std::pair<std::string, uint32_t>> base_entries;
+    if (base >= 0)
+        base_entries = read_directory(base);
+    auto find_entry = [](const auto &entries, const std::string &name)
+    {
+        return std::find_if(entries.begin(), entries.end(),
+                            [&](const auto &entry)
+                            { return entry.first == name; });
+    };
+    auto is_directory = [&](uint32_t index)
+    {
+        return (read_inode(index).flags & INODE_MODE_MASK) ==
+               FILE_TYPE::DIR;
+    };
+    auto child_path = [&](const std::string &name)
+    {
+        return (path.empty()) ? (name) : (path + "/" + name);
+    };
+
+    // removals go first, a new entry may take the name
+    for (auto &[name, child] : base_entries)
+    {
+        if (name == "." || name == ".." || is_directory(child))
+            continue;
+        auto found = find_entry(target_entries, name);
+        if (found == target_entries.end() || is_directory(found->second))
+        {
+            put(stream, RECORD::REMOVED);
+            put_string(stream, child_path(name));
+        }
+    }
+    for (auto &[name, child] : target_entries)
+    {
+        if (name == "." || name == "..")
+            continue;
+        auto found = find_entry(base_entries, name);
+        int64_t base_child = (found != base_entries.end())
+                                 ? (static_cast<int64_t>(found->second))
+                                 : (-1);
+        if (base_child >= 0 && is_directory(child) != is_directory(base_child))
+            base_child = -1;
+        if (is_directory(child))
+        {
+            if (base_child < 0)
+            {
+                put(stream, RECORD::DIRECTORY);
+                put_string(stream, child_path(name));
+            }
+            send_directory(stream, child_path(name), child, base_child,
+                           state);
+            continue;
+        }
+        Inode base_inode;
+        if (base_child >= 0)
+            base_inode = read_inode(base_child);
+        if (send_file(stream, child_path(name), read_inode(child),
+                      (base_child >= 0) ? (&base_inode) : (nullptr), state))
+            ++state.file_count;
+    }
+}
+
+std::string FileSystem::send(const std::string &name,
+                             const std::string &local_name,
+                             const std::string &base)
+{
+    auto timed = time_call(Metrics::SEND, {name, base});
+    auto paused = pause_cleaner(Access::READ);
+    if (!shares_blocks())
+        throw BlockSharingDisabledException();
+    std::string snapshots = std::string("/") + SNAPSHOT_DIRECTORY + "/";
+    uint32_t target = find_file_in_dir(snapshots + name);
+    int64_t base_index = (base.empty())
+                             ? (-1)
+                             : (static_cast<int64_t>(
+                                   find_file_in_dir(snapshots + base)));
+
+    std::ofstream stream(local_name, std::ios::binary | std::ios::trunc);
+    put(stream, STREAM_ID);
+    put(stream, this->superblock.block_size);
+    // a snapshot is told apart by its generation and creation time
+    Inode base_root{};
+    if (base_index >= 0)
+        base_root = read_inode(base_index);
+    Inode target_root = read_inode(target);
+    put(stream, base_root.generation);
+    put(stream, base_root.creation_time);
+    put(stream, target_root.generation);
+    put(stream, target_root.creation_time);
+    put_string(stream, base);
+    put_string(stream, name);
+    SendState state;
+    send_directory(stream, "", target, base_index, state);
+    put(stream, RECORD::END);
+
+    std::stringstream result;
+    result << "Sent " << name;
+    if (!base.empty())
+        result << " (base " << base << ")";
+    result << ": " << state.file_count << " files, " << state.block_count
+           << " blocks, " << state.clone_count << " cloned, " << stream.tellp()
+           << " bytes." << std::endl;
+    return result.str();
+}
+
+std::string FileSystem::receive(const std::string &local_name)
+{
+    auto timed = time_call(Metrics::RECEIVE, {local_name});
+    auto paused = pause_cleaner();
+    if (!shares_blocks())
+        throw BlockSharingDisabledException();
+    std::ifstream stream(local_name, std::ios::binary);
+    if (get<uint64_t>(stream) != STREAM_ID)
+        throw InvalidStreamException();
+    if (get<uint32_t>(stream) != this->superblock.block_size)
+        throw InvalidGeometryException();
+    uint64_t base_generation = get<uint64_t>(stream);
+    uint64_t base_creation_time = get<uint64_t>(stream);
+    uint64_t target_generation = get<uint64_t>(stream);
+    uint64_t target_creation_time = get<uint64_t>(stream);
+    std::string base = get_string(stream);
+    std::string name = get_string(stream);
+
+    // the stream only holds the changes against its own base
+    std::string snapshots = std::string("/") + SNAPSHOT_DIRECTORY;
+    std::string path = snapshots + "/" + name;
+    int64_t base_index = -1;
+    if (!base.empty())
+    {
+        base_index = find_file_in_dir(snapshots + "/" + base);
+        Inode base_root = read_inode(base_index);
+        if (base_root.generation != base_generation ||
+            base_root.creation_time != base_creation_time)
+            throw SnapshotMismatchException();
+    }
+    mkdir(snapshots);
+    if (!is_name_unique(name, find_file_in_dir(snapshots)))
+        throw NonUniqueNameException();
+    mkdir(path);
+    uint64_t cloned_files = 0, cloned_directories = 0;
+    if (base_index >= 0)
+        clone_tree(base_index, path, cloned_files, cloned_directories);
+
+    uint64_t file_count = 0, block_count = 0, clone_count = 0;
+    uint64_t removed_count = 0;
+    // the block each source block of the stream was written to
+    std::unordered_map<uint64_t, uint64_t> received_blocks;
+    uint32_t file_index = 0;
+    Inode file{};
+    bool file_open = false;
+    uint64_t goal = 0;
+    DataBlock block(this->superblock.block_size);
+    auto close_file = [&]()
+    {
+        if (!file_open)
+            return;
+        file.last_modified = touch_superblock();
+        file.generation = superblock.generation;
+        write_inode(file_index, file);
+        file_open = false;
+    };
+    for (RECORD kind; (kind = get<RECORD>(stream)) != RECORD::END;)
+    {
+        if (kind == RECORD::BLOCK || kind == RECORD::CLONE ||
+            kind == RECORD::HOLE)
+        {
+            uint64_t logical = get<uint64_t>(stream);
+            if (!file_open || logical >= get_file_data_block_count(file))
+                throw InvalidStreamException();
+            if (kind == RECORD::HOLE)
+            {
+                if (get_data_block_pointer(file, logical) != 0)
+                    release_block(map_data_block(file, logical, 0, goal));
+                continue;
+            }
+            uint64_t source = get<uint64_t>(stream);
+            if (kind == RECORD::CLONE)
+            {
+                auto found = received_blocks.find(source);
+                if (found == received_blocks.end())
+                    throw InvalidStreamException();
+                {
+                    std::lock_guard<std::mutex> guard(this->reference_lock);
+                    BlockReference reference =
+                        read_block_reference(found->second);
+                    ++reference.count;
+                    write_block_reference(found->second, reference);
+                }
+                uint64_t previous =
+                    map_data_block(file, logical, found->second, goal);
+                if (previous != 0)
+                    release_block(previous);
+                ++clone_count;
+                continue;
+            }
+            stream.read(block.data(), block.size());
+            if (!stream)
+                throw InvalidStreamException();
+            // blocks still shared with the base are replaced
+            uint64_t written = private_data_block(file, logical, goal, false);
+            write_block(written, block);
+            received_blocks[source] = written;
+            ++block_count;
+            continue;
+        }
+        close_file();
+        std::string entry = path + "/" + get_string(stream);
+        if (kind == RECORD::DIRECTORY)
+            mkdir(entry);
+        else if (kind == RECORD::REMOVED)
+        {
+            rm(entry);
+            ++removed_count;
+        }
+        else if (kind == RECORD::FILE)
+        {
+            mask_type flags = get<mask_type>(stream);
+            uint64_t size = get<uint64_t>(stream);
+            mask_type type = flags & INODE_MODE_MASK;
+            if (type == 0 || type == FILE_TYPE::DIR ||
+                get_file_data_block_count(size) > this->max_inode_block_count)
+                throw InvalidStreamException();
+            try
+            {
+                file_index = find_file_in_dir(entry);
+            }
+            catch (const DirectoryNotFoundException &e)
+            {
+                create_file(entry, static_cast<FILE_TYPE>(type));
+                file_index = find_file_in_dir(entry);
+            }
+            file = read_inode(file_index);
+            if ((file.flags & INODE_MODE_MASK) == FILE_TYPE::DIR)
+                throw InvalidStreamException();
+            // the blocks and holes that follow fill in the rest
+            if (get_file_data_block_count(size) <
+                get_file_data_block_count(file))
+                release_file_blocks(file, get_file_data_block_count(size));
+            file.size = size;
+            file.flags = (file.flags &
+                          ~(INODE_MODE_MASK | INODE_COMPRESSED_MASK)) |
+                         flags;
+            goal = this->groups[file.group]->first_block;
+            file_open = true;
+            ++file_count;
+        }
+        else
+            throw InvalidStreamException();
+    }
+    close_file();
+
+    uint32_t index = find_file_in_dir(path);
+    seal_tree(index);
+    // the received snapshot can be the base of the next stream
+    Inode root = read_inode(index);
+    root.generation = target_generation;
+    root.creation_time = target_creation_time;
+    write_inode(index, root);
+    superblock.generation =
+        std::max(superblock.generation, target_generation) + 1;
+    write_superblock();
+
+    std::stringstream result;
+    result << "Received " << path << ": " << file_count << " files, "
+           << block_count << " blocks, " << clone_count << " cloned, "
+           << removed_count << " removed." << std::endl;
+    return result.str();
+}
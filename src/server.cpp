@@ -0,0 +1,536 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "exceptions.hpp"
+#include "server.hpp"
+
+// epoll keys of the descriptors that are not connections
+enum : uint64_t
+{
+    LISTENER_KEY,
+    COMPLETIONS_KEY,
+    WAKE_KEY,
+    FIRST_CONNECTION_KEY
+};
+
+static sockaddr_un socket_address(const std::string &path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+        throw ConnectionException();
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+static void watch(int poller, int descriptor, uint64_t key, uint32_t events,
+                  int operation = EPOLL_CTL_ADD)
+{
+    epoll_event event = {};
+    event.events = events;
+    event.data.u64 = key;
+    if (::epoll_ctl(poller, operation, descriptor, &event) != 0)
+        throw ConnectionException();
+}
+
+// The bulk data of a request in the shared buffer of its connection,
+// checked against the bounds of the buffer.
+static char *shared_data(const Request &request, size_t index, uint64_t size,
+                         char *shared, uint64_t shared_size)
+{
+    if (index >= request.numbers.size() || shared == nullptr)
+        throw InvalidMessageException();
+    uint64_t offset = request.numbers[index];
+    if (offset > shared_size || size > shared_size - offset)
+        throw InvalidMessageException();
+    return shared + offset;
+}
+
+// The full path of a local file of an upload or extract. Absolute names
+// and .. are refused, and so is a name a link leads out of the root.
+static std::string local_path(const std::string &root,
+                              const std::string &name)
+{
+    std::filesystem::path relative(name);
+    if (root.empty() || name.empty() || relative.is_absolute())
+        throw LocalPathException();
+    for (const std::filesystem::path &part : relative)
+        if (part == "..")
+            throw LocalPathException();
+    std::filesystem::path base(root);
+    std::filesystem::path full =
+        std::filesystem::weakly_canonical(base / relative);
+    if (std::mismatch(base.begin(), base.end(), full.begin(), full.end())
+            .first != base.end())
+        throw LocalPathException();
+    return full.string();
+}
+
+// Runs one request on a worker.
+static Response execute(FileSystem &fs, const Request &request, char *shared,
+                        uint64_t shared_size, const std::string &local_root)
+{
+    Response response;
+    response.id = request.id;
+    auto name = [&](size_t i) -> const std::string &
+    {
+        if (i >= request.names.size())
+            throw InvalidMessageException();
+        return request.names[i];
+    };
+    auto number = [&](size_t i)
+    {
+        if (i >= request.numbers.size())
+            throw InvalidMessageException();
+        return request.numbers[i];
+    };
+    bool in_shared = request.flags & PROTOCOL_SHARED;
+    // the buffer a read goes to, the response or the shared buffer
+    auto read_buffer = [&](uint64_t size, size_t index)
+    {
+        if (in_shared)
+            return shared_data(request, index, size, shared, shared_size);
+        if (size > PROTOCOL_MAX_MESSAGE / 2)
+            throw ReadTooBigException();
+        response.data.resize(size);
+        return response.data.data();
+    };
+    try
+    {
+        switch (request.operation)
+        {
+        case PROTOCOL_OPEN:
+            response.number = fs.open(name(0));
+            break;
+        case PROTOCOL_PREAD:
+            response.number =
+                fs.read(number(0), number(1),
+                        read_buffer(number(2), 3), number(2));
+            if (!in_shared)
+                response.data.resize(response.number);
+            break;
+        case PROTOCOL_PWRITE:
+        {
+            uint64_t size = number(2);
+            char *data = (in_shared)
+                             ? (shared_data(request, 3, size, shared,
+                                            shared_size))
+                             : (const_cast<char *>(request.data.data()));
+            if (!in_shared && request.data.size() < size)
+                throw InvalidMessageException();
+            fs.write(number(0), number(1), data, size);
+            response.number = size;
+            break;
+        }
+        case PROTOCOL_READ:
+            response.number = fs.read(name(0), number(0),
+                                      read_buffer(number(1), 2), number(1));
+            if (!in_shared)
+                response.data.resize(response.number);
+            break;
+        case PROTOCOL_MKDIR:
+            fs.mkdir(name(0));
+            break;
+        case PROTOCOL_RM:
+            fs.rm(name(0));
+            break;
+        case PROTOCOL_EXTEND:
+            fs.extend(name(0), number(0));
+            break;
+        case PROTOCOL_TRUNCATE:
+            fs.truncate(name(0), number(0));
+            break;
+        case PROTOCOL_LS:
+            response.data = fs.ls(name(0));
+            break;
+        case PROTOCOL_DF:
+            response.data = fs.df();
+            break;
+        case PROTOCOL_UPLOAD:
+            fs.cplocal(local_path(local_root, name(0)), name(1));
+            break;
+        case PROTOCOL_EXTRACT:
+            fs.cpvirtual(name(0), local_path(local_root, name(1)));
+            break;
+        case PROTOCOL_REFLINK:
+            fs.reflink(name(0), name(1));
+            break;
+        case PROTOCOL_SNAPSHOT:
+            response.data = fs.snapshot(name(0));
+            break;
+        case PROTOCOL_SET_COMPRESSION:
+            fs.set_compression(name(0), number(0));
+            break;
+        case PROTOCOL_STATS:
+            response.data = fs.stats(number(0));
+            break;
+        case PROTOCOL_SYNC:
+            fs.sync();
+            break;
+        default:
+            throw InvalidMessageException();
+        }
+    }
+    catch (const std::exception &e)
+    {
+        response.status = PROTOCOL_FAILED;
+        response.number = 0;
+        response.data = e.what();
+    }
+    return response;
+}
+
+Server::Server(FileSystem &file_system, const std::string &path,
+               unsigned thread_count, const std::string &root)
+    : fs(file_system), socket_path(path),
+      local_root((root.empty()) ? (root)
+                                : (std::filesystem::canonical(root).string())),
+      workers(std::make_unique<ThreadPoolExecutor>(thread_count)),
+      next_connection(FIRST_CONNECTION_KEY)
+{
+    bool bound = false;
+    try
+    {
+        // an image only in memory that was never dumped has nothing to lock
+        this->image_lock = ::open(this->fs.get_image_name().c_str(),
+                                  O_RDONLY | O_CLOEXEC);
+        if (this->image_lock < 0 && errno != ENOENT)
+            throw DeviceException();
+        if (this->image_lock >= 0 &&
+            ::flock(this->image_lock, LOCK_EX | LOCK_NB) != 0)
+            throw ImageLockedException();
+
+        // a socket left behind by a server that is gone is replaced, one
+        // that still answers is not
+        sockaddr_un address = socket_address(this->socket_path);
+        int probe = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool taken = probe >= 0 &&
+                     ::connect(probe, reinterpret_cast<sockaddr *>(&address),
+                               sizeof(address)) == 0;
+        if (probe >= 0)
+            ::close(probe);
+        if (taken)
+            throw ConnectionException();
+        ::unlink(this->socket_path.c_str());
+
+        this->listener = ::socket(
+            AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (this->listener < 0 ||
+            ::bind(this->listener, reinterpret_cast<sockaddr *>(&address),
+                   sizeof(address)) != 0)
+            throw ConnectionException();
+        bound = true;
+        if (::listen(this->listener, SOMAXCONN) != 0)
+            throw ConnectionException();
+        this->wake = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        this->poller = ::epoll_create1(EPOLL_CLOEXEC);
+        if (this->wake < 0 || this->poller < 0)
+            throw ConnectionException();
+        watch(this->poller, this->listener, LISTENER_KEY, EPOLLIN);
+        watch(this->poller, this->completions.descriptor(), COMPLETIONS_KEY,
+              EPOLLIN);
+        watch(this->poller, this->wake, WAKE_KEY, EPOLLIN);
+    }
+    catch (...)
+    {
+        for (int descriptor : {this->poller, this->wake, this->listener,
+                               this->image_lock})
+            if (descriptor >= 0)
+                ::close(descriptor);
+        if (bound)
+            ::unlink(this->socket_path.c_str());
+        throw;
+    }
+}
+
+Server::~Server()
+{
+    // the workers may still use the shared buffers of their connections
+    this->workers.reset();
+    while (!this->connections.empty())
+        close_connection(this->connections.begin()->first);
+    ::close(this->listener);
+    ::unlink(this->socket_path.c_str());
+    ::close(this->poller);
+    ::close(this->wake);
+    if (this->image_lock >= 0)
+        ::close(this->image_lock);
+}
+
+void Server::stop()
+{
+    this->stopping = true;
+    uint64_t one = 1;
+    [[maybe_unused]] ssize_t written = ::write(this->wake, &one, sizeof(one));
+}
+
+void Server::run()
+{
+    epoll_event events[MAX_EVENTS];
+    while (!this->stopping)
+    {
+        int count = ::epoll_wait(this->poller, events, MAX_EVENTS, -1);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            throw ConnectionException();
+        for (int i = 0; i < count; ++i)
+        {
+            uint64_t key = events[i].data.u64;
+            if (key == LISTENER_KEY)
+                accept_clients();
+            else if (key == COMPLETIONS_KEY)
+                this->completions.run_pending();
+            else if (key == WAKE_KEY)
+                continue;
+            else
+            {
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    receive(key);
+                if (events[i].events & EPOLLOUT)
+                    flush(key);
+            }
+        }
+    }
+}
+
+void Server::accept_clients()
+{
+    while (true)
+    {
+        int client =
+            ::accept4(this->listener, nullptr, nullptr,
+                      SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0)
+            return;
+        uint64_t id = this->next_connection++;
+        Connection &connection = this->connections[id];
+        connection.socket = client;
+        watch(this->poller, client, id, EPOLLIN);
+        connection.watched = true;
+    }
+}
+
+bool Server::backed_up(const Connection &connection)
+{
+    return connection.pending.size() >= MAX_PENDING ||
+           connection.output.size() >= MAX_OUTPUT;
+}
+
+void Server::receive(uint64_t id)
+{
+    auto found = this->connections.find(id);
+    if (found == this->connections.end())
+        return;
+    Connection &connection = found->second;
+    char buffer[RECEIVE_SIZE];
+    char control[CMSG_SPACE(sizeof(int))];
+    while (!connection.closing && !backed_up(connection))
+    {
+        iovec piece = {buffer, sizeof(buffer)};
+        msghdr message = {};
+        message.msg_iov = &piece;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        ssize_t got = ::recvmsg(connection.socket, &message, MSG_CMSG_CLOEXEC);
+        if (got < 0 && (errno == EAGAIN || errno == EINTR))
+            break;
+        if (got <= 0)
+        {
+            connection.closing = true;
+            break;
+        }
+        for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr;
+             header = CMSG_NXTHDR(&message, header))
+        {
+            if (header->cmsg_level != SOL_SOCKET ||
+                header->cmsg_type != SCM_RIGHTS)
+                continue;
+            if (connection.received >= 0)
+                ::close(connection.received);
+            std::memcpy(&connection.received, CMSG_DATA(header),
+                        sizeof(int));
+        }
+        connection.input.append(buffer, got);
+
+        // every whole request is queued, the rest waits for more bytes
+        size_t used = 0;
+        try
+        {
+            while (true)
+            {
+                Request request;
+                size_t length =
+                    decode_request(connection.input.data() + used,
+                                   connection.input.size() - used, request);
+                if (length == 0)
+                    break;
+                used += length;
+                connection.pending.push_back(std::move(request));
+            }
+        }
+        catch (const InvalidMessageException &)
+        {
+            connection.closing = true;
+            connection.pending.clear();
+        }
+        connection.input.erase(0, used);
+    }
+    flush(id);
+}
+
+void Server::start_next(uint64_t id)
+{
+    Connection &connection = this->connections.at(id);
+    // responses wait for the client to read the ones before
+    while (!connection.running && !connection.pending.empty() &&
+           connection.output.size() < MAX_OUTPUT)
+    {
+        Request request = std::move(connection.pending.front());
+        connection.pending.pop_front();
+        if (request.operation == PROTOCOL_ATTACH)
+        {
+            // nothing of the connection runs, its buffer can be replaced
+            Response response;
+            response.id = request.id;
+            attach(connection, request, response);
+            encode_response(response, connection.output);
+            continue;
+        }
+        connection.running = true;
+        char *shared = connection.shared;
+        uint64_t shared_size = connection.shared_size;
+        this->workers->post(
+            [this, id, shared, shared_size,
+             request = std::move(request)]()
+            {
+                Response response = execute(this->fs, request, shared,
+                                            shared_size, this->local_root);
+                this->completions.post(
+                    [this, id, response = std::move(response)]()
+                    { finish(id, response); });
+            });
+    }
+}
+
+void Server::attach(Connection &connection, const Request &request,
+                    Response &response)
+{
+    int descriptor = connection.received;
+    connection.received = -1;
+    if (connection.shared != nullptr)
+        ::munmap(connection.shared, connection.shared_size);
+    connection.shared = nullptr;
+    connection.shared_size = 0;
+    uint64_t size = (request.numbers.empty()) ? (0) : (request.numbers[0]);
+    // the buffer must hold the size the client claims and stay that large,
+    // touching a page past the end of the file kills the server
+    struct stat status;
+    bool usable = descriptor >= 0 && size > 0 &&
+                  ::fstat(descriptor, &status) == 0 &&
+                  static_cast<uint64_t>(status.st_size) >= size &&
+                  (::fcntl(descriptor, F_GET_SEALS) & F_SEAL_SHRINK) != 0;
+    void *mapped = MAP_FAILED;
+    if (usable)
+        mapped = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        descriptor, 0);
+    if (descriptor >= 0)
+        ::close(descriptor);
+    if (mapped == MAP_FAILED)
+    {
+        response.status = PROTOCOL_FAILED;
+        response.data = SharedBufferException().what();
+        return;
+    }
+    connection.shared = static_cast<char *>(mapped);
+    connection.shared_size = size;
+    response.number = size;
+}
+
+void Server::finish(uint64_t id, const Response &response)
+{
+    auto found = this->connections.find(id);
+    if (found == this->connections.end())
+        return;
+    Connection &connection = found->second;
+    connection.running = false;
+    encode_response(response, connection.output);
+    flush(id);
+}
+
+void Server::flush(uint64_t id)
+{
+    auto found = this->connections.find(id);
+    if (found == this->connections.end())
+        return;
+    Connection &connection = found->second;
+    size_t sent = 0;
+    while (sent < connection.output.size())
+    {
+        ssize_t done = ::send(connection.socket,
+                              connection.output.data() + sent,
+                              connection.output.size() - sent, MSG_NOSIGNAL);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done < 0 && errno == EAGAIN)
+            break;
+        if (done < 0)
+        {
+            // the peer is gone, nobody reads the rest
+            connection.closing = true;
+            connection.pending.clear();
+            sent = connection.output.size();
+            break;
+        }
+        sent += done;
+    }
+    connection.output.erase(0, sent);
+    start_next(id);
+    if (connection.closing && !connection.running &&
+        connection.pending.empty() && connection.output.empty())
+    {
+        close_connection(id);
+        return;
+    }
+    // a closing connection is only watched while it has something to
+    // send, the hang up of its peer would wake the loop all the time; one
+    // that is backed up is read again once its queues drain
+    uint32_t events = 0;
+    if (!connection.closing && !backed_up(connection))
+        events |= EPOLLIN;
+    if (!connection.output.empty())
+        events |= EPOLLOUT;
+    if (events == 0 && connection.watched)
+        ::epoll_ctl(this->poller, EPOLL_CTL_DEL, connection.socket, nullptr);
+    else if (events != 0)
+        watch(this->poller, connection.socket, id, events,
+              (connection.watched) ? (EPOLL_CTL_MOD) : (EPOLL_CTL_ADD));
+    connection.watched = events != 0;
+}
+
+void Server::close_connection(uint64_t id)
+{
+    Connection &connection = this->connections.at(id);
+    if (connection.watched)
+        ::epoll_ctl(this->poller, EPOLL_CTL_DEL, connection.socket,
+                    nullptr);
+    ::close(connection.socket);
+    if (connection.received >= 0)
+        ::close(connection.received);
+    if (connection.shared != nullptr)
+        ::munmap(connection.shared, connection.shared_size);
+    this->connections.erase(id);
+}
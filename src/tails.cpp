@@ -0,0 +1,157 @@
+#include <cstring>
+
+#include "fs.hpp"
+#include "exceptions.hpp"
+
+void FileSystem::load_tail_index()
+{
+    this->tail_space.clear();
+    this->tail_free.clear();
+    if (!(this->superblock.features & FEATURE_TAILS))
+        return;
+    // the space in use is summed up from the fragments of packed inodes
+    const uint32_t block_size = this->superblock.block_size;
+    const uint32_t CHUNK = 1024;
+    std::unordered_map<uint64_t, uint32_t> used;
+    std::vector<Inode> inodes(CHUNK);
+    for (uint32_t first = 0; first < this->superblock.max_file_count;
+         first += CHUNK)
+    {
+        uint32_t count =
+            std::min(CHUNK, this->superblock.max_file_count - first);
+        this->drive->read(inodes_offset +
+                              static_cast<uint64_t>(first) * sizeof(Inode),
+                          reinterpret_cast<char *>(inodes.data()),
+                          count * sizeof(Inode));
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            const Inode &inode = inodes[i];
+            if (!(inode.flags & INODE_USED_MASK) ||
+                !(inode.flags & INODE_TAIL_MASK))
+                continue;
+            uint64_t address =
+                inode.data_pointers[get_file_data_block_count(inode) - 1];
+            auto found =
+                used.emplace(address / block_size, TAIL_HEADER_SIZE).first;
+            found->second += FRAGMENT_HEADER_SIZE + inode.size % block_size;
+        }
+    }
+    for (auto &[tail, used_bytes] : used)
+    {
+        this->tail_free[tail] = block_size - used_bytes;
+        this->tail_space.emplace(block_size - used_bytes, tail);
+    }
+}
+
+void FileSystem::pack_tail(uint32_t index)
+{
+    Inode inode = read_inode(index);
+    const uint32_t block_size = this->superblock.block_size;
+    uint32_t length = inode.size % block_size;
+    uint64_t data_block_count = get_file_data_block_count(inode);
+    // a tail over half a block saves little and leaves tail blocks half
+    // empty, compressed files and directories keep their own blocks
+    if (!(this->superblock.features & FEATURE_TAILS) ||
+        (inode.flags & (INODE_TAIL_MASK | INODE_COMPRESSED_MASK)) ||
+        (inode.flags & INODE_MODE_MASK) != FILE_TYPE::FILE || length == 0 ||
+        length > block_size / 2 ||
+        data_block_count > INODE_PRIMARY_TABLE_SIZE)
+        return;
+
+    uint64_t last = inode.data_pointers[data_block_count - 1];
+    DataBlock data = read_block(last);
+    uint32_t needed = FRAGMENT_HEADER_SIZE + length;
+    std::lock_guard<std::mutex> guard(this->tail_lock);
+    uint64_t tail;
+    uint32_t used;
+    DataBlock block(block_size, 0);
+    auto found = this->tail_space.lower_bound({needed, 0});
+    if (found == this->tail_space.end())
+    {
+        tail = allocate_block(this->groups[inode.group]->first_block);
+        used = TAIL_HEADER_SIZE;
+    }
+    else
+    {
+        tail = found->second;
+        used = block_size - found->first;
+        this->tail_space.erase(found);
+        block = read_block(tail);
+    }
+    uint32_t header[2] = {index, length};
+    std::memcpy(block.data() + used, header, FRAGMENT_HEADER_SIZE);
+    std::memcpy(block.data() + used + FRAGMENT_HEADER_SIZE, data.data(),
+                length);
+    uint64_t address = tail * block_size + used + FRAGMENT_HEADER_SIZE;
+    used += needed;
+    std::memcpy(block.data(), &used, sizeof(uint32_t));
+    write_block(tail, block);
+    this->tail_free[tail] = block_size - used;
+    this->tail_space.emplace(block_size - used, tail);
+
+    release_block(last);
+    inode.data_pointers[data_block_count - 1] = address;
+    inode.flags |= INODE_TAIL_MASK;
+    write_inode(index, inode);
+}
+
+void FileSystem::unpack_tail(Inode &inode)
+{
+    if (!(inode.flags & INODE_TAIL_MASK))
+        return;
+    const uint32_t block_size = this->superblock.block_size;
+    uint64_t data_block_count = get_file_data_block_count(inode);
+    uint64_t address = inode.data_pointers[data_block_count - 1];
+    uint32_t length = inode.size % block_size;
+    DataBlock block(block_size, 0);
+    read_from_block(address / block_size, block.data(), length,
+                    address % block_size);
+    uint64_t goal = (data_block_count > 1)
+                        ? (inode.data_pointers[data_block_count - 2] + 1)
+                        : (this->groups[inode.group]->first_block);
+    uint64_t target = allocate_block(goal);
+    write_block(target, block);
+    remove_fragment(address);
+    inode.data_pointers[data_block_count - 1] = target;
+    inode.flags &= ~INODE_TAIL_MASK;
+}
+
+void FileSystem::remove_fragment(uint64_t address)
+{
+    const uint32_t block_size = this->superblock.block_size;
+    uint64_t tail = address / block_size;
+    uint32_t offset = address % block_size - FRAGMENT_HEADER_SIZE;
+    std::lock_guard<std::mutex> guard(this->tail_lock);
+    DataBlock block = read_block(tail);
+    uint32_t used, header[2];
+    std::memcpy(&used, block.data(), sizeof(uint32_t));
+    std::memcpy(header, block.data() + offset, FRAGMENT_HEADER_SIZE);
+    uint32_t removed = FRAGMENT_HEADER_SIZE + header[1];
+
+    // the fragments behind it move down, their inodes follow
+    for (uint32_t pos = offset + removed; pos < used;)
+    {
+        uint32_t moved[2];
+        std::memcpy(moved, block.data() + pos, FRAGMENT_HEADER_SIZE);
+        Inode owner = read_inode(moved[0]);
+        owner.data_pointers[get_file_data_block_count(owner) - 1] -= removed;
+        write_inode(moved[0], owner);
+        pos += FRAGMENT_HEADER_SIZE + moved[1];
+    }
+    std::memmove(block.data() + offset, block.data() + offset + removed,
+                 used - offset - removed);
+    used -= removed;
+    std::fill(block.begin() + used, block.end(), 0);
+
+    this->tail_space.erase({this->tail_free[tail], tail});
+    if (used == TAIL_HEADER_SIZE)
+    {
+        this->tail_free.erase(tail);
+        release_block(tail);
+        return;
+    }
+    std::memcpy(block.data(), &used, sizeof(uint32_t));
+    write_block(tail, block);
+    this->tail_free[tail] = block_size - used;
+    this->tail_space.emplace(block_size - used, tail);
+}
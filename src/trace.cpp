@@ -0,0 +1,364 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <sstream>
+#include <thread>
+
+#include "fs.hpp"
+#include "exceptions.hpp"
+#include "trace.hpp"
+#include "varint.hpp"
+
+static const uint64_t TRACE_MAGIC = 0x31454341525446; // "FTRACE1"
+// the made up upload files are written this much at a time
+static const uint64_t SOURCE_CHUNK = 64 << 10;
+
+TraceWriter::TraceWriter(const std::string &path)
+    : stream(path, std::ios::binary | std::ios::trunc),
+      origin(std::chrono::steady_clock::now())
+{
+    if (!this->stream)
+        throw TraceFileException();
+    this->stream.write(reinterpret_cast<const char *>(&TRACE_MAGIC),
+                       sizeof(TRACE_MAGIC));
+}
+
+void TraceWriter::put(uint64_t value)
+{
+    char bytes[VARINT_MAX_BYTES];
+    this->stream.write(bytes, encode_varint(value, bytes));
+}
+
+uint64_t TraceWriter::now() const
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - this->origin)
+        .count();
+}
+
+void TraceWriter::append(const TraceRecord &record)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    // calls waiting for each other return out of order, the delta can be
+    // negative
+    int64_t delta = record.start - this->previous_start;
+    this->previous_start = record.start;
+    put(record.operation);
+    put((static_cast<uint64_t>(delta) << 1) ^ (delta >> 63));
+    put(record.duration);
+    put(record.names.size());
+    for (const std::string &name : record.names)
+    {
+        put(name.size());
+        this->stream.write(name.data(), name.size());
+    }
+    put(record.numbers.size());
+    for (uint64_t number : record.numbers)
+        put(number);
+    ++this->count;
+}
+
+uint64_t TraceWriter::record_count()
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    return this->count;
+}
+
+TraceReader::TraceReader(const std::string &path)
+    : stream(path, std::ios::binary)
+{
+    uint64_t magic = 0;
+    this->stream.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    if (!this->stream || magic != TRACE_MAGIC)
+        throw InvalidTraceException();
+}
+
+uint64_t TraceReader::get()
+{
+    uint64_t value;
+    // EOF is -1
+    if (!decode_varint([this]() { return this->stream.get(); }, value))
+        throw InvalidTraceException();
+    return value;
+}
+
+bool TraceReader::next(TraceRecord &record)
+{
+    if (this->stream.peek() == EOF)
+        return false;
+    record.operation = get();
+    if (record.operation >= Metrics::OPERATION_COUNT)
+        throw InvalidTraceException();
+    uint64_t zigzag = get();
+    int64_t delta = static_cast<int64_t>(zigzag >> 1) ^ -(zigzag & 1);
+    record.start = this->previous_start += delta;
+    record.duration = get();
+    record.names.resize(get());
+    for (std::string &name : record.names)
+    {
+        name.resize(get());
+        this->stream.read(name.data(), name.size());
+    }
+    record.numbers.resize(get());
+    for (uint64_t &number : record.numbers)
+        number = get();
+    if (!this->stream)
+        throw InvalidTraceException();
+    return true;
+}
+
+CallTimer::CallTimer(LatencyHistogram &histogram,
+                     std::shared_ptr<TraceWriter> writer,
+                     Metrics::Operation operation,
+                     std::vector<std::string> names,
+                     std::vector<uint64_t> numbers)
+    : timed(histogram), trace(std::move(writer))
+{
+    if (this->trace == nullptr)
+        return;
+    this->record.operation = operation;
+    this->record.start = this->trace->now();
+    this->record.names = std::move(names);
+    this->record.numbers = std::move(numbers);
+}
+
+CallTimer::~CallTimer()
+{
+    if (this->trace == nullptr)
+        return;
+    this->record.duration = this->trace->now() - this->record.start;
+    this->trace->append(this->record);
+}
+
+void CallTimer::add_number(uint64_t number)
+{
+    if (this->trace != nullptr)
+        this->record.numbers.push_back(number);
+}
+
+CallTimer FileSystem::time_call(Metrics::Operation operation,
+                                std::vector<std::string> names,
+                                std::vector<uint64_t> numbers)
+{
+    std::shared_ptr<TraceWriter> writer;
+    {
+        std::lock_guard<std::mutex> guard(this->trace_lock);
+        writer = this->trace;
+    }
+    return CallTimer(this->metrics.operation_latency[operation],
+                     std::move(writer), operation, std::move(names),
+                     std::move(numbers));
+}
+
+std::string FileSystem::trace_start(const std::string &local_name)
+{
+    auto writer = std::make_shared<TraceWriter>(local_name);
+    std::lock_guard<std::mutex> guard(this->trace_lock);
+    this->trace = writer;
+    return "Recording calls to " + local_name + ".\n";
+}
+
+std::string FileSystem::trace_stop()
+{
+    std::shared_ptr<TraceWriter> writer;
+    {
+        std::lock_guard<std::mutex> guard(this->trace_lock);
+        writer.swap(this->trace);
+    }
+    if (writer == nullptr)
+        return "No trace is being recorded.\n";
+    // calls still holding the writer finish their records before it closes
+    std::stringstream result;
+    result << "Recorded " << writer->record_count() << " calls." << std::endl;
+    return result.str();
+}
+
+std::string FileSystem::replay(const std::string &local_name, bool timed,
+                               unsigned replayers)
+{
+    if (replayers == 0)
+        replayers = 1;
+    // fail before any thread starts on a file that is no trace
+    TraceReader check(local_name);
+
+    // uploads read local files of the recorded sizes, made up once
+    std::mutex scratch_lock;
+    std::map<uint64_t, std::string> sources;
+    auto source = [&](uint64_t size)
+    {
+        std::lock_guard<std::mutex> guard(scratch_lock);
+        auto found = sources.find(size);
+        if (found != sources.end())
+            return found->second;
+        std::string path = local_name + ".upload." + std::to_string(size);
+        std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+        std::vector<char> chunk(std::min(size, SOURCE_CHUNK));
+        for (uint64_t done = 0; done < size;)
+        {
+            uint64_t length = std::min(size - done, SOURCE_CHUNK);
+            for (uint64_t i = 0; i < length; ++i)
+                chunk[i] = static_cast<char>((done + i) * 2654435761u >> 13);
+            stream.write(chunk.data(), length);
+            done += length;
+        }
+        sources.emplace(size, path);
+        return path;
+    };
+
+    // with several replayers every one works in a directory of its own and
+    // names its snapshots apart
+    std::atomic<uint64_t> calls{0}, failed{0}, skipped{0};
+    // a broken trace stops its replayer, the caller rethrows
+    std::vector<std::exception_ptr> errors(replayers);
+    auto replayer = [&](unsigned index)
+    {
+        std::string prefix = (replayers > 1)
+                                 ? ("/replay" + std::to_string(index))
+                                 : ("");
+        auto path = [&](const std::string &name)
+        {
+            if (prefix.empty())
+                return name;
+            return prefix + ((name.starts_with("/")) ? ("") : ("/")) + name;
+        };
+        auto snapshot_name = [&](const std::string &name)
+        {
+            if (prefix.empty() || name.empty())
+                return name;
+            return name + ".replay" + std::to_string(index);
+        };
+        std::string output = local_name + ".out." + std::to_string(index);
+        std::vector<char> buffer;
+        TraceReader reader(local_name);
+        auto start = std::chrono::steady_clock::now();
+        TraceRecord record;
+        while (true)
+        {
+            try
+            {
+                if (!reader.next(record))
+                    break;
+            }
+            catch (...)
+            {
+                errors[index] = std::current_exception();
+                break;
+            }
+            if (timed)
+                std::this_thread::sleep_until(
+                    start + std::chrono::nanoseconds(record.start));
+            const std::vector<std::string> &names = record.names;
+            const std::vector<uint64_t> &numbers = record.numbers;
+            auto name = [&](size_t i)
+            { return (i < names.size()) ? (names[i]) : (std::string()); };
+            auto number = [&](size_t i)
+            { return (i < numbers.size()) ? (numbers[i]) : (0); };
+            ++calls;
+            try
+            {
+                switch (record.operation)
+                {
+                case Metrics::UPLOAD:
+                    cplocal(source(number(0)), path(name(0)));
+                    break;
+                case Metrics::EXTRACT:
+                    cpvirtual(path(name(0)), output);
+                    break;
+                case Metrics::READ:
+                    buffer.resize(number(1));
+                    read(path(name(0)), number(0), buffer.data(),
+                         buffer.size());
+                    break;
+                case Metrics::MKDIR:
+                    mkdir(path(name(0)));
+                    break;
+                case Metrics::RM:
+                    rm(path(name(0)));
+                    break;
+                case Metrics::EXTEND:
+                    extend(path(name(0)), number(0));
+                    break;
+                case Metrics::TRUNCATE:
+                    truncate(path(name(0)), number(0));
+                    break;
+                case Metrics::LS:
+                    ls(path(name(0)));
+                    break;
+                case Metrics::DF:
+                    df();
+                    break;
+                case Metrics::SCRUB:
+                    scrub(number(0), number(1));
+                    break;
+                case Metrics::FSCK:
+                    fsck(number(0), number(1));
+                    break;
+                case Metrics::DEFRAG:
+                    defrag(number(0));
+                    break;
+                case Metrics::FILEFRAG:
+                    filefrag(path(name(0)));
+                    break;
+                case Metrics::REFLINK:
+                    reflink(path(name(0)), path(name(1)));
+                    break;
+                case Metrics::SNAPSHOT:
+                    snapshot(snapshot_name(name(0)));
+                    break;
+                case Metrics::SEND:
+                    send(snapshot_name(name(0)), output,
+                         snapshot_name(name(1)));
+                    break;
+                case Metrics::SET_COMPRESSION:
+                    set_compression(path(name(0)), number(0));
+                    break;
+                case Metrics::CLEAN:
+                    clean(number(0));
+                    break;
+                case Metrics::OPEN:
+                    open(path(name(0)));
+                    break;
+                default:
+                    // receive, dump, import and export need files of the
+                    // recording machine, pread and pwrite its inode numbers
+                    ++skipped;
+                    --calls;
+                    break;
+                }
+            }
+            catch (const std::exception &)
+            {
+                ++failed;
+            }
+        }
+        std::remove(output.c_str());
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < replayers && replayers > 1; ++i)
+        mkdir("/replay" + std::to_string(i));
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < replayers; ++i)
+        workers.emplace_back(replayer, i);
+    replayer(0);
+    for (auto &worker : workers)
+        worker.join();
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    for (auto &[size, path] : sources)
+        std::remove(path.c_str());
+    for (auto &error : errors)
+        if (error)
+            std::rethrow_exception(error);
+
+    std::stringstream result;
+    result << "Replayed " << calls << " calls (" << failed << " failed, "
+           << skipped << " skipped) with " << replayers << " replayers in "
+           << seconds << " s";
+    if (seconds > 0)
+        result << " (" << calls / seconds << " calls/s)";
+    result << "." << std::endl;
+    return result.str();
+}
@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fs.hpp"
+#include "exceptions.hpp"
+
+typedef struct
+{
+    std::string local_path;
+    uint32_t index;
+    uint64_t size;
+} TreeFile;
+
+// Runs job on every file with thread_count threads taking them in order,
+// the first failure stops the others and is rethrown.
+static void for_each_file(std::vector<TreeFile> &files, unsigned thread_count,
+                          const std::function<void(TreeFile &)> &job)
+{
+    std::atomic<size_t> next{0};
+    std::exception_ptr error;
+    std::mutex error_lock;
+    auto worker = [&]()
+    {
+        for (size_t i = next++; i < files.size(); i = next++)
+        {
+            try
+            {
+                job(files[i]);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> guard(error_lock);
+                if (!error)
+                    error = std::current_exception();
+                next = files.size();
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < thread_count; ++i)
+        workers.emplace_back(worker);
+    worker();
+    for (auto &thread : workers)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+std::string FileSystem::import_tree(const std::string &local_dir,
+                                    const std::string &virtual_dir,
+                                    unsigned thread_count)
+{
+    auto timed = time_call(Metrics::IMPORT, {local_dir, virtual_dir},
+                           {thread_count});
+    auto paused = pause_cleaner();
+    if (thread_count == 0)
+        thread_count = 1;
+    if (!std::filesystem::is_directory(local_dir))
+        throw NotADirectoryException();
+    auto start = std::chrono::steady_clock::now();
+
+    // The tree is created by one thread, directory by directory, each
+    // entry added to a parent known by its inode instead of by a path.
+    // The superblock and descriptor writes wait until it is complete.
+    bool was_batching = this->batching.exchange(true);
+    auto finish_batch = [&]()
+    {
+        if (was_batching)
+            return;
+        this->batching = false;
+        write_deferred_metadata();
+    };
+    std::vector<TreeFile> files;
+    uint64_t directories = 0, skipped = 0;
+    std::atomic<uint64_t> bytes{0};
+    try
+    {
+        uint32_t root = 0;
+        std::stringstream path(virtual_dir);
+        for (std::string name; std::getline(path, name, '/');)
+        {
+            uint32_t child;
+            if (name.empty())
+                continue;
+            if (!find_entry(root, name, child))
+            {
+                child = create_file(name, root, FILE_TYPE::DIR);
+                ++directories;
+            }
+            else if ((read_inode(child).flags & INODE_MODE_MASK) !=
+                     FILE_TYPE::DIR)
+                throw NotADirectoryException();
+            root = child;
+        }
+
+        std::vector<std::pair<std::filesystem::path, uint32_t>> pending = {
+            {local_dir, root}};
+        while (!pending.empty())
+        {
+            auto [local, parent] = pending.back();
+            pending.pop_back();
+            std::vector<std::filesystem::directory_entry> entries(
+                std::filesystem::directory_iterator(local), {});
+            std::sort(entries.begin(), entries.end());
+            for (const auto &entry : entries)
+            {
+                std::string name = entry.path().filename().string();
+                if (entry.is_directory() && !entry.is_symlink())
+                {
+                    uint32_t child;
+                    if (!find_entry(parent, name, child))
+                    {
+                        child = create_file(name, parent, FILE_TYPE::DIR);
+                        ++directories;
+                    }
+                    pending.emplace_back(entry.path(), child);
+                }
+                else if (entry.is_regular_file() && !entry.is_symlink())
+                    files.push_back({entry.path().string(),
+                                     create_file(name, parent,
+                                                 FILE_TYPE::FILE),
+                                     entry.file_size()});
+                else
+                    ++skipped;
+            }
+        }
+
+        // the contents go in parallel, every file written by one thread
+        for_each_file(
+            files, thread_count,
+            [&](TreeFile &file)
+            {
+                int local = ::open(file.local_path.c_str(), O_RDONLY);
+                if (local < 0)
+                    throw LocalFileException();
+                try
+                {
+                    copy_file_in(file.index, local, file.size);
+                }
+                catch (...)
+                {
+                    ::close(local);
+                    throw;
+                }
+                ::close(local);
+                bytes += file.size;
+            });
+    }
+    catch (...)
+    {
+        finish_batch();
+        throw;
+    }
+    finish_batch();
+    timed.add_number(bytes);
+
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    double megabytes = static_cast<double>(bytes) / (1024 * 1024);
+    std::stringstream result;
+    result << "Imported " << files.size() << " files (" << megabytes
+           << " MiB) and " << directories << " directories in " << seconds
+           << " s using " << thread_count << " threads";
+    if (seconds > 0)
+        result << " (" << megabytes / seconds << " MiB/s, "
+               << files.size() / seconds << " files/s)";
+    result << ", " << skipped << " skipped." << std::endl;
+    return result.str();
+}
+
+std::string FileSystem::export_tree(const std::string &virtual_dir,
+                                    const std::string &local_dir,
+                                    unsigned thread_count)
+{
+    auto timed = time_call(Metrics::EXPORT, {virtual_dir, local_dir},
+                           {thread_count});
+    auto paused = pause_cleaner(Access::READ);
+    if (thread_count == 0)
+        thread_count = 1;
+    auto start = std::chrono::steady_clock::now();
+    uint32_t root = find_file_in_dir((virtual_dir.empty()) ? ("/")
+                                                           : (virtual_dir));
+    if ((read_inode(root).flags & INODE_MODE_MASK) != FILE_TYPE::DIR)
+        throw NotADirectoryException();
+
+    // the local directories are made while the tree is walked, the files
+    // are only collected
+    std::vector<TreeFile> files;
+    std::vector<uint64_t> first_blocks;
+    uint64_t directories = 0;
+    std::vector<std::pair<std::filesystem::path, uint32_t>> pending = {
+        {local_dir, root}};
+    while (!pending.empty())
+    {
+        auto [local, index] = pending.back();
+        pending.pop_back();
+        std::filesystem::create_directories(local);
+        ++directories;
+        for (auto &[name, child] : read_directory(index))
+        {
+            if (name == "." || name == "..")
+                continue;
+            Inode inode = read_inode(child);
+            if ((inode.flags & INODE_MODE_MASK) == FILE_TYPE::DIR)
+            {
+                pending.emplace_back(local / name, child);
+                continue;
+            }
+            std::vector<Extent> extents = get_file_extents(inode);
+            files.push_back({(local / name).string(), child, inode.size});
+            first_blocks.push_back((extents.empty()) ? (0)
+                                                     : (extents[0].start));
+        }
+    }
+
+    // taken in the order of their first blocks the files are read with
+    // the drive moving forward, even with several threads at it
+    std::vector<size_t> order(files.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                     { return first_blocks[a] < first_blocks[b]; });
+    std::vector<TreeFile> sorted;
+    sorted.reserve(files.size());
+    for (size_t i : order)
+        sorted.push_back(std::move(files[i]));
+
+    std::atomic<uint64_t> bytes{0};
+    for_each_file(
+        sorted, thread_count,
+        [&](TreeFile &file)
+        {
+            int local = ::open(file.local_path.c_str(),
+                               O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (local < 0)
+                throw LocalFileException();
+            try
+            {
+                copy_file_out(file.index, read_inode(file.index), local);
+            }
+            catch (...)
+            {
+                ::close(local);
+                throw;
+            }
+            ::close(local);
+            bytes += file.size;
+        });
+    timed.add_number(bytes);
+
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    double megabytes = static_cast<double>(bytes) / (1024 * 1024);
+    std::stringstream result;
+    result << "Exported " << sorted.size() << " files (" << megabytes
+           << " MiB) and " << directories << " directories in " << seconds
+           << " s using " << thread_count << " threads";
+    if (seconds > 0)
+        result << " (" << megabytes / seconds << " MiB/s, "
+               << sorted.size() / seconds << " files/s)";
+    result << "." << std::endl;
+    return result.str();
+}